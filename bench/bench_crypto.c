@@ -0,0 +1,140 @@
+/**
+  bench_crypto.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+   Measures crypto_encrypt and crypto_decrypt alone, on packets of a few
+   sizes, with the buffer layout the datapath uses.
+*/
+
+#include "shadowvpn.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+static void usage() {
+  printf("usage: bench_crypto [-n packets] [-j] [size ...]\n"
+         "\n"
+         "  -n packets  packets per size and direction, default 1000000\n"
+         "  -j          print results as JSON, one line per size\n"
+         "  size        payload sizes, default 64 512 1400\n");
+}
+
+static int bench_size(size_t size, uint64_t npackets, int json) {
+  size_t len = SHADOWVPN_USERTOKEN_LEN + size;
+  unsigned char *plain = calloc(1, SHADOWVPN_ZERO_BYTES + len);
+  unsigned char *cipher = calloc(1, SHADOWVPN_ZERO_BYTES + len);
+  unsigned char *out = calloc(1, SHADOWVPN_ZERO_BYTES + len);
+  uint64_t i, start, encrypt_ns, decrypt_ns;
+  uint64_t failures = 0;
+  double encrypt_pps, decrypt_pps;
+
+  for (i = 0; i < len; i++) {
+    plain[SHADOWVPN_ZERO_BYTES + i] = i;
+  }
+
+  start = latency_now_ns();
+  for (i = 0; i < npackets; i++) {
+    crypto_encrypt(cipher, plain, len);
+  }
+  encrypt_ns = latency_now_ns() - start;
+
+  start = latency_now_ns();
+  for (i = 0; i < npackets; i++) {
+    if (0 != crypto_decrypt(out, cipher, len))
+      failures++;
+  }
+  decrypt_ns = latency_now_ns() - start;
+
+  if (failures ||
+      memcmp(out + SHADOWVPN_ZERO_BYTES, plain + SHADOWVPN_ZERO_BYTES, len)) {
+    errf("%llu of %llu packets of %lu bytes failed to decrypt",
+         (unsigned long long)failures, (unsigned long long)npackets,
+         (unsigned long)size);
+    return -1;
+  }
+
+  encrypt_pps = npackets * 1e9 / encrypt_ns;
+  decrypt_pps = npackets * 1e9 / decrypt_ns;
+  if (json) {
+    printf("{\"name\": \"crypto\", \"size\": %lu, \"packets\": %llu, "
+           "\"encrypt_pps\": %.0f, \"encrypt_mbps\": %.1f, "
+           "\"decrypt_pps\": %.0f, \"decrypt_mbps\": %.1f}\n",
+           (unsigned long)size, (unsigned long long)npackets,
+           encrypt_pps, encrypt_pps * size * 8 / 1e6,
+           decrypt_pps, decrypt_pps * size * 8 / 1e6);
+  } else {
+    printf("%5lu bytes: encrypt %.0f ns, %.0f Mbps; "
+           "decrypt %.0f ns, %.0f Mbps\n", (unsigned long)size,
+           (double)encrypt_ns / npackets, encrypt_pps * size * 8 / 1e6,
+           (double)decrypt_ns / npackets, decrypt_pps * size * 8 / 1e6);
+  }
+  free(plain);
+  free(cipher);
+  free(out);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  static const size_t default_sizes[] = {64, 512, 1400};
+  uint64_t npackets = 1000000;
+  int json = 0, c, i;
+
+  while ((c = getopt(argc, argv, "n:jh")) != -1) {
+    switch (c) {
+      case 'n':
+        npackets = strtoull(optarg, NULL, 10);
+        break;
+      case 'j':
+        json = 1;
+        break;
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (npackets == 0) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  if (-1 == crypto_init() ||
+      -1 == crypto_set_password("bench", strlen("bench"))) {
+    errf("can not initialize crypto");
+    return EXIT_FAILURE;
+  }
+
+  if (optind == argc) {
+    for (i = 0; i < 3; i++) {
+      if (-1 == bench_size(default_sizes[i], npackets, json))
+        return EXIT_FAILURE;
+    }
+    return 0;
+  }
+  for (i = optind; i < argc; i++) {
+    int size = atoi(argv[i]);
+    if (size <= 0 || size > 65535) {
+      usage();
+      return EXIT_FAILURE;
+    }
+    if (-1 == bench_size(size, npackets, json))
+      return EXIT_FAILURE;
+  }
+  return 0;
+}
@@ -0,0 +1,380 @@
+/**
+  bench_nat.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+   Measures nat_fix_upstream and nat_fix_downstream with a synthetic user
+   population, so that NAT table changes can be compared with uthash.
+
+   Packets are IPv4 TCP and UDP headers from users picked uniformly or by a
+   Zipf distribution, where a few users send most of the traffic. Each
+   packet is copied from a pregenerated pool before it is translated, as
+   the datapath would read it from tun or decrypt it.
+*/
+
+// before shadowvpn.h, whose logf macro would clash with math.h
+#include <math.h>
+
+#include "shadowvpn.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+
+#ifdef TARGET_LINUX
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/* size of the pregenerated packet pool */
+#define POOL_SIZE 65536
+/* token + IPv4 + TCP + a little payload */
+#define PKT_LEN (SHADOWVPN_USERTOKEN_LEN + 20 + 20 + 24)
+
+typedef struct {
+  unsigned char buf[PKT_LEN];
+  size_t len;
+} bench_pkt_t;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng() {
+  // xorshift64*
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+static double rng_double() {
+  return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static long max_rss_kb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef TARGET_DARWIN
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+/* cache misses through perf, -1 where not available */
+static int cache_counter_open() {
+#ifdef TARGET_LINUX
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static void cache_counter_start(int fd) {
+#ifdef TARGET_LINUX
+  if (fd != -1) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+static int64_t cache_counter_stop(int fd) {
+  int64_t count = -1;
+#ifdef TARGET_LINUX
+  if (fd != -1) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (sizeof(count) != read(fd, &count, sizeof(count)))
+      count = -1;
+  }
+#endif
+  return count;
+}
+
+/* rank -> user, so that popular users are not next to each other */
+static uint32_t *shuffled_users(int nusers) {
+  uint32_t *users = malloc(nusers * sizeof(uint32_t));
+  int i;
+  for (i = 0; i < nusers; i++) {
+    users[i] = i;
+  }
+  for (i = nusers - 1; i > 0; i--) {
+    int j = rng() % (i + 1);
+    uint32_t t = users[i];
+    users[i] = users[j];
+    users[j] = t;
+  }
+  return users;
+}
+
+/* cumulative distribution of Zipf(s) over nusers ranks */
+static double *zipf_cdf(int nusers, double s) {
+  double *cdf = malloc(nusers * sizeof(double));
+  double sum = 0;
+  int i;
+  for (i = 0; i < nusers; i++) {
+    sum += 1.0 / pow(i + 1, s);
+    cdf[i] = sum;
+  }
+  for (i = 0; i < nusers; i++) {
+    cdf[i] /= sum;
+  }
+  return cdf;
+}
+
+static int zipf_rank(const double *cdf, int nusers) {
+  double u = rng_double();
+  int lo = 0, hi = nusers - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static uint16_t ip_checksum(const unsigned char *hdr) {
+  uint32_t sum = 0;
+  int i;
+  for (i = 0; i < 20; i += 2) {
+    sum += (hdr[i] << 8) | hdr[i + 1];
+  }
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return htons(~sum & 0xffff);
+}
+
+/*
+   upstream packets come from the user's own address, downstream packets
+   go to the address NAT assigned to the user
+*/
+static void make_packet(bench_pkt_t *pkt, shadowvpn_args_t *args, int user,
+                        int upstream) {
+  unsigned char *ip = pkt->buf + SHADOWVPN_USERTOKEN_LEN;
+  unsigned char *l4 = ip + 20;
+  uint32_t user_ip = htonl(upstream ? 0xc0a80002 : args->netip + user + 1);
+  uint32_t remote_ip = htonl(0x08080000 | (rng() & 0xffff));
+  uint16_t user_port = htons(1024 + rng() % 60000);
+  uint16_t remote_port = htons(rng() & 1 ? 443 : 53);
+  int tcp = rng() % 4 != 0;
+  uint16_t sum;
+
+  memset(pkt->buf, 0, sizeof(pkt->buf));
+  memcpy(pkt->buf, args->user_tokens[user], SHADOWVPN_USERTOKEN_LEN);
+  pkt->len = PKT_LEN;
+  ip[0] = 0x45;
+  ip[2] = (PKT_LEN - SHADOWVPN_USERTOKEN_LEN) >> 8;
+  ip[3] = (PKT_LEN - SHADOWVPN_USERTOKEN_LEN) & 0xff;
+  ip[8] = 64;
+  ip[9] = tcp ? 6 : 17;
+  memcpy(ip + 12, upstream ? &user_ip : &remote_ip, 4);
+  memcpy(ip + 16, upstream ? &remote_ip : &user_ip, 4);
+  sum = ip_checksum(ip);
+  memcpy(ip + 10, &sum, 2);
+  memcpy(l4, upstream ? &user_port : &remote_port, 2);
+  memcpy(l4 + 2, upstream ? &remote_port : &user_port, 2);
+  if (tcp) {
+    l4[12] = 0x50;
+    l4[13] = 0x10;
+    // any checksum will do, NAT only adjusts it
+    l4[16] = rng() & 0xff;
+  } else {
+    l4[5] = PKT_LEN - SHADOWVPN_USERTOKEN_LEN - 20;
+    l4[6] = 0x12;
+  }
+}
+
+typedef struct {
+  double ns_per_packet;
+  int64_t cache_misses;
+  uint64_t failures;
+} phase_result_t;
+
+static phase_result_t run_phase(nat_ctx_t *nat, bench_pkt_t *pool,
+                                uint64_t npackets, int upstream,
+                                int perf_fd) {
+  bench_pkt_t work;
+  struct sockaddr_in addr;
+  client_info_t *client;
+  phase_result_t result;
+  uint64_t i, start;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(1123);
+  addr.sin_addr.s_addr = inet_addr("192.0.2.1");
+  result.failures = 0;
+
+  cache_counter_start(perf_fd);
+  start = latency_now_ns();
+  for (i = 0; i < npackets; i++) {
+    bench_pkt_t *pkt = &pool[i & (POOL_SIZE - 1)];
+    memcpy(work.buf, pkt->buf, pkt->len);
+    if (upstream) {
+      if (0 != nat_fix_upstream(nat, work.buf, pkt->len,
+                                (struct sockaddr *)&addr, sizeof(addr)))
+        result.failures++;
+    } else {
+      if (0 != nat_fix_downstream(nat, work.buf, pkt->len, &client))
+        result.failures++;
+    }
+  }
+  result.ns_per_packet = (double)(latency_now_ns() - start) / npackets;
+  result.cache_misses = cache_counter_stop(perf_fd);
+  return result;
+}
+
+static void usage() {
+  printf("usage: bench_nat [-u users] [-z exponent] [-n packets] [-j]\n"
+         "\n"
+         "  -u users     number of synthetic users, 1 to 1000000, "
+         "default 1000\n"
+         "  -z exponent  pick users by Zipf(exponent) instead of uniformly\n"
+         "  -n packets   packets per direction, default 10000000\n"
+         "  -j           print results as JSON\n");
+}
+
+int main(int argc, char **argv) {
+  shadowvpn_args_t args;
+  nat_ctx_t nat;
+  bench_pkt_t *up_pool, *down_pool;
+  phase_result_t up, down;
+  uint32_t *users;
+  double *cdf = NULL;
+  double zipf = 0;
+  uint64_t npackets = 10000000;
+  int nusers = 1000, json = 0, perf_fd;
+  long rss_before, rss_after;
+  int c, i;
+
+  while ((c = getopt(argc, argv, "u:z:n:jh")) != -1) {
+    switch (c) {
+      case 'u':
+        nusers = atoi(optarg);
+        break;
+      case 'z':
+        zipf = atof(optarg);
+        break;
+      case 'n':
+        npackets = strtoull(optarg, NULL, 10);
+        break;
+      case 'j':
+        json = 1;
+        break;
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (nusers < 1 || nusers > 1000000 || npackets == 0 || zipf < 0) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  bzero(&args, sizeof(args));
+  args.mode = SHADOWVPN_MODE_SERVER;
+  // 10.0.0.0/8 has room for a million users
+  args.netip = 0x0a000001;
+  args.user_tokens_len = nusers;
+  args.user_tokens = calloc(nusers, SHADOWVPN_USERTOKEN_LEN);
+  for (i = 0; i < nusers; i++) {
+    uint64_t token = rng();
+    memcpy(args.user_tokens[i], &token, SHADOWVPN_USERTOKEN_LEN);
+  }
+
+  rss_before = max_rss_kb();
+  if (-1 == nat_init(&nat, &args)) {
+    errf("can not initialize NAT");
+    return EXIT_FAILURE;
+  }
+  rss_after = max_rss_kb();
+
+  users = shuffled_users(nusers);
+  if (zipf > 0)
+    cdf = zipf_cdf(nusers, zipf);
+  up_pool = malloc(POOL_SIZE * sizeof(bench_pkt_t));
+  down_pool = malloc(POOL_SIZE * sizeof(bench_pkt_t));
+  for (i = 0; i < POOL_SIZE; i++) {
+    int rank = cdf ? zipf_rank(cdf, nusers) : (int)(rng() % nusers);
+    make_packet(&up_pool[i], &args, users[rank], 1);
+    rank = cdf ? zipf_rank(cdf, nusers) : (int)(rng() % nusers);
+    make_packet(&down_pool[i], &args, users[rank], 0);
+  }
+
+  perf_fd = cache_counter_open();
+  // the first packet of each user takes the connect path, keep it out
+  run_phase(&nat, up_pool, POOL_SIZE, 1, -1);
+  up = run_phase(&nat, up_pool, npackets, 1, perf_fd);
+  down = run_phase(&nat, down_pool, npackets, 0, perf_fd);
+
+  if (json) {
+    printf("{\"name\": \"nat\", \"users\": %d, \"distribution\": \"%s\", "
+           "\"zipf\": %.2f, \"packets\": %llu, "
+           "\"upstream_ns_per_packet\": %.2f, "
+           "\"downstream_ns_per_packet\": %.2f, "
+           "\"upstream_cache_misses_per_packet\": %.3f, "
+           "\"downstream_cache_misses_per_packet\": %.3f, "
+           "\"table_kb\": %ld, \"failures\": %llu}\n",
+           nusers, cdf ? "zipf" : "uniform", zipf,
+           (unsigned long long)npackets, up.ns_per_packet,
+           down.ns_per_packet,
+           up.cache_misses < 0 ? -1.0 : (double)up.cache_misses / npackets,
+           down.cache_misses < 0 ? -1.0 :
+           (double)down.cache_misses / npackets,
+           rss_after - rss_before,
+           (unsigned long long)(up.failures + down.failures));
+  } else {
+    printf("users:          %d (%s", nusers, cdf ? "zipf" : "uniform");
+    if (cdf)
+      printf(" s=%.2f", zipf);
+    printf(")\n");
+    // small tables fit in memory malloc already had, so RSS stays flat
+    printf("table memory:   %ld KB RSS, %lu KB of client_info_t "
+           "(%lu bytes each)\n", rss_after - rss_before,
+           (unsigned long)(nusers * sizeof(client_info_t) / 1024),
+           (unsigned long)sizeof(client_info_t));
+    printf("upstream:       %.1f ns/packet, %.2f Mpps",
+           up.ns_per_packet, 1e3 / up.ns_per_packet);
+    if (up.cache_misses >= 0)
+      printf(", %.3f cache misses/packet",
+             (double)up.cache_misses / npackets);
+    printf("\n");
+    printf("downstream:     %.1f ns/packet, %.2f Mpps",
+           down.ns_per_packet, 1e3 / down.ns_per_packet);
+    if (down.cache_misses >= 0)
+      printf(", %.3f cache misses/packet",
+             (double)down.cache_misses / npackets);
+    printf("\n");
+    if (up.failures + down.failures)
+      printf("failures:       %llu\n",
+             (unsigned long long)(up.failures + down.failures));
+  }
+  return up.failures + down.failures ? EXIT_FAILURE : 0;
+}
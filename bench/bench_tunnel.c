@@ -0,0 +1,285 @@
+/**
+  bench_tunnel.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+   Runs a client and a server vpn_run() loop in one process over the mock
+   I/O backend, with a relay thread standing in for the network, and
+   measures packets/sec from the client's tun to the server's tun, plus
+   the RTT of one packet at a time through both loops.
+
+   It covers everything between tun and UDP: select, batching, the send
+   queue, crypto and the bookkeeping around them, without root or a tun
+   device. The socketpairs cost about as much as the kernel would, so
+   compare results with each other rather than with a real link.
+*/
+
+#include "shadowvpn.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+/* a receiver that sees nothing for this long gives up */
+#define IDLE_TIMEOUT_MS 1000
+
+/*
+   packets the sender keeps in flight: flooding the loops would only
+   measure how fast they drop packets, and make results vary a lot
+*/
+#define WINDOW 128
+
+/* a sender that sees no progress for this long counts the window lost */
+#define WINDOW_TIMEOUT_NS 10000000
+
+/* round trips for the RTT */
+#define RTT_ROUNDS 1000
+
+typedef struct {
+  vpn_ctx_t client;
+  vpn_ctx_t server;
+  vpn_io_mock_t client_io;
+  vpn_io_mock_t server_io;
+  shadowvpn_args_t client_args;
+  shadowvpn_args_t server_args;
+  int relay_pipe[2];
+  size_t size;
+  uint64_t npackets;
+  // written by the receiver, read by the sender
+  uint64_t received;
+} tunnel_t;
+
+static void *run_vpn(void *ctx) {
+  vpn_run(ctx);
+  return NULL;
+}
+
+static void *relay(void *arg) {
+  tunnel_t *t = arg;
+  int a = t->client_io.udp_peers[0], b = t->server_io.udp_peers[0];
+  int stop = t->relay_pipe[0];
+  int maxfd = a > b ? a : b;
+  unsigned char buf[65536];
+  if (stop > maxfd)
+    maxfd = stop;
+  while (1) {
+    fd_set readset;
+    FD_ZERO(&readset);
+    FD_SET(a, &readset);
+    FD_SET(b, &readset);
+    FD_SET(stop, &readset);
+    if (-1 == select(maxfd + 1, &readset, NULL, NULL, NULL)) {
+      if (errno == EINTR)
+        continue;
+      err("select");
+      break;
+    }
+    if (FD_ISSET(stop, &readset))
+      break;
+    if (FD_ISSET(a, &readset)) {
+      ssize_t r = recv(a, buf, sizeof(buf), 0);
+      if (r > 0)
+        send(b, buf, r, 0);
+    }
+    if (FD_ISSET(b, &readset)) {
+      ssize_t r = recv(b, buf, sizeof(buf), 0);
+      if (r > 0)
+        send(a, buf, r, 0);
+    }
+  }
+  return NULL;
+}
+
+static void *send_packets(void *arg) {
+  tunnel_t *t = arg;
+  unsigned char *pkt = calloc(1, t->size);
+  uint64_t i, lost = 0;
+  pkt[0] = 0x45;
+  pkt[2] = t->size >> 8;
+  pkt[3] = t->size & 0xff;
+  pkt[9] = 17;
+  for (i = 0; i < t->npackets; i++) {
+    if (i - lost >= STATS_LOAD(t->received) + WINDOW) {
+      uint64_t start = latency_now_ns();
+      while (i - lost >= STATS_LOAD(t->received) + WINDOW) {
+        if (latency_now_ns() - start > WINDOW_TIMEOUT_NS) {
+          lost = i - STATS_LOAD(t->received);
+          break;
+        }
+        usleep(10);
+      }
+    }
+    memcpy(pkt + 20, &i, sizeof(i));
+    if (-1 == send(t->client_io.tun_peer, pkt, t->size, 0)) {
+      err("send");
+      break;
+    }
+  }
+  free(pkt);
+  return NULL;
+}
+
+/* wait until fd is readable, return 0 on timeout */
+static int wait_readable(int fd, int timeout_ms) {
+  struct timeval tv;
+  fd_set readset;
+  FD_ZERO(&readset);
+  FD_SET(fd, &readset);
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  return select(fd + 1, &readset, NULL, NULL, &tv) > 0;
+}
+
+static uint64_t measure_throughput(tunnel_t *t, uint64_t *elapsed_ns) {
+  unsigned char buf[65536];
+  pthread_t sender;
+  uint64_t start, last;
+
+  start = last = latency_now_ns();
+  pthread_create(&sender, NULL, send_packets, t);
+  while (t->received < t->npackets &&
+         wait_readable(t->server_io.tun_peer, IDLE_TIMEOUT_MS)) {
+    if (recv(t->server_io.tun_peer, buf, sizeof(buf), 0) == (ssize_t)t->size) {
+      STATS_ADD(t->received, 1);
+      last = latency_now_ns();
+    }
+  }
+  pthread_join(sender, NULL);
+  *elapsed_ns = last - start;
+  return t->received;
+}
+
+static int measure_rtt(tunnel_t *t, latency_hist_t *hist) {
+  unsigned char pkt[64], buf[65536];
+  int i;
+  bzero(pkt, sizeof(pkt));
+  pkt[0] = 0x45;
+  pkt[3] = sizeof(pkt);
+  pkt[9] = 17;
+  for (i = 0; i < RTT_ROUNDS; i++) {
+    uint64_t start = latency_now_ns();
+    send(t->client_io.tun_peer, pkt, sizeof(pkt), 0);
+    if (!wait_readable(t->server_io.tun_peer, IDLE_TIMEOUT_MS) ||
+        recv(t->server_io.tun_peer, buf, sizeof(buf), 0) <= 0)
+      return -1;
+    send(t->server_io.tun_peer, pkt, sizeof(pkt), 0);
+    if (!wait_readable(t->client_io.tun_peer, IDLE_TIMEOUT_MS) ||
+        recv(t->client_io.tun_peer, buf, sizeof(buf), 0) <= 0)
+      return -1;
+    latency_hist_record(hist, latency_now_ns() - start);
+  }
+  return 0;
+}
+
+static void usage() {
+  printf("usage: bench_tunnel [-s size] [-n packets] [-j]\n"
+         "\n"
+         "  -s size     IP packet size, default 1400\n"
+         "  -n packets  packets to send, default 200000\n"
+         "  -j          print results as JSON\n");
+}
+
+int main(int argc, char **argv) {
+  static tunnel_t t;
+  static latency_hist_t rtt;
+  pthread_t client_thread, server_thread, relay_thread;
+  uint64_t received, elapsed_ns;
+  double pps, loss;
+  int json = 0, c, r;
+
+  t.size = 1400;
+  t.npackets = 200000;
+  while ((c = getopt(argc, argv, "s:n:jh")) != -1) {
+    switch (c) {
+      case 's':
+        t.size = atoi(optarg);
+        break;
+      case 'n':
+        t.npackets = strtoull(optarg, NULL, 10);
+        break;
+      case 'j':
+        json = 1;
+        break;
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (t.size < 28 || t.size > 1440 || t.npackets == 0) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  if (-1 == crypto_init() ||
+      -1 == crypto_set_password("bench", strlen("bench"))) {
+    errf("can not initialize crypto");
+    return EXIT_FAILURE;
+  }
+  t.client_args.mode = SHADOWVPN_MODE_CLIENT;
+  t.client_args.mtu = 1440;
+  t.client_args.concurrency = 1;
+  t.server_args = t.client_args;
+  t.server_args.mode = SHADOWVPN_MODE_SERVER;
+  if (-1 == vpn_ctx_init_mock(&t.client, &t.client_args, &t.client_io) ||
+      -1 == vpn_ctx_init_mock(&t.server, &t.server_args, &t.server_io) ||
+      -1 == pipe(t.relay_pipe)) {
+    errf("can not set up the tunnel");
+    return EXIT_FAILURE;
+  }
+  pthread_create(&client_thread, NULL, run_vpn, &t.client);
+  pthread_create(&server_thread, NULL, run_vpn, &t.server);
+  pthread_create(&relay_thread, NULL, relay, &t);
+
+  // the first packet also tells the server where the client is
+  r = measure_rtt(&t, &rtt);
+  if (r == 0)
+    received = measure_throughput(&t, &elapsed_ns);
+
+  vpn_stop(&t.client);
+  vpn_stop(&t.server);
+  if (-1 == write(t.relay_pipe[1], "", 1))
+    err("write");
+  pthread_join(client_thread, NULL);
+  pthread_join(server_thread, NULL);
+  pthread_join(relay_thread, NULL);
+
+  if (r != 0) {
+    errf("packets did not make it through the tunnel");
+    return EXIT_FAILURE;
+  }
+  pps = elapsed_ns ? received * 1e9 / elapsed_ns : 0;
+  loss = 100.0 * (t.npackets - received) / t.npackets;
+  if (json) {
+    printf("{\"name\": \"tunnel\", \"size\": %lu, \"packets\": %llu, "
+           "\"pps\": %.0f, \"mbps\": %.1f, \"loss_pct\": %.3f, "
+           "\"rtt_p50_us\": %.1f, \"rtt_p99_us\": %.1f}\n",
+           (unsigned long)t.size, (unsigned long long)t.npackets, pps,
+           pps * t.size * 8 / 1e6, loss,
+           latency_quantile(&rtt, 0.5) / 1e3,
+           latency_quantile(&rtt, 0.99) / 1e3);
+  } else {
+    printf("%lu byte packets: %.0f pps, %.0f Mbps, %.3f%% loss\n",
+           (unsigned long)t.size, pps, pps * t.size * 8 / 1e6, loss);
+    printf("rtt: p50 %.1f us, p99 %.1f us\n",
+           latency_quantile(&rtt, 0.5) / 1e3,
+           latency_quantile(&rtt, 0.99) / 1e3);
+  }
+  return 0;
+}
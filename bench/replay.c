@@ -0,0 +1,492 @@
+/**
+  replay.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+   Replays a packet trace through the datapath in-process, without tun or
+   sockets, and reports throughput.
+
+   Each packet goes the way a packet from a user and its reply would go:
+
+     client: add user token, encrypt
+     server: decrypt, nat_fix_upstream
+             (reply: source and destination swapped)
+     server: nat_fix_downstream, encrypt
+     client: decrypt
+
+   Both pcap and pcapng are read, so captures from /capture.pcapng or
+   tcpdump can be replayed as is.
+*/
+
+#include "shadowvpn.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define REPLAY_MAX_PACKET 65535
+
+/* pcap link types we can find IP packets in */
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW_OLD 12
+#define LINKTYPE_LOOP 108
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+
+typedef struct {
+  unsigned char *data;
+  size_t len;
+  // index of the synthetic user sending it
+  int user;
+} replay_pkt_t;
+
+typedef struct {
+  replay_pkt_t *pkts;
+  size_t npkts;
+  size_t cap;
+  size_t bytes;
+  size_t skipped;
+} trace_t;
+
+#ifdef __GLIBC__
+/* count allocations made while replaying, the datapath should make none */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t nallocs;
+
+void *malloc(size_t size) {
+  nallocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  nallocs++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  nallocs++;
+  return __libc_realloc(ptr, size);
+}
+#define HAVE_ALLOC_COUNT 1
+#endif
+
+static uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+/* find the IP packet in a frame, return its offset or -1 */
+static int ip_offset(int linktype, const unsigned char *frame, size_t len) {
+  int off;
+  switch (linktype) {
+    case LINKTYPE_RAW:
+    case LINKTYPE_RAW_OLD:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+      off = 0;
+      break;
+    case LINKTYPE_NULL:
+    case LINKTYPE_LOOP:
+      off = 4;
+      break;
+    case LINKTYPE_ETHERNET:
+      off = 14;
+      // skip one VLAN tag
+      if (len >= 18 && frame[12] == 0x81 && frame[13] == 0x00)
+        off = 18;
+      break;
+    case LINKTYPE_LINUX_SLL:
+      off = 16;
+      break;
+    default:
+      return -1;
+  }
+  if (len < (size_t)off + 20)
+    return -1;
+  if ((frame[off] >> 4) != 4 && (frame[off] >> 4) != 6)
+    return -1;
+  return off;
+}
+
+static void trace_add(trace_t *trace, int linktype, const unsigned char *frame,
+                      size_t len) {
+  replay_pkt_t *pkt;
+  int off = ip_offset(linktype, frame, len);
+  if (off < 0 || len - off > REPLAY_MAX_PACKET) {
+    trace->skipped++;
+    return;
+  }
+  if (trace->npkts == trace->cap) {
+    trace->cap = trace->cap ? trace->cap * 2 : 1024;
+    trace->pkts = realloc(trace->pkts, trace->cap * sizeof(replay_pkt_t));
+  }
+  pkt = &trace->pkts[trace->npkts++];
+  pkt->len = len - off;
+  pkt->data = malloc(pkt->len);
+  memcpy(pkt->data, frame + off, pkt->len);
+  trace->bytes += pkt->len;
+}
+
+static uint32_t get32(const unsigned char *p, int swap) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t get16(const unsigned char *p, int swap) {
+  uint16_t v;
+  memcpy(&v, p, 2);
+  return swap ? __builtin_bswap16(v) : v;
+}
+
+static int read_pcap(trace_t *trace, const unsigned char *d, size_t len) {
+  uint32_t magic = get32(d, 0);
+  int swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+  int linktype;
+  size_t off = 24;
+
+  if (len < 24)
+    return -1;
+  linktype = get32(d + 20, swap);
+  while (off + 16 <= len) {
+    uint32_t caplen = get32(d + off + 8, swap);
+    if (off + 16 + caplen > len)
+      break;
+    trace_add(trace, linktype, d + off + 16, caplen);
+    off += 16 + caplen;
+  }
+  return 0;
+}
+
+static int read_pcapng(trace_t *trace, const unsigned char *d, size_t len) {
+  int linktypes[64];
+  int nifaces = 0, swap = 0;
+  size_t off = 0;
+
+  while (off + 12 <= len) {
+    uint32_t type = get32(d + off, swap);
+    uint32_t block_len;
+    if (type == 0x0A0D0D0A) {
+      swap = get32(d + off + 8, 0) != 0x1A2B3C4D;
+      nifaces = 0;
+      type = get32(d + off, swap);
+    }
+    block_len = get32(d + off + 4, swap);
+    if (block_len < 12 || off + block_len > len)
+      return -1;
+    if (type == 1 && nifaces < 64) {
+      linktypes[nifaces++] = get16(d + off + 8, swap);
+    } else if (type == 6 && block_len >= 28) {
+      uint32_t iface = get32(d + off + 8, swap);
+      uint32_t caplen = get32(d + off + 20, swap);
+      if (iface < (uint32_t)nifaces && caplen <= block_len - 28)
+        trace_add(trace, linktypes[iface], d + off + 28, caplen);
+    } else if (type == 3 && nifaces > 0 && block_len >= 16) {
+      // simple packet block, always interface 0
+      uint32_t caplen = block_len - 16;
+      uint32_t orig = get32(d + off + 8, swap);
+      trace_add(trace, linktypes[0], d + off + 12,
+                orig < caplen ? orig : caplen);
+    }
+    off += block_len;
+  }
+  return 0;
+}
+
+static int read_trace(trace_t *trace, const char *path) {
+  FILE *fp;
+  unsigned char *d;
+  long len;
+  uint32_t magic;
+  int r;
+
+  if (NULL == (fp = fopen(path, "rb"))) {
+    err("fopen");
+    return -1;
+  }
+  fseek(fp, 0, SEEK_END);
+  len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  d = malloc(len);
+  if (len < 4 || (size_t)len != fread(d, 1, len, fp)) {
+    errf("can not read %s", path);
+    fclose(fp);
+    free(d);
+    return -1;
+  }
+  fclose(fp);
+  memcpy(&magic, d, 4);
+  if (magic == 0x0A0D0D0A) {
+    r = read_pcapng(trace, d, len);
+  } else if (magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 ||
+             magic == 0xa1b23c4d || magic == 0x4d3cb2a1) {
+    r = read_pcap(trace, d, len);
+  } else {
+    errf("%s is neither pcap nor pcapng", path);
+    r = -1;
+  }
+  free(d);
+  return r;
+}
+
+/* the reply to an IP packet goes the other way */
+static void swap_addrs(unsigned char *ip) {
+  unsigned char tmp[16];
+  if ((ip[0] >> 4) == 4) {
+    memcpy(tmp, ip + 12, 4);
+    memcpy(ip + 12, ip + 16, 4);
+    memcpy(ip + 16, tmp, 4);
+  } else {
+    memcpy(tmp, ip + 8, 16);
+    memcpy(ip + 8, ip + 24, 16);
+    memcpy(ip + 24, tmp, 16);
+  }
+}
+
+typedef struct {
+  nat_ctx_t nat;
+  shadowvpn_args_t args;
+  unsigned char *client_buf;
+  unsigned char *server_buf;
+  unsigned char *udp_buf;
+  struct sockaddr_in addr;
+  // time each stage, see -s
+  latency_t *latency;
+} replay_ctx_t;
+
+#define MARK(ctx, stage, t) do {                                  \
+  if ((ctx)->latency) {                                           \
+    uint64_t __now = latency_now_ns();                            \
+    latency_record((ctx)->latency, stage, __now - (t));           \
+    (t) = __now;                                                  \
+  }                                                               \
+} while (0)
+
+/* return -1 if the packet did not make it through */
+static int replay_one(replay_ctx_t *ctx, replay_pkt_t *pkt) {
+  unsigned char *client = ctx->client_buf + SHADOWVPN_ZERO_BYTES;
+  unsigned char *server = ctx->server_buf + SHADOWVPN_ZERO_BYTES;
+  size_t len = SHADOWVPN_USERTOKEN_LEN + pkt->len;
+  client_info_t *user = NULL;
+  uint64_t t = ctx->latency ? latency_now_ns() : 0;
+
+  memcpy(client, ctx->args.user_tokens[pkt->user], SHADOWVPN_USERTOKEN_LEN);
+  memcpy(client + SHADOWVPN_USERTOKEN_LEN, pkt->data, pkt->len);
+  crypto_encrypt(ctx->udp_buf, ctx->client_buf, len);
+  MARK(ctx, LATENCY_ENCRYPT, t);
+  if (0 != crypto_decrypt(ctx->server_buf, ctx->udp_buf, len))
+    return -1;
+  MARK(ctx, LATENCY_DECRYPT, t);
+  if (0 != nat_fix_upstream(&ctx->nat, server, len,
+                            (struct sockaddr *)&ctx->addr,
+                            sizeof(ctx->addr)))
+    return -1;
+  MARK(ctx, LATENCY_NAT_UP, t);
+  swap_addrs(server + SHADOWVPN_USERTOKEN_LEN);
+  if (0 != nat_fix_downstream(&ctx->nat, server, len, &user))
+    return -1;
+  MARK(ctx, LATENCY_NAT_DOWN, t);
+  crypto_encrypt(ctx->udp_buf, ctx->server_buf, len);
+  MARK(ctx, LATENCY_ENCRYPT, t);
+  if (0 != crypto_decrypt(ctx->client_buf, ctx->udp_buf, len))
+    return -1;
+  MARK(ctx, LATENCY_DECRYPT, t);
+  return 0;
+}
+
+static int replay_init(replay_ctx_t *ctx, int nusers) {
+  int i;
+
+  bzero(ctx, sizeof(replay_ctx_t));
+  ctx->args.mode = SHADOWVPN_MODE_SERVER;
+  ctx->args.netip = ntohl(inet_addr("10.7.0.1"));
+  inet_pton(AF_INET6, "fd00:7::1", ctx->args.netip6);
+  ctx->args.has_net6 = 1;
+  ctx->args.user_prefix6 = 128;
+  ctx->args.user_tokens_len = nusers;
+  ctx->args.user_tokens = calloc(nusers, SHADOWVPN_USERTOKEN_LEN);
+  ctx->args.user_rates = calloc(nusers, sizeof(uint32_t));
+  for (i = 0; i < nusers; i++) {
+    uint64_t token = 0x5eed000000000000ULL + i;
+    memcpy(ctx->args.user_tokens[i], &token, SHADOWVPN_USERTOKEN_LEN);
+  }
+  if (-1 == nat_init(&ctx->nat, &ctx->args))
+    return -1;
+  ctx->client_buf = calloc(1, SHADOWVPN_ZERO_BYTES + SHADOWVPN_USERTOKEN_LEN +
+                           REPLAY_MAX_PACKET);
+  ctx->server_buf = calloc(1, SHADOWVPN_ZERO_BYTES + SHADOWVPN_USERTOKEN_LEN +
+                           REPLAY_MAX_PACKET);
+  ctx->udp_buf = calloc(1, SHADOWVPN_ZERO_BYTES + SHADOWVPN_USERTOKEN_LEN +
+                        REPLAY_MAX_PACKET);
+  ctx->addr.sin_family = AF_INET;
+  ctx->addr.sin_port = htons(1123);
+  ctx->addr.sin_addr.s_addr = inet_addr("192.0.2.1");
+  if (-1 == crypto_init() ||
+      -1 == crypto_set_password("replay", strlen("replay")))
+    return -1;
+  return 0;
+}
+
+static void usage() {
+  printf("usage: shadowvpn-replay [-u users] [-n loops] [-s] [-j] trace\n"
+         "\n"
+         "  -u users  number of synthetic users, default 16\n"
+         "  -n loops  times the trace is replayed, default 10\n"
+         "  -s        also report the time of each stage\n"
+         "  -j        print results as JSON\n");
+}
+
+int main(int argc, char **argv) {
+  replay_ctx_t ctx;
+  trace_t trace;
+  int nusers = 16, loops = 10, stages = 0, json = 0;
+  uint64_t start_ns, elapsed_ns, start_cycles, elapsed_cycles;
+  uint64_t allocs_before = 0, allocs = 0, npkts;
+  size_t i, kept;
+  int c, loop;
+  double pps, mbps;
+
+  while ((c = getopt(argc, argv, "u:n:sjh")) != -1) {
+    switch (c) {
+      case 'u':
+        nusers = atoi(optarg);
+        break;
+      case 'n':
+        loops = atoi(optarg);
+        break;
+      case 's':
+        stages = 1;
+        break;
+      case 'j':
+        json = 1;
+        break;
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1 || nusers < 1 || loops < 1) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  bzero(&trace, sizeof(trace));
+  if (-1 == read_trace(&trace, argv[optind]))
+    return EXIT_FAILURE;
+  if (-1 == replay_init(&ctx, nusers)) {
+    errf("can not initialize");
+    return EXIT_FAILURE;
+  }
+
+  // spread flows over users by source address, then drop what does not
+  // make it through so that every replayed packet does the full round
+  kept = 0;
+  trace.bytes = 0;
+  for (i = 0; i < trace.npkts; i++) {
+    replay_pkt_t *pkt = &trace.pkts[i];
+    // low 32 bits of the source address
+    const unsigned char *src = pkt->data + ((pkt->data[0] >> 4) == 4 ? 12 : 20);
+    uint32_t h;
+    memcpy(&h, src, 4);
+    pkt->user = (h * 2654435761u >> 8) % nusers;
+    if (0 == replay_one(&ctx, pkt)) {
+      trace.pkts[kept++] = *pkt;
+      trace.bytes += pkt->len;
+    } else {
+      trace.skipped++;
+    }
+  }
+  trace.npkts = kept;
+  if (kept == 0) {
+    errf("no IP packets to replay in %s", argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  if (stages) {
+    ctx.latency = malloc(sizeof(latency_t));
+    latency_init(ctx.latency, 1);
+  }
+#ifdef HAVE_ALLOC_COUNT
+  allocs_before = nallocs;
+#endif
+  start_cycles = cycles();
+  start_ns = latency_now_ns();
+  for (loop = 0; loop < loops; loop++) {
+    for (i = 0; i < trace.npkts; i++) {
+      replay_one(&ctx, &trace.pkts[i]);
+    }
+  }
+  elapsed_ns = latency_now_ns() - start_ns;
+  elapsed_cycles = cycles() - start_cycles;
+#ifdef HAVE_ALLOC_COUNT
+  allocs = nallocs - allocs_before;
+#endif
+
+  npkts = (uint64_t)trace.npkts * loops;
+  pps = npkts * 1e9 / elapsed_ns;
+  mbps = (double)trace.bytes * loops * 8 * 1e3 / elapsed_ns;
+  if (json) {
+    printf("{\"name\": \"replay\", \"users\": %d, \"packets\": %llu, "
+           "\"pps\": %.0f, \"mbps\": %.1f, \"ns_per_packet\": %.1f, "
+           "\"cycles_per_packet\": %.1f, \"allocs\": %llu}\n",
+           nusers, (unsigned long long)npkts, pps, mbps,
+           (double)elapsed_ns / npkts, (double)elapsed_cycles / npkts,
+           (unsigned long long)allocs);
+  } else {
+    printf("packets:           %llu (%lu in trace, %lu skipped)\n",
+           (unsigned long long)npkts, (unsigned long)trace.npkts,
+           (unsigned long)trace.skipped);
+    printf("users:             %d\n", nusers);
+    printf("packets/sec:       %.0f\n", pps);
+    printf("Mbit/s:            %.1f\n", mbps);
+    printf("ns/packet:         %.1f\n", (double)elapsed_ns / npkts);
+    if (elapsed_cycles)
+      printf("cycles/packet:     %.1f\n", (double)elapsed_cycles / npkts);
+#ifdef HAVE_ALLOC_COUNT
+    printf("allocations:       %llu\n", (unsigned long long)allocs);
+#endif
+  }
+  if (stages) {
+    static const latency_stage_t timed[] = {
+      LATENCY_ENCRYPT, LATENCY_DECRYPT, LATENCY_NAT_UP, LATENCY_NAT_DOWN
+    };
+    // keep stdout a single JSON object with -j
+    FILE *out = json ? stderr : stdout;
+    latency_hist_t *hist;
+    for (i = 0; i < sizeof(timed) / sizeof(timed[0]); i++) {
+      hist = &ctx.latency->hists[timed[i]];
+      fprintf(out, "stage %-9s count=%llu mean=%.0fns p50=%lluns "
+              "p99=%lluns\n", latency_stage_name(timed[i]),
+              (unsigned long long)hist->count,
+              (double)hist->sum_ns / hist->count,
+              (unsigned long long)latency_quantile(hist, 0.5),
+              (unsigned long long)latency_quantile(hist, 0.99));
+    }
+  }
+  return 0;
+}
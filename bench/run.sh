@@ -0,0 +1,136 @@
+#!/bin/sh
+#
+# Runs the crypto, NAT and loopback tunnel benchmarks, writes their results
+# as JSON lines and compares them with a checked-in baseline. Exits with 1
+# when throughput regressed by more than the tolerance. Run it with
+# `make bench`, or `make bench-baseline` to record a new baseline.
+#
+#   BENCH_TOLERANCE  regression allowed, as a fraction, default 0.25
+#   BENCH_RUNS       runs of each benchmark, the best one counts, default 3
+#   BENCH_OUTPUT     where results go, default results.json
+#   BENCH_BASELINE   baseline to compare with, default baseline.json here
+#   BENCH_TRACE      pcap or pcapng trace to also run shadowvpn-replay on
+#
+# Only values whose names end with pps or mbps (higher is better) and
+# ns_per_packet (lower is better) are compared. Baselines are only
+# meaningful on the machine that recorded them.
+
+srcdir=$(dirname "$0")
+tolerance=${BENCH_TOLERANCE:-0.25}
+runs=${BENCH_RUNS:-3}
+output=${BENCH_OUTPUT:-results.json}
+baseline=${BENCH_BASELINE:-$srcdir/baseline.json}
+
+update=0
+if [ "$1" = "-u" ]; then
+  update=1
+fi
+
+: > "$output"
+
+# run id command...: run a benchmark that prints JSON, tag its lines with id
+run() {
+  id=$1
+  shift
+  echo "running $id" >&2
+  i=0
+  while [ $i -lt "$runs" ]; do
+    result=$("$@") || {
+      echo "$id failed: $*" >&2
+      exit 1
+    }
+    echo "$result" | sed "s/^{/{\"id\": \"$id\", /" >> "$output"
+    i=$((i + 1))
+  done
+}
+
+run crypto_64 ./bench_crypto -j -n 500000 64
+run crypto_1400 ./bench_crypto -j -n 200000 1400
+run nat_uniform_1k ./bench_nat -j -u 1000 -n 2000000
+run nat_zipf_100k ./bench_nat -j -u 100000 -z 1.1 -n 2000000
+run tunnel_64 ./bench_tunnel -j -s 64 -n 100000
+run tunnel_1400 ./bench_tunnel -j -s 1400 -n 100000
+if [ -n "$BENCH_TRACE" ]; then
+  run replay ./shadowvpn-replay -j -u 100 "$BENCH_TRACE"
+fi
+
+if [ $update = 1 ]; then
+  cp "$output" "$baseline"
+  echo "baseline written to $baseline" >&2
+  exit 0
+fi
+
+if [ ! -f "$baseline" ]; then
+  echo "no baseline at $baseline, record one with make bench-baseline" >&2
+  exit 1
+fi
+
+awk -v tolerance="$tolerance" -v baseline="$baseline" '
+  # flat JSON objects as printed by the benchmarks
+  function parse(line, kv,    n, parts, i, k, v) {
+    gsub(/^{|}$/, "", line)
+    n = split(line, parts, /, /)
+    for (i = 1; i <= n; i++) {
+      k = parts[i]
+      sub(/:.*/, "", k)
+      gsub(/"/, "", k)
+      v = parts[i]
+      sub(/^[^:]*: */, "", v)
+      gsub(/"/, "", v)
+      kv[k] = v
+    }
+  }
+  function direction(k) {
+    if (k ~ /(pps|mbps)$/)
+      return 1
+    if (k ~ /ns_per_packet$/)
+      return -1
+    return 0
+  }
+  # several runs of the same benchmark, keep the best
+  function fold(best, key, v, d) {
+    if (!(key in best) || d * (v - best[key]) > 0)
+      best[key] = v
+  }
+  {
+    split("", kv)
+    parse($0, kv)
+    if (kv["id"] == "")
+      next
+    for (k in kv) {
+      d = direction(k)
+      if (!d)
+        continue
+      key = kv["id"] " " k
+      if (FILENAME == baseline) {
+        fold(base, key, kv[k], d)
+      } else {
+        if (!(key in cur))
+          order[n++] = key
+        fold(cur, key, kv[k], d)
+        dir[key] = d
+      }
+    }
+  }
+  END {
+    failed = 0
+    printf "%-40s %14s %14s %8s\n", "benchmark", "baseline", "current",
+           "change"
+    for (i = 0; i < n; i++) {
+      key = order[i]
+      if (!(key in base)) {
+        printf "%-40s %14s %14s %8s\n", key, "-", cur[key], "new"
+        continue
+      }
+      change = base[key] ? (cur[key] - base[key]) / base[key] : 0
+      status = ""
+      if (dir[key] * change < -tolerance) {
+        status = "  REGRESSED"
+        failed = 1
+      }
+      printf "%-40s %14s %14s %+7.1f%%%s\n", key, base[key], cur[key],
+             change * 100, status
+    }
+    exit failed
+  }
+' "$baseline" "$output"
@@ -11,6 +11,10 @@ sysctl -w net.ipv4.ip_forward=1
 ip addr add $net dev $intf
 ip link set $intf mtu $mtu
 ip link set $intf up
+if [ -n "$net6" ]; then
+  sysctl -w net.ipv6.conf.all.forwarding=1
+  ip -6 addr add $net6 dev $intf
+fi
 
 # turn on NAT over VPN
 if !(iptables-save -t nat | grep -q "shadowvpn"); then
@@ -18,6 +18,8 @@
 
 */
 
+#include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -47,6 +49,54 @@ static void print_help() __attribute__ ((noreturn));
 
 static void load_default_args(shadowvpn_args_t *args);
 
+/* host[:port][@intf][*weight], comma separated */
+static int parse_paths(shadowvpn_args_t *args, char *value) {
+  char *p;
+  int len = 1, i;
+  for (p = value; *p; p++) {
+    if (*p == ',')
+      len++;
+  }
+  args->paths = calloc(len, sizeof(shadowvpn_path_t));
+  args->paths_len = len;
+  for (i = 0; i < len; i++) {
+    shadowvpn_path_t *path = &args->paths[i];
+    char *next = strchr(value, ',');
+    if (next)
+      *next++ = 0;
+    path->weight = 1;
+    if (NULL != (p = strchr(value, '*'))) {
+      *p = 0;
+      path->weight = atol(p + 1);
+      if (path->weight < 1 || path->weight > 100) {
+        errf("path weight should be between 1 and 100");
+        return -1;
+      }
+    }
+    if (NULL != (p = strchr(value, '@'))) {
+      *p = 0;
+      path->intf = p + 1;
+    }
+    if (*value == '[') {
+      // [IPv6]:port
+      value++;
+      if (NULL == (p = strchr(value, ']'))) {
+        errf("invalid path %s", value);
+        return -1;
+      }
+      *p++ = 0;
+      if (*p == ':')
+        path->port = atol(p + 1);
+    } else if (NULL != (p = strchr(value, ':')) && !strchr(p + 1, ':')) {
+      *p = 0;
+      path->port = atol(p + 1);
+    }
+    path->host = value;
+    value = next;
+  }
+  return 0;
+}
+
 static int process_key_value(shadowvpn_args_t *args, const char *key,
                       const char *value);
 
@@ -60,7 +110,7 @@ static int parse_config_file(shadowvpn_args_t *args, const char *filename) {
   char *line;
   FILE *fp;
   size_t len = sizeof(buf);
-  int lineno = 0;
+  int lineno = 0, i;
 
   fp = fopen(filename, "rb");
   if (fp == NULL) {
@@ -111,6 +161,35 @@ static int parse_config_file(shadowvpn_args_t *args, const char *filename) {
     errf("password not set in config file");
     return -1;
   }
+#ifndef TARGET_WIN32
+  // in NAT mode users get the user_prefix6 that follow the one of net6
+  if (args->has_net6 && args->mode == SHADOWVPN_MODE_SERVER &&
+      args->user_tokens_len) {
+    int bits = args->user_prefix6 - args->net6_prefix;
+    if (bits <= 0) {
+      errf("user_prefix6 %d should be longer than the net6 prefix %d",
+           args->user_prefix6, args->net6_prefix);
+      return -1;
+    }
+    if (bits < 64) {
+      uint64_t first = 0;
+      for (i = args->net6_prefix; i < args->user_prefix6; i++) {
+        first = first << 1 | ((args->netip6[i / 8] >> (7 - i % 8)) & 1);
+      }
+      if (args->user_tokens_len > (1ULL << bits) - 1 - first) {
+        errf("net6 /%d has room for %llu users of /%d, not %zu",
+             args->net6_prefix,
+             (unsigned long long)((1ULL << bits) - 1 - first),
+             args->user_prefix6, args->user_tokens_len);
+        return -1;
+      }
+    }
+  }
+#endif
+  for (i = 0; i < args->paths_len; i++) {
+    if (!args->paths[i].port)
+      args->paths[i].port = args->port;
+  }
 #ifdef TARGET_WIN32
   if (!args->tun_ip) {
     errf("tunip not set in config file");
@@ -137,11 +216,12 @@ static int parse_user_tokens(shadowvpn_args_t *args, char *value) {
   args->user_tokens_len = len;
   args->user_tokens = calloc(len, 8);
   bzero(args->user_tokens, 8 * len);
+  args->user_rates = calloc(len, sizeof(uint32_t));
   value = start;
   while (*value) {
     int has_next = 0;
     sp_pos = strchr(value, ',');
-    if (sp_pos > 0) {
+    if (sp_pos != NULL) {
       has_next = 1;
       *sp_pos = 0;
     }
@@ -157,6 +237,20 @@ static int parse_user_tokens(shadowvpn_args_t *args, char *value) {
         break;
       }
     }
+    // optional rate limit, i.e. 7e335d67f1dc2c01:2048
+    if (*value == ':') {
+      char *end;
+      unsigned long rate;
+      errno = 0;
+      rate = strtoul(value + 1, &end, 10);
+      if (!isdigit((unsigned char)value[1]) || errno || *end ||
+          rate > UINT32_MAX) {
+        errf("invalid rate in user_token: %s", value + 1);
+        free(start);
+        return -1;
+      }
+      args->user_rates[i] = rate;
+    }
     i++;
     if (has_next) {
       value = sp_pos + 1;
@@ -194,10 +288,75 @@ static int process_key_value(shadowvpn_args_t *args, const char *key,
       errf("concurrency should <= 100");
       return -1;
     }
+  } else if (strcmp("user_rate", key) == 0) {
+    args->user_rate = atol(value);
+  } else if (strcmp("idle_timeout", key) == 0) {
+    args->idle_timeout = atol(value);
+  } else if (strcmp("metrics", key) == 0) {
+    args->metrics = strdup(value);
+  } else if (strcmp("latency_sample", key) == 0) {
+    args->latency_sample = atol(value);
+  } else if (strcmp("capture_slots", key) == 0) {
+    args->capture_slots = atol(value);
+  } else if (strcmp("capture_snaplen", key) == 0) {
+    args->capture_snaplen = atol(value);
+  } else if (strcmp("rcvbuf", key) == 0) {
+    args->rcvbuf = atol(value);
+  } else if (strcmp("sndbuf", key) == 0) {
+    args->sndbuf = atol(value);
+  } else if (strcmp("txqueuelen", key) == 0) {
+    args->txqueuelen = atol(value);
+  } else if (strcmp("coalesce", key) == 0) {
+    args->coalesce = atol(value);
+  } else if (strcmp("coalesce_delay", key) == 0) {
+    args->coalesce_delay = atol(value);
+  } else if (strcmp("fec", key) == 0) {
+    // data:parity, i.e. 10:2
+    int data = 0, parity = 0;
+    if (2 != sscanf(value, "%d:%d", &data, &parity) || data < 1 ||
+        parity < 1 || data + parity > FEC_MAX_SHARDS) {
+      errf("fec should be data:parity, with at most %d in total",
+           FEC_MAX_SHARDS);
+      return -1;
+    }
+    args->fec_data = data;
+    args->fec_parity = parity;
+  } else if (strcmp("fec_timeout", key) == 0) {
+    args->fec_timeout = atol(value);
+  } else if (strcmp("compress", key) == 0) {
+    args->compress = atol(value);
+  } else if (strcmp("pmtud", key) == 0) {
+    args->pmtud = atol(value);
+  } else if (strcmp("tos", key) == 0) {
+    args->tos = atol(value);
+  } else if (strcmp("pacing", key) == 0) {
+    if (strcmp("auto", value) == 0) {
+      args->pacing_auto = 1;
+    } else {
+      args->pacing_rate = atol(value);
+    }
+  } else if (strcmp("roaming", key) == 0) {
+    args->roaming = atol(value);
+  } else if (strcmp("fragment", key) == 0) {
+    long fragment = atol(value);
+    // the same limit as mtu, pieces carry more than their header
+    if (fragment && fragment < 68 + SHADOWVPN_OVERHEAD_LEN) {
+      errf("fragment %ld is too small", fragment);
+      return -1;
+    }
+    args->fragment = fragment;
+  } else if (strcmp("paths", key) == 0) {
+    if (-1 == parse_paths(args, strdup(value)))
+      return -1;
+  } else if (strcmp("path_probe_interval", key) == 0) {
+    args->path_probe_interval = atol(value);
+  } else if (strcmp("keepalive_interval", key) == 0) {
+    args->keepalive_interval = atol(value);
   } else if (strcmp("password", key) == 0) {
     args->password = strdup(value);
   } else if (strcmp("user_token", key) == 0) {
-    parse_user_tokens(args, strdup(value));
+    if (-1 == parse_user_tokens(args, strdup(value)))
+      return -1;
   }
 #ifndef TARGET_WIN32
   else if (strcmp("net", key) == 0) {
@@ -208,6 +367,35 @@ static int process_key_value(shadowvpn_args_t *args, const char *key,
       errf("warning: invalid net IP in config file: %s", value);
     }
     args->netip = ntohl((uint32_t)addr);
+  } else if (strcmp("net6", key) == 0) {
+    char *p = strchr(value, '/');
+    char *end;
+    unsigned long prefix;
+    if (p == NULL) {
+      errf("net6 should have a prefix length, i.e. fd00:7::1/48");
+      return -1;
+    }
+    *p = 0;
+    if (1 != inet_pton(AF_INET6, value, args->netip6)) {
+      errf("invalid net6 IP in config file: %s", value);
+      return -1;
+    }
+    errno = 0;
+    prefix = strtoul(p + 1, &end, 10);
+    if (!isdigit((unsigned char)p[1]) || errno || *end || prefix < 1 ||
+        prefix > 128) {
+      errf("invalid net6 prefix length in config file: %s", p + 1);
+      return -1;
+    }
+    args->net6_prefix = prefix;
+    args->has_net6 = 1;
+  } else if (strcmp("user_prefix6", key) == 0) {
+    long prefix = atol(value);
+    if (prefix < 1 || prefix > 128) {
+      errf("user_prefix6 should be between 1 and 128");
+      return -1;
+    }
+    args->user_prefix6 = prefix;
   }
 #endif
   else if (strcmp("mode", key) == 0) {
@@ -269,6 +457,10 @@ static void load_default_args(shadowvpn_args_t *args) {
   args->pid_file = "/var/run/shadowvpn.pid";
   args->log_file = "/var/log/shadowvpn.log";
   args->concurrency = 1;
+  args->user_prefix6 = 128;
+  args->capture_snaplen = 256;
+  args->fec_timeout = 20;
+  args->path_probe_interval = 500;
 #ifdef TARGET_WIN32
   args->tun_mask = 24;
   args->tun_port = TUN_DELEGATE_PORT;
@@ -37,6 +37,16 @@ typedef enum {
   SHADOWVPN_CMD_RESTART
 } shadowvpn_cmd;
 
+/* one of the paths a client sends over, see args->paths */
+typedef struct {
+  const char *host;
+  uint16_t port;
+  // local interface to send from, NULL for the default route
+  const char *intf;
+  // share of flows relative to other paths, while they all work
+  int weight;
+} shadowvpn_path_t;
+
 typedef struct {
   shadowvpn_mode mode;
   shadowvpn_cmd cmd;
@@ -50,14 +60,79 @@ typedef struct {
   uint16_t mtu;
   uint16_t concurrency;
 
+  // server only, forget a client after it has been idle for this long
+  // in seconds, 0 means never
+  uint32_t idle_timeout;
+
   // the ip of the "net" configuration
   // in host order
   uint32_t netip;
+
+  // the ip of the "net6" configuration
+  // in network order
+  uint8_t netip6[16];
+  int has_net6;
+  // prefix length of the "net6" configuration
+  uint8_t net6_prefix;
+  // prefix length assigned to each user in NAT mode, 128 means one
+  // address per user
+  uint8_t user_prefix6;
+
   char (*user_tokens)[8];
+  // per user rate limit in kbit/s, 0 means user_rate
+  uint32_t *user_rates;
   size_t user_tokens_len;
 
+  // server only, default rate limit of each user in kbit/s, 0 means unlimited
+  uint32_t user_rate;
+
   const char *up_script;
   const char *down_script;
+
+  // where to serve metrics, "unix:/path" or "host:port", NULL to disable
+  const char *metrics;
+  // time one in every this many packets at each stage, 0 to disable
+  uint32_t latency_sample;
+  // size of the capture ring started through metrics, 0 to disable
+  uint32_t capture_slots;
+  // bytes kept of each captured packet
+  uint32_t capture_snaplen;
+  // SO_RCVBUF / SO_SNDBUF of UDP sockets, 0 keeps the system default
+  int rcvbuf;
+  int sndbuf;
+  // txqueuelen of the tun device, 0 keeps the system default
+  int txqueuelen;
+  // pack small packets to the same peer into one datagram
+  int coalesce;
+  // in us, how long small packets may wait for more to pack with them
+  uint32_t coalesce_delay;
+  // FEC sends fec_parity datagrams after every fec_data, 0 to disable
+  int fec_data;
+  int fec_parity;
+  // in ms, how long a group waits to fill up before its parity is sent
+  uint32_t fec_timeout;
+  // compress plaintexts that get smaller
+  int compress;
+  // probe for the largest datagram that gets through, see pmtu.h
+  int pmtud;
+  // send datagrams with the DSCP of the packets in them
+  int tos;
+  // in kbit/s, what datagrams are paced to, 0 for no pacing. pacing_auto
+  // sets it from the traffic instead
+  uint32_t pacing_rate;
+  int pacing_auto;
+  // client only, tell the server at once when our address changes
+  int roaming;
+  // the largest IP packet the path takes, larger ones are sent in pieces,
+  // 0 to send them as is
+  uint32_t fragment;
+  // client only, spread flows over these instead of sending to server
+  shadowvpn_path_t *paths;
+  int paths_len;
+  // in ms, how often each path is probed for RTT and loss
+  uint32_t path_probe_interval;
+  // in ms, how often to ping the peer, or each user, 0 to disable
+  uint32_t keepalive_interval;
 #ifdef TARGET_WIN32
   const char *tun_ip;
   int tun_mask;
@@ -0,0 +1,257 @@
+/**
+  capture.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "shadowvpn.h"
+
+#include <stdlib.h>
+#ifndef TARGET_WIN32
+#include <sys/time.h>
+#endif
+
+/* pcapng block types and link types */
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define LINKTYPE_RAW 101
+#define LINKTYPE_USER0 147
+
+#define OPT_ENDOFOPT 0
+#define OPT_COMMENT 1
+#define IF_NAME 2
+#define EPB_FLAGS 2
+
+#define ALIGN4(n) (((n) + 3) & ~3)
+
+void capture_init(capture_t *capture, uint32_t nslots, uint32_t snaplen) {
+  bzero(capture, sizeof(capture_t));
+  capture->nslots = nslots;
+  capture->snaplen = snaplen > 0xffff ? 0xffff : snaplen;
+  capture->slot_size = ALIGN4(sizeof(capture_slot_t) + capture->snaplen);
+}
+
+void capture_destroy(capture_t *capture) {
+  free(capture->slots);
+  capture->slots = NULL;
+}
+
+static inline capture_slot_t *slot_at(capture_t *capture, uint64_t i) {
+  return (capture_slot_t *)(capture->slots +
+                            (i % capture->nslots) * capture->slot_size);
+}
+
+static uint64_t now_us() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void capture_packet(capture_t *capture, int iface, int dir,
+                    const uint8_t *user, const void *data, size_t len) {
+  capture_slot_t *slot;
+  uint64_t head;
+  uint32_t conf_seq;
+  int skip;
+
+  // a capture_start() may have begun after the caller saw us enabled
+  conf_seq = __atomic_load_n(&capture->conf_seq, __ATOMIC_ACQUIRE);
+  if (conf_seq & 1)
+    return;
+  skip = (iface == CAPTURE_UDP && !capture->encrypted) ||
+         (capture->has_user &&
+          (user == NULL || memcmp(user, capture->user, 8) != 0));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (skip || conf_seq != __atomic_load_n(&capture->conf_seq,
+                                          __ATOMIC_RELAXED))
+    return;
+
+  head = capture->head;
+  slot = slot_at(capture, head);
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->iface = iface;
+  slot->dir = dir;
+  slot->len = len;
+  slot->caplen = len < capture->snaplen ? len : capture->snaplen;
+  slot->ts_us = now_us();
+  if (user)
+    memcpy(slot->user, user, 8);
+  else
+    bzero(slot->user, 8);
+  memcpy(slot->data, data, slot->caplen);
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&capture->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int parse_token(const char *hex, uint8_t *token) {
+  int i;
+  if (strlen(hex) != 16)
+    return -1;
+  for (i = 0; i < 8; i++) {
+    unsigned int temp;
+    if (1 != sscanf(hex + i * 2, "%2x", &temp))
+      return -1;
+    token[i] = temp;
+  }
+  return 0;
+}
+
+int capture_start(capture_t *capture, const char *user, int encrypted) {
+  uint8_t token[8];
+
+  if (capture->nslots == 0) {
+    errf("capture: disabled, set capture_slots to enable it");
+    return -1;
+  }
+  if (user && -1 == parse_token(user, token)) {
+    errf("capture: invalid user token %s", user);
+    return -1;
+  }
+  // settings can only change while the datapath is not recording
+  capture_stop(capture);
+  if (capture->slots == NULL) {
+    capture->slots = calloc(capture->nslots, capture->slot_size);
+    if (capture->slots == NULL) {
+      errf("capture: can not allocate %u slots", capture->nslots);
+      return -1;
+    }
+  }
+  // the datapath may still be in capture_packet(), and skips the packet
+  // when it sees the settings change under it
+  __atomic_store_n(&capture->conf_seq, capture->conf_seq + 1,
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  capture->has_user = user != NULL;
+  if (user)
+    memcpy(capture->user, token, 8);
+  capture->encrypted = encrypted;
+  __atomic_store_n(&capture->conf_seq, capture->conf_seq + 1,
+                   __ATOMIC_RELEASE);
+  __atomic_store_n(&capture->enabled, 1, __ATOMIC_RELEASE);
+  logf("capture: started%s%s%s", user ? " for user " : "", user ? user : "",
+       encrypted ? " with encrypted datagrams" : "");
+  return 0;
+}
+
+void capture_stop(capture_t *capture) {
+  if (__atomic_exchange_n(&capture->enabled, 0, __ATOMIC_ACQ_REL))
+    logf("capture: stopped");
+}
+
+static void put_u16(metrics_buf_t *out, uint16_t v) {
+  metrics_append(out, &v, 2);
+}
+
+static void put_u32(metrics_buf_t *out, uint32_t v) {
+  metrics_append(out, &v, 4);
+}
+
+static void put_option(metrics_buf_t *out, uint16_t code, const void *data,
+                       uint16_t len) {
+  static const uint8_t zeros[4];
+  put_u16(out, code);
+  put_u16(out, len);
+  metrics_append(out, data, len);
+  metrics_append(out, zeros, ALIGN4(len) - len);
+}
+
+static void put_idb(metrics_buf_t *out, uint16_t linktype, uint32_t snaplen,
+                    const char *name) {
+  uint32_t name_len = strlen(name);
+  uint32_t block_len = 20 + 4 + ALIGN4(name_len) + 4;
+  put_u32(out, PCAPNG_IDB);
+  put_u32(out, block_len);
+  put_u16(out, linktype);
+  put_u16(out, 0);
+  put_u32(out, snaplen);
+  put_option(out, IF_NAME, name, name_len);
+  put_option(out, OPT_ENDOFOPT, NULL, 0);
+  put_u32(out, block_len);
+}
+
+static void put_epb(metrics_buf_t *out, capture_slot_t *slot) {
+  static const uint8_t zeros[8];
+  static const uint8_t pad[4];
+  char comment[32];
+  int comment_len = 0;
+  uint32_t flags = slot->dir;
+  uint32_t block_len;
+
+  if (memcmp(slot->user, zeros, 8) != 0) {
+    comment_len = snprintf(comment, sizeof(comment),
+                           "user %02x%02x%02x%02x%02x%02x%02x%02x",
+                           slot->user[0], slot->user[1], slot->user[2],
+                           slot->user[3], slot->user[4], slot->user[5],
+                           slot->user[6], slot->user[7]);
+  }
+  block_len = 28 + ALIGN4(slot->caplen) + 8 +
+              (comment_len ? 4 + ALIGN4(comment_len) : 0) + 4 + 4;
+  put_u32(out, PCAPNG_EPB);
+  put_u32(out, block_len);
+  put_u32(out, slot->iface);
+  put_u32(out, slot->ts_us >> 32);
+  put_u32(out, (uint32_t)slot->ts_us);
+  put_u32(out, slot->caplen);
+  put_u32(out, slot->len);
+  metrics_append(out, slot->data, slot->caplen);
+  metrics_append(out, pad, ALIGN4(slot->caplen) - slot->caplen);
+  put_option(out, EPB_FLAGS, &flags, 4);
+  if (comment_len)
+    put_option(out, OPT_COMMENT, comment, comment_len);
+  put_option(out, OPT_ENDOFOPT, NULL, 0);
+  put_u32(out, block_len);
+}
+
+void capture_dump(capture_t *capture, metrics_buf_t *out) {
+  capture_slot_t *copy;
+  uint64_t head, i;
+  int64_t section_len = -1;
+
+  put_u32(out, PCAPNG_SHB);
+  put_u32(out, 28);
+  put_u32(out, PCAPNG_BYTE_ORDER);
+  put_u16(out, 1);
+  put_u16(out, 0);
+  metrics_append(out, &section_len, 8);
+  put_u32(out, 28);
+  // interface ids are CAPTURE_TUN and CAPTURE_UDP
+  put_idb(out, LINKTYPE_RAW, capture->snaplen, "tun");
+  put_idb(out, LINKTYPE_USER0, capture->snaplen, "udp");
+
+  if (capture->slots == NULL)
+    return;
+  if (NULL == (copy = malloc(capture->slot_size)))
+    return;
+  head = __atomic_load_n(&capture->head, __ATOMIC_ACQUIRE);
+  i = head > capture->nslots ? head - capture->nslots : 0;
+  for (; i < head; i++) {
+    capture_slot_t *slot = slot_at(capture, i);
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+    memcpy(copy, slot, capture->slot_size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // overwritten while we were copying
+    if (seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED))
+      continue;
+    put_epb(out, copy);
+  }
+  free(copy);
+}
@@ -0,0 +1,109 @@
+/**
+  capture.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "metrics.h"
+
+/**
+  An in-memory packet capture for live troubleshooting.
+
+  While enabled, plaintext packets are recorded as the user sees them:
+  from tun after NAT, and from UDP after decryption but before NAT.
+  Encrypted datagrams can be recorded as well. Each packet is annotated
+  with its user token, and a capture can be limited to one user.
+
+  Packets go into a fixed ring of slots which only the thread
+  running vpn_run() writes. Each slot is guarded by a sequence number, so
+  any other thread can dump the ring as pcapng without locking. When
+  disabled, the datapath only tests `enabled`.
+*/
+
+/* interfaces in the pcapng file */
+#define CAPTURE_TUN 0
+#define CAPTURE_UDP 1
+
+/* directions, as in pcapng epb_flags */
+#define CAPTURE_IN 1
+#define CAPTURE_OUT 2
+
+typedef struct {
+  // odd while the slot is being written
+  uint32_t seq;
+  uint8_t iface;
+  uint8_t dir;
+  uint16_t caplen;
+  uint32_t len;
+  // wall clock, in us
+  uint64_t ts_us;
+  // all zero if unknown
+  uint8_t user[8];
+  unsigned char data[];
+} capture_slot_t;
+
+typedef struct {
+  int enabled;
+  // odd while capture_start() changes the settings below
+  uint32_t conf_seq;
+  // record encrypted datagrams as well
+  int encrypted;
+  // only record packets of this user
+  int has_user;
+  uint8_t user[8];
+
+  uint32_t nslots;
+  uint32_t snaplen;
+  size_t slot_size;
+  // allocated on first capture_start()
+  unsigned char *slots;
+  // number of packets ever recorded
+  uint64_t head;
+} capture_t;
+
+void capture_init(capture_t *capture, uint32_t nslots, uint32_t snaplen);
+
+/* only call this when nothing else uses it */
+void capture_destroy(capture_t *capture);
+
+static inline int capture_on(capture_t *capture) {
+  return __atomic_load_n(&capture->enabled, __ATOMIC_ACQUIRE);
+}
+
+/* user may be NULL, only call this from the thread running vpn_run() */
+void capture_packet(capture_t *capture, int iface, int dir,
+                    const uint8_t *user, const void *data, size_t len);
+
+/*
+   start recording, may be called from any thread
+   user is NULL or the hex of a user token
+   return -1 on error
+*/
+int capture_start(capture_t *capture, const char *user, int encrypted);
+
+void capture_stop(capture_t *capture);
+
+/* write what is in the ring as pcapng */
+void capture_dump(capture_t *capture, metrics_buf_t *out);
+
+#endif
@@ -0,0 +1,253 @@
+/**
+  compress.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "shadowvpn.h"
+
+#define LZ4_MINMATCH 4
+// the last match starts at least this far from the end
+#define LZ4_MFLIMIT 12
+// and the last this many bytes are always literals
+#define LZ4_LAST_LITERALS 5
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t lz4_hash(uint32_t v) {
+  return (v * 2654435761U) >> (32 - COMPRESS_HASH_LOG);
+}
+
+/* write a length that went over its 4 bits in the token */
+static uint8_t *lz4_write_len(uint8_t *op, size_t n) {
+  while (n >= 255) {
+    *op++ = 255;
+    n -= 255;
+  }
+  *op++ = n;
+  return op;
+}
+
+/* return the length of the block, 0 if it does not fit in cap */
+static size_t lz4_compress(compress_t *c, const uint8_t *src, size_t len,
+                           uint8_t *dst, size_t cap) {
+  const uint8_t *ip = src, *anchor = src, *end = src + len;
+  uint8_t *op = dst, *oend = dst + cap;
+  size_t lit;
+
+  // positions are 16 bits, which is also the max match offset
+  if (len > 0xffff)
+    return 0;
+  // the table is not cleared between packets, stale entries are only
+  // used if they still point before ip and the bytes there match
+  if (len > LZ4_MFLIMIT) {
+    const uint8_t *mflimit = end - LZ4_MFLIMIT;
+    const uint8_t *matchlimit = end - LZ4_LAST_LITERALS;
+    ip++;
+    while (ip < mflimit) {
+      uint32_t seq = read32(ip);
+      uint32_t h = lz4_hash(seq);
+      const uint8_t *ref = src + c->table[h];
+      const uint8_t *m, *r;
+      size_t mlen;
+      uint8_t *token;
+
+      c->table[h] = ip - src;
+      if (ref >= ip || read32(ref) != seq) {
+        // speed up on data that does not compress
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      m = ip + LZ4_MINMATCH;
+      r = ref + LZ4_MINMATCH;
+      while (m < matchlimit && *m == *r) {
+        m++;
+        r++;
+      }
+      lit = ip - anchor;
+      mlen = m - ip - LZ4_MINMATCH;
+      if (op + 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1 > oend)
+        return 0;
+      token = op++;
+      if (lit >= 15) {
+        *token = 15 << 4;
+        op = lz4_write_len(op, lit - 15);
+      } else {
+        *token = lit << 4;
+      }
+      memcpy(op, anchor, lit);
+      op += lit;
+      *op++ = (ip - ref) & 0xff;
+      *op++ = (ip - ref) >> 8;
+      if (mlen >= 15) {
+        *token |= 15;
+        op = lz4_write_len(op, mlen - 15);
+      } else {
+        *token |= mlen;
+      }
+      ip = anchor = m;
+      if (ip < mflimit)
+        c->table[lz4_hash(read32(ip - 2))] = ip - 2 - src;
+    }
+  }
+  lit = end - anchor;
+  if (op + 1 + lit + lit / 255 + 1 > oend)
+    return 0;
+  if (lit >= 15) {
+    *op++ = 15 << 4;
+    op = lz4_write_len(op, lit - 15);
+  } else {
+    *op++ = lit << 4;
+  }
+  memcpy(op, anchor, lit);
+  op += lit;
+  return op - dst;
+}
+
+/* return the length of the block decompressed, -1 if it is malformed */
+static ssize_t lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                              size_t cap) {
+  const uint8_t *ip = src, *iend = src + len;
+  uint8_t *op = dst, *oend = dst + cap;
+
+  while (ip < iend) {
+    unsigned token = *ip++;
+    size_t lit = token >> 4, mlen = token & 15, off;
+    unsigned b;
+    const uint8_t *m;
+
+    if (lit == 15) {
+      do {
+        if (ip == iend)
+          return -1;
+        b = *ip++;
+        lit += b;
+      } while (b == 255);
+    }
+    if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+      return -1;
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    // the last sequence has literals only
+    if (ip == iend)
+      break;
+    if (iend - ip < 2)
+      return -1;
+    off = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (off == 0 || off > (size_t)(op - dst))
+      return -1;
+    if (mlen == 15) {
+      do {
+        if (ip == iend)
+          return -1;
+        b = *ip++;
+        mlen += b;
+      } while (b == 255);
+    }
+    mlen += LZ4_MINMATCH;
+    if (mlen > (size_t)(oend - op))
+      return -1;
+    // when the match overlaps what it writes, it repeats the last off
+    // bytes, copy what is there and twice as much the next time
+    m = op - off;
+    while (mlen) {
+      size_t n = op - m < mlen ? (size_t)(op - m) : mlen;
+      memcpy(op, m, n);
+      op += n;
+      mlen -= n;
+    }
+  }
+  return op - dst;
+}
+
+int compress_class(const unsigned char *pkt, size_t len) {
+  size_t l4 = 0;
+  uint8_t proto = 0;
+  uint16_t sport, dport, port;
+
+  if ((pkt[0] & 0xf0) == 0x40 && len >= 20) {
+    l4 = (pkt[0] & 0x0f) * 4;
+    proto = pkt[9];
+  } else if ((pkt[0] & 0xf0) == 0x60 && len >= 40) {
+    l4 = 40;
+    proto = pkt[6];
+  }
+  if ((proto != 6 && proto != 17) || l4 + 4 > len)
+    return proto % COMPRESS_CLASSES;
+  // the lower port is most likely the service, the other one changes with
+  // each connection
+  sport = (pkt[l4] << 8) | pkt[l4 + 1];
+  dport = (pkt[l4 + 2] << 8) | pkt[l4 + 3];
+  port = sport < dport ? sport : dport;
+  return ((port * 2654435761U) >> 16) % COMPRESS_CLASSES;
+}
+
+int compress_bypass(compress_class_t *cls) {
+  if (cls->bypass == 0)
+    return 0;
+  cls->bypass--;
+  return 1;
+}
+
+size_t compress_frame(compress_t *c, compress_class_t *cls,
+                      const unsigned char *data, size_t len,
+                      unsigned char *out) {
+  size_t n = 0;
+
+  if (len > COMPRESS_HDR_LEN + 1) {
+    n = lz4_compress(c, data, len, out + COMPRESS_HDR_LEN,
+                     len - COMPRESS_HDR_LEN - 1);
+  }
+  cls->in += len;
+  cls->out += n ? COMPRESS_HDR_LEN + n : len;
+  if (++cls->samples == COMPRESS_SAMPLES) {
+    if (cls->out > cls->in - cls->in / 8)
+      cls->bypass = COMPRESS_BYPASS;
+    cls->in = cls->out = 0;
+    cls->samples = 0;
+  }
+  if (n == 0)
+    return 0;
+  out[0] = FRAME_COMPRESSED;
+  out[1] = len >> 8;
+  out[2] = len & 0xff;
+  return COMPRESS_HDR_LEN + n;
+}
+
+ssize_t decompress_frame(const unsigned char *frame, size_t len,
+                         unsigned char *out, size_t cap) {
+  size_t orig;
+  if (len <= COMPRESS_HDR_LEN)
+    return -1;
+  orig = (frame[1] << 8) | frame[2];
+  if (orig > cap)
+    return -1;
+  if ((ssize_t)orig != lz4_decompress(frame + COMPRESS_HDR_LEN,
+                                      len - COMPRESS_HDR_LEN, out, orig))
+    return -1;
+  return orig;
+}
@@ -0,0 +1,93 @@
+/**
+  compress.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+  Compression of datagram plaintexts, in the LZ4 block format.
+
+  A compressed plaintext is sent as a FRAME_COMPRESSED frame:
+
+    [type] [len 2] [LZ4 block]
+
+  where len is the length of the plaintext once decompressed, in network
+  order. It is only sent when it is smaller than the plaintext.
+
+  Traffic is sorted into a few classes by service port, so that TLS or
+  video in one class does not turn compression off for telemetry in
+  another. A class that saved less than 1/8 over its last
+  COMPRESS_SAMPLES packets skips the next COMPRESS_BYPASS packets, then
+  gets sampled again.
+*/
+
+#define COMPRESS_HDR_LEN 3
+
+/* shorter plaintexts are not worth it */
+#define COMPRESS_MIN_LEN 64
+
+#define COMPRESS_CLASSES 16
+#define COMPRESS_SAMPLES 16
+#define COMPRESS_BYPASS 256
+
+#define COMPRESS_HASH_LOG 12
+
+/* match finder state, one per thread */
+typedef struct {
+  uint16_t table[1 << COMPRESS_HASH_LOG];
+} compress_t;
+
+/* how well a class of traffic compresses, one set per peer */
+typedef struct {
+  // bytes before and after compression in the current sample
+  uint32_t in;
+  uint32_t out;
+  uint16_t samples;
+  // packets left to send without trying
+  uint16_t bypass;
+} compress_class_t;
+
+/* the class of an IP packet, below COMPRESS_CLASSES */
+int compress_class(const unsigned char *pkt, size_t len);
+
+/* return 1 if the next packet of this class should be sent as is */
+int compress_bypass(compress_class_t *cls);
+
+/*
+   compress len bytes of data into a frame in out, which has room for len
+   bytes, and account the result in cls
+   return the length of the frame, 0 if it would not be smaller than len
+*/
+size_t compress_frame(compress_t *c, compress_class_t *cls,
+                      const unsigned char *data, size_t len,
+                      unsigned char *out);
+
+/*
+   decompress a frame into out, which has room for cap bytes
+   return the length of the plaintext, -1 if the frame is malformed
+*/
+ssize_t decompress_frame(const unsigned char *frame, size_t len,
+                         unsigned char *out, size_t cap);
+
+#endif
@@ -0,0 +1,462 @@
+/**
+  fec.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+
+#include "shadowvpn.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define FEC_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define FEC_NEON
+#include <arm_neon.h>
+#endif
+
+/* x^8 + x^4 + x^3 + x^2 + 1 */
+#define GF_POLY 0x11d
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+
+typedef void (*gf_mul_add_t)(uint8_t *dst, const uint8_t *src,
+                             const uint8_t *lo, const uint8_t *hi,
+                             size_t len);
+
+static gf_mul_add_t gf_mul_add_impl;
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0)
+    return 0;
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) {
+  return gf_exp[255 - gf_log[a]];
+}
+
+/*
+   c * x is c * (x & 0x0f) ^ c * (x & 0xf0), so a multiplication by c is two
+   lookups in 16 entry tables, which fit in one vector register
+*/
+static void gf_mul_add_scalar(uint8_t *dst, const uint8_t *src,
+                              const uint8_t *lo, const uint8_t *hi,
+                              size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+  }
+}
+
+#ifdef FEC_X86
+__attribute__((target("ssse3")))
+static void gf_mul_add_ssse3(uint8_t *dst, const uint8_t *src,
+                             const uint8_t *lo, const uint8_t *hi,
+                             size_t len) {
+  __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+  __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+  __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i;
+  for (i = 0; i + 16 <= len; i += 16) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(s, mask));
+    __m128i h = _mm_shuffle_epi8(thi,
+                                 _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_xor_si128(d, _mm_xor_si128(l, h)));
+  }
+  gf_mul_add_scalar(dst + i, src + i, lo, hi, len - i);
+}
+
+__attribute__((target("avx2")))
+static void gf_mul_add_avx2(uint8_t *dst, const uint8_t *src,
+                            const uint8_t *lo, const uint8_t *hi,
+                            size_t len) {
+  // the shuffle works within each 128 bit lane, so both get the tables
+  __m256i tlo = _mm256_broadcastsi128_si256(
+                  _mm_loadu_si128((const __m128i *)lo));
+  __m256i thi = _mm256_broadcastsi128_si256(
+                  _mm_loadu_si128((const __m128i *)hi));
+  __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t i;
+  for (i = 0; i + 32 <= len; i += 32) {
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask));
+    __m256i h = _mm256_shuffle_epi8(thi,
+                  _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+  }
+  gf_mul_add_scalar(dst + i, src + i, lo, hi, len - i);
+}
+#endif
+
+#ifdef FEC_NEON
+static void gf_mul_add_neon(uint8_t *dst, const uint8_t *src,
+                            const uint8_t *lo, const uint8_t *hi,
+                            size_t len) {
+  uint8x16_t tlo = vld1q_u8(lo);
+  uint8x16_t thi = vld1q_u8(hi);
+  uint8x16_t mask = vdupq_n_u8(0x0f);
+  size_t i;
+  for (i = 0; i + 16 <= len; i += 16) {
+    uint8x16_t s = vld1q_u8(src + i);
+    uint8x16_t d = vld1q_u8(dst + i);
+    uint8x16_t l = vqtbl1q_u8(tlo, vandq_u8(s, mask));
+    uint8x16_t h = vqtbl1q_u8(thi, vshrq_n_u8(s, 4));
+    vst1q_u8(dst + i, veorq_u8(d, veorq_u8(l, h)));
+  }
+  gf_mul_add_scalar(dst + i, src + i, lo, hi, len - i);
+}
+#endif
+
+static void gf_init() {
+  int i, x = 1;
+  if (gf_mul_add_impl)
+    return;
+  for (i = 0; i < 255; i++) {
+    gf_exp[i] = x;
+    gf_log[x] = i;
+    x <<= 1;
+    if (x & 0x100)
+      x ^= GF_POLY;
+  }
+  for (i = 255; i < 512; i++) {
+    gf_exp[i] = gf_exp[i - 255];
+  }
+#if defined(FEC_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    gf_mul_add_impl = gf_mul_add_avx2;
+  else if (__builtin_cpu_supports("ssse3"))
+    gf_mul_add_impl = gf_mul_add_ssse3;
+  else
+    gf_mul_add_impl = gf_mul_add_scalar;
+#elif defined(FEC_NEON)
+  gf_mul_add_impl = gf_mul_add_neon;
+#else
+  gf_mul_add_impl = gf_mul_add_scalar;
+#endif
+}
+
+/* dst ^= c * src */
+static void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c,
+                       size_t len) {
+  uint8_t lo[16], hi[16];
+  int i;
+  if (c == 0)
+    return;
+  for (i = 0; i < 16; i++) {
+    lo[i] = gf_mul(c, i);
+    hi[i] = gf_mul(c, i << 4);
+  }
+  gf_mul_add_impl(dst, src, lo, hi, len);
+}
+
+/*
+   coefficient of data shard i in parity shard j. rows and columns come
+   from disjoint sets, so every square submatrix can be inverted
+*/
+static uint8_t fec_coef(int j, int i) {
+  return gf_inv((FEC_MAX_SHARDS + j) ^ i);
+}
+
+int fec_encoder_init(fec_encoder_t *enc, int k, int m, size_t max_len) {
+  gf_init();
+  bzero(enc, sizeof(fec_encoder_t));
+  if (k < 1 || m < 1 || k + m > FEC_MAX_SHARDS) {
+    errf("fec: k + m must be at most %d", FEC_MAX_SHARDS);
+    return -1;
+  }
+  enc->k = k;
+  enc->m = m;
+  enc->shard_size = 2 + max_len;
+  if (NULL == (enc->shards = malloc(enc->shard_size * k))) {
+    errf("fec: can not allocate %d shards", k);
+    return -1;
+  }
+  return 0;
+}
+
+void fec_encoder_destroy(fec_encoder_t *enc) {
+  free(enc->shards);
+  enc->shards = NULL;
+}
+
+static void fec_write_hdr(unsigned char *out, uint16_t group, int index,
+                          int k, int m) {
+  out[0] = FRAME_FEC;
+  out[1] = group >> 8;
+  out[2] = group & 0xff;
+  out[3] = index;
+  out[4] = k;
+  out[5] = m;
+}
+
+size_t fec_encode(fec_encoder_t *enc, const unsigned char *data, size_t len,
+                  unsigned char *out) {
+  unsigned char *shard = enc->shards + enc->shard_size * enc->count;
+  shard[0] = len >> 8;
+  shard[1] = len & 0xff;
+  memcpy(shard + 2, data, len);
+  if (2 + len > enc->max_len)
+    enc->max_len = 2 + len;
+  fec_write_hdr(out, enc->group, enc->count, enc->k, enc->m);
+  memcpy(out + FEC_HDR_LEN, data, len);
+  enc->count++;
+  return FEC_HDR_LEN + len;
+}
+
+size_t fec_parity(fec_encoder_t *enc, int j, unsigned char *out) {
+  unsigned char *parity = out + FEC_HDR_LEN;
+  int i;
+  fec_write_hdr(out, enc->group, enc->count + j, enc->count, enc->m);
+  bzero(parity, enc->max_len);
+  for (i = 0; i < enc->count; i++) {
+    unsigned char *shard = enc->shards + enc->shard_size * i;
+    size_t len = 2 + ((shard[0] << 8) | shard[1]);
+    // the padding is zero and adds nothing
+    gf_mul_add(parity, shard, fec_coef(j, i), len);
+  }
+  return FEC_HDR_LEN + enc->max_len;
+}
+
+void fec_next_group(fec_encoder_t *enc) {
+  enc->group++;
+  enc->count = 0;
+  enc->max_len = 0;
+}
+
+int fec_decoder_init(fec_decoder_t *dec, int k, int m, size_t max_len,
+                     uint64_t timeout) {
+  gf_init();
+  bzero(dec, sizeof(fec_decoder_t));
+  if (k < 1 || m < 1 || k + m > FEC_MAX_SHARDS) {
+    errf("fec: k + m must be at most %d", FEC_MAX_SHARDS);
+    return -1;
+  }
+  dec->k = k;
+  dec->m = m;
+  dec->timeout = timeout;
+  dec->shard_size = 2 + max_len;
+  dec->shards = malloc(dec->shard_size * (k + m) * FEC_RX_GROUPS);
+  if (dec->shards == NULL) {
+    errf("fec: can not allocate %d shards", (k + m) * FEC_RX_GROUPS);
+    return -1;
+  }
+  return 0;
+}
+
+void fec_decoder_destroy(fec_decoder_t *dec) {
+  free(dec->shards);
+  dec->shards = NULL;
+}
+
+static unsigned char *fec_shard(fec_decoder_t *dec, fec_group_t *g, int i) {
+  return dec->shards + dec->shard_size *
+         ((g - dec->groups) * (dec->k + dec->m) + i);
+}
+
+/* return NULL if the group is older than the one in its slot */
+static fec_group_t *fec_group(fec_decoder_t *dec, uint16_t group,
+                              uint64_t now) {
+  fec_group_t *g = &dec->groups[group % FEC_RX_GROUPS];
+  if (g->used && g->group == group && now < g->expires)
+    return g;
+  if (g->used && g->group != group && (int16_t)(group - g->group) < 0 &&
+      now < g->expires)
+    return NULL;
+  bzero(g, sizeof(fec_group_t));
+  g->used = 1;
+  g->group = group;
+  g->expires = now + dec->timeout;
+  return g;
+}
+
+static int popcount(uint64_t x) {
+  return __builtin_popcountll(x);
+}
+
+/* invert the n x n matrix a in place, return -1 if it is singular */
+static int gf_invert(uint8_t a[][FEC_MAX_SHARDS], int n) {
+  uint8_t inv[FEC_MAX_SHARDS][FEC_MAX_SHARDS];
+  int i, j, r;
+  bzero(inv, sizeof(inv));
+  for (i = 0; i < n; i++) {
+    inv[i][i] = 1;
+  }
+  for (i = 0; i < n; i++) {
+    uint8_t c;
+    for (r = i; r < n && a[r][i] == 0; r++);
+    if (r == n)
+      return -1;
+    if (r != i) {
+      for (j = 0; j < n; j++) {
+        uint8_t t = a[i][j];
+        a[i][j] = a[r][j];
+        a[r][j] = t;
+        t = inv[i][j];
+        inv[i][j] = inv[r][j];
+        inv[r][j] = t;
+      }
+    }
+    c = gf_inv(a[i][i]);
+    for (j = 0; j < n; j++) {
+      a[i][j] = gf_mul(a[i][j], c);
+      inv[i][j] = gf_mul(inv[i][j], c);
+    }
+    for (r = 0; r < n; r++) {
+      if (r == i || a[r][i] == 0)
+        continue;
+      c = a[r][i];
+      for (j = 0; j < n; j++) {
+        a[r][j] ^= gf_mul(a[i][j], c);
+        inv[r][j] ^= gf_mul(inv[i][j], c);
+      }
+    }
+  }
+  for (i = 0; i < n; i++) {
+    memcpy(a[i], inv[i], n);
+  }
+  return 0;
+}
+
+/* rebuild the missing data shards of g if enough shards have arrived */
+static void fec_recover(fec_decoder_t *dec, fec_group_t *g) {
+  uint8_t a[FEC_MAX_SHARDS][FEC_MAX_SHARDS];
+  int missing[FEC_MAX_SHARDS], rows[FEC_MAX_SHARDS];
+  uint64_t data_mask = (g->k == 64 ? ~0ULL : (1ULL << g->k) - 1);
+  size_t len = 0;
+  int n = 0, nrows = 0, i, j, r;
+
+  if (!g->has_parity || (g->have & data_mask) == data_mask ||
+      popcount(g->have) < g->k)
+    return;
+  for (i = 0; i < g->k; i++) {
+    if (!(g->have & (1ULL << i)))
+      missing[n++] = i;
+  }
+  for (j = 0; j < dec->m && nrows < n; j++) {
+    if (g->have & (1ULL << (dec->k + j))) {
+      rows[nrows++] = j;
+      len = g->lens[dec->k + j];
+    }
+  }
+
+  // parity minus what the data we have adds to it, in place
+  for (r = 0; r < n; r++) {
+    unsigned char *parity = fec_shard(dec, g, dec->k + rows[r]);
+    for (i = 0; i < g->k; i++) {
+      if (g->have & (1ULL << i))
+        gf_mul_add(parity, fec_shard(dec, g, i), fec_coef(rows[r], i),
+                   g->lens[i]);
+    }
+    for (i = 0; i < n; i++) {
+      a[r][i] = fec_coef(rows[r], missing[i]);
+    }
+  }
+  if (-1 == gf_invert(a, n))
+    return;
+  for (i = 0; i < n; i++) {
+    unsigned char *shard = fec_shard(dec, g, missing[i]);
+    size_t shard_len;
+    bzero(shard, len);
+    for (r = 0; r < n; r++) {
+      gf_mul_add(shard, fec_shard(dec, g, dec->k + rows[r]), a[i][r], len);
+    }
+    shard_len = 2 + ((shard[0] << 8) | shard[1]);
+    g->have |= 1ULL << missing[i];
+    if (shard_len <= len && shard_len > 2) {
+      g->lens[missing[i]] = shard_len;
+      g->recovered |= 1ULL << missing[i];
+    }
+  }
+  dec->last = g;
+}
+
+int fec_decode(fec_decoder_t *dec, const unsigned char *frame, size_t len,
+               uint64_t now, const unsigned char **data, size_t *data_len) {
+  uint16_t group;
+  int index, k, m, slot, deliver = 0;
+  fec_group_t *g;
+
+  dec->last = NULL;
+  if (len <= FEC_HDR_LEN)
+    return -1;
+  group = (frame[1] << 8) | frame[2];
+  index = frame[3];
+  k = frame[4];
+  m = frame[5];
+  if (k < 1 || k > dec->k || m != dec->m || index >= k + m)
+    return -1;
+  len -= FEC_HDR_LEN;
+  if (index < k) {
+    if (len + 2 > dec->shard_size)
+      return -1;
+    *data = frame + FEC_HDR_LEN;
+    *data_len = len;
+    deliver = 1;
+    slot = index;
+  } else {
+    if (len > dec->shard_size)
+      return -1;
+    slot = dec->k + index - k;
+  }
+
+  // too old to keep, deliver data anyway
+  if (NULL == (g = fec_group(dec, group, now)))
+    return deliver;
+  if (g->have & (1ULL << slot)) {
+    // a duplicate, or data we already rebuilt
+    return 0;
+  }
+  if (index < k) {
+    unsigned char *shard = fec_shard(dec, g, slot);
+    shard[0] = len >> 8;
+    shard[1] = len & 0xff;
+    memcpy(shard + 2, frame + FEC_HDR_LEN, len);
+    if (!g->has_parity)
+      g->k = k;
+  } else {
+    memcpy(fec_shard(dec, g, slot), frame + FEC_HDR_LEN, len);
+    // parity tells how many data shards the group really has
+    g->k = k;
+    g->has_parity = 1;
+  }
+  g->have |= 1ULL << slot;
+  g->lens[slot] = index < k ? 2 + len : len;
+  fec_recover(dec, g);
+  return deliver;
+}
+
+int fec_next_recovered(fec_decoder_t *dec, const unsigned char **data,
+                       size_t *data_len) {
+  fec_group_t *g = dec->last;
+  int i;
+  if (g == NULL || g->recovered == 0)
+    return 0;
+  i = __builtin_ctzll(g->recovered);
+  g->recovered &= g->recovered - 1;
+  *data = fec_shard(dec, g, i) + 2;
+  *data_len = g->lens[i] - 2;
+  return 1;
+}
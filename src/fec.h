@@ -0,0 +1,147 @@
+/**
+  fec.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+  Forward error correction over groups of datagrams.
+
+  After every k datagrams to a peer, m parity datagrams are sent. They are
+  computed with a systematic Reed-Solomon code over GF(256) built from a
+  Cauchy matrix, so that any k datagrams of a group are enough to rebuild
+  the others. Datagrams are delivered as soon as they arrive, only lost
+  ones wait for parity. A group that does not fill up within the timeout
+  gets its parity early, with k lowered to what was sent.
+
+  A shard is a datagram plaintext with its length in front, zero padded to
+  the longest one in the group. On the wire, each is a FRAME_FEC frame:
+
+    [type] [group 2] [index] [k] [m] [plaintext or parity]
+
+  where index is below k for data and k + j for parity j.
+
+  Multiplying a region by a constant is nearly all of the work, and is
+  done 16 or 32 bytes at a time with SSSE3, AVX2 or NEON table lookups
+  when the CPU has them.
+*/
+
+#define FEC_HDR_LEN 6
+
+/* max k + m */
+#define FEC_MAX_SHARDS 64
+
+/* groups the receiver keeps at a time */
+#define FEC_RX_GROUPS 4
+
+typedef struct {
+  int k;
+  int m;
+  uint16_t group;
+  // data shards in the current group
+  int count;
+  // longest shard in the current group, with its length
+  size_t max_len;
+  // k shards of shard_size bytes
+  size_t shard_size;
+  unsigned char *shards;
+} fec_encoder_t;
+
+typedef struct {
+  uint16_t group;
+  int used;
+  // data shards in the group, as told by parity if any has arrived
+  int k;
+  int has_parity;
+  // shards received or recovered, data i is bit i, parity j is bit k + j
+  // of the decoder's own k
+  uint64_t have;
+  // length of each shard with its length prefix, parity is padded
+  uint16_t lens[FEC_MAX_SHARDS];
+  // in ms
+  uint64_t expires;
+  // data shards recovered and not yet handed out
+  uint64_t recovered;
+} fec_group_t;
+
+typedef struct {
+  int k;
+  int m;
+  // in ms, how long a group is kept for parity to arrive
+  uint64_t timeout;
+  size_t shard_size;
+  fec_group_t groups[FEC_RX_GROUPS];
+  // FEC_RX_GROUPS * (k + m) shards of shard_size bytes
+  unsigned char *shards;
+  // group the last recovery was in, for fec_next_recovered()
+  fec_group_t *last;
+} fec_decoder_t;
+
+/*
+   max_len is the longest plaintext a shard will carry
+   return -1 on error
+*/
+int fec_encoder_init(fec_encoder_t *enc, int k, int m, size_t max_len);
+
+void fec_encoder_destroy(fec_encoder_t *enc);
+
+/*
+   wrap a plaintext as the next data shard of the current group into out,
+   which has room for FEC_HDR_LEN more bytes than len
+   return the length of the frame
+*/
+size_t fec_encode(fec_encoder_t *enc, const unsigned char *data, size_t len,
+                  unsigned char *out);
+
+/*
+   write parity shard j of the current group into out, which has room for
+   FEC_HDR_LEN + 2 more bytes than the longest plaintext
+   return the length of the frame
+*/
+size_t fec_parity(fec_encoder_t *enc, int j, unsigned char *out);
+
+/* start the next group, call after sending its parity */
+void fec_next_group(fec_encoder_t *enc);
+
+int fec_decoder_init(fec_decoder_t *dec, int k, int m, size_t max_len,
+                     uint64_t timeout);
+
+void fec_decoder_destroy(fec_decoder_t *dec);
+
+/*
+   take a FEC frame received at now, in ms
+   return 1 and set data and len to the plaintext if it should be delivered
+   now, 0 if not, -1 if the frame is malformed. then call
+   fec_next_recovered() until it returns 0
+*/
+int fec_decode(fec_decoder_t *dec, const unsigned char *frame, size_t len,
+               uint64_t now, const unsigned char **data, size_t *data_len);
+
+/*
+   return 1 and set data and len to a plaintext rebuilt by the last call
+   to fec_decode(), 0 if there are no more
+*/
+int fec_next_recovered(fec_decoder_t *dec, const unsigned char **data,
+                       size_t *data_len);
+
+#endif
@@ -0,0 +1,164 @@
+/**
+  frag.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "shadowvpn.h"
+
+#include <stdlib.h>
+
+int frag_count(size_t len, size_t room) {
+  size_t piece;
+  int count;
+  if (len <= room)
+    return 1;
+  if (room <= FRAG_HDR_LEN)
+    return 0;
+  piece = room - FRAG_HDR_LEN;
+  count = (len + piece - 1) / piece;
+  return count <= FRAG_MAX_PIECES ? count : 0;
+}
+
+/* length of every piece but the last */
+static size_t frag_piece_len(size_t len, int count) {
+  return (len + count - 1) / count;
+}
+
+size_t frag_piece(unsigned char *out, uint16_t id, int index, int count,
+                  const unsigned char *plaintext, size_t len) {
+  size_t piece = frag_piece_len(len, count);
+  size_t offset = index * piece;
+  size_t n = index == count - 1 ? len - offset : piece;
+
+  out[0] = FRAME_FRAGMENT;
+  out[1] = id >> 8;
+  out[2] = id & 0xff;
+  out[3] = index;
+  out[4] = count;
+  out[5] = len >> 8;
+  out[6] = len & 0xff;
+  memcpy(out + FRAG_HDR_LEN, plaintext + offset, n);
+  return FRAG_HDR_LEN + n;
+}
+
+int frag_rx_init(frag_rx_t *rx, size_t max_len, size_t token_len) {
+  bzero(rx, sizeof(frag_rx_t));
+  rx->max_len = max_len;
+  rx->token_len = token_len;
+  rx->bufs = malloc(FRAG_RX_SLOTS * (token_len + max_len));
+  if (rx->bufs == NULL) {
+    err("malloc");
+    return -1;
+  }
+  return 0;
+}
+
+void frag_rx_destroy(frag_rx_t *rx) {
+  free(rx->bufs);
+  rx->bufs = NULL;
+}
+
+/* the slot for plaintext id, a new one if it has none */
+static frag_slot_t *frag_slot(frag_rx_t *rx, uint16_t id, int *dropped) {
+  frag_slot_t *slot, *free_slot = NULL, *oldest = NULL;
+  int i;
+
+  for (i = 0; i < FRAG_RX_SLOTS; i++) {
+    slot = &rx->slots[i];
+    if (!slot->used) {
+      if (free_slot == NULL)
+        free_slot = slot;
+    } else if (slot->id == id) {
+      return slot;
+    } else if (oldest == NULL || slot->expires < oldest->expires) {
+      oldest = slot;
+    }
+  }
+  if (free_slot)
+    return free_slot;
+  (*dropped)++;
+  oldest->used = 0;
+  return oldest;
+}
+
+int frag_add(frag_rx_t *rx, const unsigned char *token,
+             const unsigned char *frame, size_t len, uint64_t now,
+             unsigned char **out, size_t *out_len, int *dropped) {
+  frag_slot_t *slot;
+  unsigned char *buf;
+  uint16_t id;
+  int index, count;
+  size_t total, piece, offset, n;
+
+  if (len <= FRAG_HDR_LEN)
+    return -1;
+  id = (frame[1] << 8) | frame[2];
+  index = frame[3];
+  count = frame[4];
+  total = (frame[5] << 8) | frame[6];
+  if (count < 2 || count > FRAG_MAX_PIECES || index >= count ||
+      total > rx->max_len || total < (size_t)count)
+    return -1;
+  piece = frag_piece_len(total, count);
+  offset = index * piece;
+  n = index == count - 1 ? total - offset : piece;
+  if (offset >= total || len - FRAG_HDR_LEN != n)
+    return -1;
+
+  slot = frag_slot(rx, id, dropped);
+  if (slot->used && (slot->count != count || slot->len != total)) {
+    // the same id for another plaintext, the old one is not coming
+    (*dropped)++;
+    slot->used = 0;
+  }
+  if (!slot->used) {
+    slot->used = 1;
+    slot->id = id;
+    slot->count = count;
+    slot->len = total;
+    slot->have = 0;
+    slot->expires = now + FRAG_TIMEOUT;
+  }
+  buf = rx->bufs + (slot - rx->slots) * (rx->token_len + rx->max_len);
+  memcpy(buf + rx->token_len + offset, frame + FRAG_HDR_LEN, n);
+  slot->have |= 1u << index;
+  if (slot->have != (1u << count) - 1)
+    return 0;
+  slot->used = 0;
+  memcpy(buf, token, rx->token_len);
+  *out = buf;
+  *out_len = rx->token_len + total;
+  return 1;
+}
+
+int frag_expire(frag_rx_t *rx, uint64_t now, uint64_t *next) {
+  int i, expired = 0;
+  *next = 0;
+  for (i = 0; i < FRAG_RX_SLOTS; i++) {
+    frag_slot_t *slot = &rx->slots[i];
+    if (!slot->used)
+      continue;
+    if (slot->expires <= now) {
+      slot->used = 0;
+      expired++;
+    } else if (*next == 0 || slot->expires < *next) {
+      *next = slot->expires;
+    }
+  }
+  return expired;
+}
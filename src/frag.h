@@ -0,0 +1,112 @@
+/**
+  frag.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef FRAG_H
+#define FRAG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+  Fragmentation of datagrams larger than the path to a peer takes.
+
+  A datagram plaintext, without its user token, that is too large is cut
+  into count pieces of the same size but the last, each sent as a datagram
+  of its own, so that each is encrypted and authenticated on its own. On
+  the wire, each is a FRAME_FRAGMENT frame:
+
+    [type] [id 2] [index] [count] [len 2] [piece]
+
+  where len is the length of the whole plaintext, in network order, and
+  piece index starts at index * ceil(len / count).
+
+  The receiver rebuilds at most FRAG_RX_SLOTS plaintexts of a peer at a
+  time, in buffers allocated once, so that memory does not grow with what
+  is sent to it. When all are in use, the oldest is dropped for a new one,
+  and one whose pieces do not all arrive within FRAG_TIMEOUT is dropped.
+*/
+
+#define FRAG_HDR_LEN 7
+
+/* pieces a plaintext is cut into at most */
+#define FRAG_MAX_PIECES 16
+
+/* plaintexts of a peer being rebuilt at a time */
+#define FRAG_RX_SLOTS 4
+
+/* in ms */
+#define FRAG_TIMEOUT 500
+
+typedef struct {
+  int used;
+  uint16_t id;
+  int count;
+  size_t len;
+  // piece i is bit i
+  uint32_t have;
+  // in ms
+  uint64_t expires;
+} frag_slot_t;
+
+typedef struct {
+  frag_slot_t slots[FRAG_RX_SLOTS];
+  // longest plaintext, and the user token in front of each
+  size_t max_len;
+  size_t token_len;
+  // FRAG_RX_SLOTS buffers of token_len + max_len bytes
+  unsigned char *bufs;
+} frag_rx_t;
+
+/*
+   how many pieces a plaintext of len bytes is cut into, so that each
+   frame is at most room bytes. 1 if it fits as is, 0 if it is too large
+*/
+int frag_count(size_t len, size_t room);
+
+/*
+   write piece index of count of the plaintext of len bytes as a frame to
+   out, return the length of the frame
+*/
+size_t frag_piece(unsigned char *out, uint16_t id, int index, int count,
+                  const unsigned char *plaintext, size_t len);
+
+/* return -1 on error */
+int frag_rx_init(frag_rx_t *rx, size_t max_len, size_t token_len);
+
+void frag_rx_destroy(frag_rx_t *rx);
+
+/*
+   add the frame of len bytes, with the user token in front
+   return 1 when it completes a plaintext, and set out and out_len to it
+   with the user token in front. it stays there until the next call
+   return 0 if pieces are missing, -1 if the frame is malformed
+   *dropped is increased by the incomplete plaintexts dropped for it
+*/
+int frag_add(frag_rx_t *rx, const unsigned char *token,
+             const unsigned char *frame, size_t len, uint64_t now,
+             unsigned char **out, size_t *out_len, int *dropped);
+
+/*
+   drop incomplete plaintexts that expired by now, return how many
+   *next is set to when the next one expires, 0 if none is left
+*/
+int frag_expire(frag_rx_t *rx, uint64_t now, uint64_t *next);
+
+#endif
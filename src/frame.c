@@ -0,0 +1,51 @@
+/**
+  frame.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "shadowvpn.h"
+
+size_t frame_bundle_add(unsigned char *buf, size_t len,
+                        const unsigned char *pkt, size_t pkt_len) {
+  if (len == 0) {
+    buf[0] = FRAME_BUNDLE;
+    len = 1;
+  }
+  buf[len] = pkt_len >> 8;
+  buf[len + 1] = pkt_len & 0xff;
+  memcpy(buf + len + FRAME_BUNDLE_HDR_LEN, pkt, pkt_len);
+  return len + FRAME_BUNDLE_HDR_LEN + pkt_len;
+}
+
+int frame_bundle_next(const unsigned char *buf, size_t len, size_t *offset,
+                      const unsigned char **pkt, size_t *pkt_len) {
+  size_t n;
+  if (*offset == 0)
+    *offset = 1;
+  if (*offset == len)
+    return 0;
+  if (*offset + FRAME_BUNDLE_HDR_LEN > len)
+    return -1;
+  n = (buf[*offset] << 8) | buf[*offset + 1];
+  if (n == 0 || *offset + FRAME_BUNDLE_HDR_LEN + n > len)
+    return -1;
+  *pkt = buf + *offset + FRAME_BUNDLE_HDR_LEN;
+  *pkt_len = n;
+  *offset += FRAME_BUNDLE_HDR_LEN + n;
+  return 1;
+}
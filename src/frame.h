@@ -0,0 +1,120 @@
+/**
+  frame.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+  What the plaintext of a datagram holds, after the optional user token.
+
+  A plaintext that starts with an IPv4 or IPv6 header is one IP packet, as
+  it has always been. Otherwise its first byte is a frame type below
+  FRAME_TYPE_MAX, which can never be the first byte of an IP header, and
+  the rest is up to the frame type:
+
+    FRAME_BUNDLE   [type] ([len 2] [IP packet])...
+                   several small packets sent as one datagram, len in
+                   network order
+    FRAME_FEC      [type] [group 2] [index] [k] [m] [data]
+                   a datagram plaintext or parity of a FEC group, see fec.h
+    FRAME_COMPRESSED
+                   [type] [len 2] [LZ4 block]
+                   an IP packet or a bundle, compressed, see compress.h
+    FRAME_PING     [type] [id] [seq 4] [time 8]
+                   a probe of the path id, see path.h, or a keepalive of
+                   the peer if id is FRAME_PING_PEER, see rtt.h
+    FRAME_PONG     the same as FRAME_PING
+                   the answer to a FRAME_PING, with its content echoed
+    FRAME_PMTU_PROBE
+                   [type] [seq 4] [zeros]
+                   a probe of the path MTU, as long as the size probed,
+                   see pmtu.h
+    FRAME_PMTU_ACK [type] [seq 4] [len 2]
+                   the answer to a FRAME_PMTU_PROBE, len is its length
+                   without the user token, in network order
+    FRAME_ANNOUNCE [type] [seq 8]
+                   where the client is now is where this came from, see
+                   roam.h, seq in network order
+    FRAME_ANNOUNCE_ACK
+                   the same as FRAME_ANNOUNCE
+                   the answer to a FRAME_ANNOUNCE, with the newest seq the
+                   server has seen
+    FRAME_FRAGMENT [type] [id 2] [index] [count] [len 2] [piece]
+                   a piece of a datagram plaintext too large for the path,
+                   see frag.h
+
+  Frames are only sent when the matching option is enabled, so both sides
+  have to enable it.
+*/
+
+#define FRAME_BUNDLE 0x01
+#define FRAME_FEC 0x02
+#define FRAME_COMPRESSED 0x03
+#define FRAME_PING 0x04
+#define FRAME_PONG 0x05
+#define FRAME_PMTU_PROBE 0x06
+#define FRAME_PMTU_ACK 0x07
+#define FRAME_ANNOUNCE 0x08
+#define FRAME_ANNOUNCE_ACK 0x09
+#define FRAME_FRAGMENT 0x0a
+
+#define FRAME_TYPE_MAX 0x40
+
+/*
+   bytes frames may add on top of mtu, buffers and datagrams are this much
+   larger than the largest IP packet
+*/
+#define FRAME_HEADROOM 16
+
+#define FRAME_PING_LEN 14
+#define FRAME_PING_PEER 0xff
+
+#define FRAME_PMTU_PROBE_MIN_LEN 5
+#define FRAME_PMTU_ACK_LEN 7
+
+#define FRAME_ANNOUNCE_LEN 9
+
+/* bytes a bundle adds to each packet in it */
+#define FRAME_BUNDLE_HDR_LEN 2
+
+/* return 1 if buf starts with an IPv4 or IPv6 header */
+static inline int frame_is_ip(const unsigned char *buf) {
+  return (buf[0] & 0xf0) == 0x40 || (buf[0] & 0xf0) == 0x60;
+}
+
+/*
+   append a packet to the bundle of len bytes in buf, which has room for it
+   return the new length of the bundle
+*/
+size_t frame_bundle_add(unsigned char *buf, size_t len,
+                        const unsigned char *pkt, size_t pkt_len);
+
+/*
+   iterate over the packets of a bundle, *offset starts at 0
+   return 1 and set pkt and pkt_len for each packet, 0 after the last one,
+   -1 if the bundle is malformed
+*/
+int frame_bundle_next(const unsigned char *buf, size_t len, size_t *offset,
+                      const unsigned char **pkt, size_t *pkt_len);
+
+#endif
@@ -0,0 +1,86 @@
+/**
+  io.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef IO_H
+#define IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef TARGET_WIN32
+#include "win32.h"
+#else
+#include <sys/socket.h>
+#endif
+
+/**
+  I/O backends of the event loop.
+
+  vpn_run() does all tun and UDP I/O through vpn_io_ops_t, and select()s
+  on ctx->tun, ctx->socks and ctx->addr_fd to know when to call them. A
+  backend only has to provide file descriptors that become readable when
+  it has something to read. All calls are non-blocking, and return -1
+  with errno set like read() and sendto() do.
+
+  vpn_ctx_init() sets up the kernel backend: a tun device and UDP sockets.
+  vpn_ctx_init_mock() sets up an in-memory one built on socketpairs, so
+  that the loop can be tested and benchmarked without root.
+*/
+
+typedef struct vpn_ctx_s vpn_ctx_t;
+
+typedef struct {
+  ssize_t (*read_tun)(vpn_ctx_t *ctx, void *buf, size_t len);
+  ssize_t (*write_tun)(vpn_ctx_t *ctx, void *buf, size_t len);
+  // i is the index into ctx->socks
+  ssize_t (*recv_udp)(vpn_ctx_t *ctx, int i, void *buf, size_t len,
+                      struct sockaddr *addr, socklen_t *addrlen);
+  ssize_t (*send_udp)(vpn_ctx_t *ctx, int i, const void *buf, size_t len,
+                      const struct sockaddr *addr, socklen_t addrlen);
+  // the IPv4 TOS or IPv6 traffic class of what socket i sends from now
+  // on, family is that of the addresses it sends to
+  int (*set_tos)(vpn_ctx_t *ctx, int i, int family, int tos);
+  // hint the kernel to pace what socket i sends to rate bytes per second
+  int (*set_pacing)(vpn_ctx_t *ctx, int i, uint64_t rate);
+  // read what made ctx->addr_fd readable, return 1 if local addresses or
+  // routes changed
+  int (*addr_changed)(vpn_ctx_t *ctx);
+  // release ctx->tun, ctx->socks and ctx->addr_fd
+  void (*close)(vpn_ctx_t *ctx);
+} vpn_io_ops_t;
+
+typedef struct {
+  // the other end of tun: write IP packets here for vpn_run() to read from
+  // tun, and read what vpn_run() writes to tun
+  int tun_peer;
+  // the other ends of ctx->socks, the same for datagrams
+  int *udp_peers;
+  int nsock;
+  // the other end of ctx->addr_fd in client mode with roaming, write a
+  // byte here for vpn_run() to see a change of the local address
+  int addr_peer;
+  // source address vpn_run() sees on datagrams written to udp_peers, and
+  // the server address in client mode
+  struct sockaddr_storage peer_addr;
+  socklen_t peer_addrlen;
+} vpn_io_mock_t;
+
+#endif
@@ -0,0 +1,217 @@
+/**
+  io_mock.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "shadowvpn.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifndef TARGET_WIN32
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static ssize_t mock_tun_read(vpn_ctx_t *ctx, void *buf, size_t len) {
+  return recv(ctx->tun, buf, len, 0);
+}
+
+static ssize_t mock_tun_write(vpn_ctx_t *ctx, void *buf, size_t len) {
+  return send(ctx->tun, buf, len, 0);
+}
+
+static ssize_t mock_udp_recv(vpn_ctx_t *ctx, int i, void *buf, size_t len,
+                             struct sockaddr *addr, socklen_t *addrlen) {
+  vpn_io_mock_t *mock = ctx->io_data;
+  ssize_t r = recv(ctx->socks[i], buf, len, 0);
+  if (r >= 0) {
+    memcpy(addr, &mock->peer_addr, mock->peer_addrlen);
+    *addrlen = mock->peer_addrlen;
+  }
+  return r;
+}
+
+static ssize_t mock_udp_send(vpn_ctx_t *ctx, int i, const void *buf,
+                             size_t len, const struct sockaddr *addr,
+                             socklen_t addrlen) {
+  // there is only one peer
+  return send(ctx->socks[i], buf, len, 0);
+}
+
+static int mock_udp_tos(vpn_ctx_t *ctx, int i, int family, int tos) {
+  return 0;
+}
+
+static int mock_udp_pacing(vpn_ctx_t *ctx, int i, uint64_t rate) {
+  return 0;
+}
+
+static int mock_addr_changed(vpn_ctx_t *ctx) {
+  char buf[16];
+  int changed = 0;
+  while (recv(ctx->addr_fd, buf, sizeof(buf), 0) > 0)
+    changed = 1;
+  return changed;
+}
+
+static void mock_close(vpn_ctx_t *ctx) {
+  int i;
+  close(ctx->tun);
+  for (i = 0; i < ctx->nsock; i++) {
+    close(ctx->socks[i]);
+  }
+  if (ctx->addr_fd != -1)
+    close(ctx->addr_fd);
+}
+
+static const vpn_io_ops_t mock_ops = {
+  mock_tun_read,
+  mock_tun_write,
+  mock_udp_recv,
+  mock_udp_send,
+  mock_udp_tos,
+  mock_udp_pacing,
+  mock_addr_changed,
+  mock_close
+};
+
+/* a datagram socketpair, non-blocking on our side */
+static int mock_pair(int *ours, int *theirs) {
+  int fds[2];
+  int flags;
+  if (-1 == socketpair(AF_UNIX, SOCK_DGRAM, 0, fds)) {
+    err("socketpair");
+    return -1;
+  }
+  flags = fcntl(fds[0], F_GETFL, 0);
+  if (flags == -1 || -1 == fcntl(fds[0], F_SETFL, flags | O_NONBLOCK)) {
+    err("fcntl");
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  *ours = fds[0];
+  *theirs = fds[1];
+  return 0;
+}
+
+/* undo a vpn_ctx_init_mock() that failed after npairs UDP pairs */
+static void mock_undo(vpn_ctx_t *ctx, vpn_io_mock_t *mock, int npairs) {
+  int i;
+  close(ctx->control_pipe[0]);
+  close(ctx->control_pipe[1]);
+  if (ctx->tun != -1) {
+    close(ctx->tun);
+    close(mock->tun_peer);
+  }
+  for (i = 0; i < npairs; i++) {
+    close(ctx->socks[i]);
+    close(mock->udp_peers[i]);
+  }
+  free(ctx->socks);
+  free(ctx->sock_drops);
+  free(ctx->sock_dscp);
+  free(mock->udp_peers);
+  free(ctx->multipath.paths);
+  ctx->socks = NULL;
+  ctx->sock_drops = NULL;
+  ctx->sock_dscp = NULL;
+  mock->udp_peers = NULL;
+  ctx->multipath.paths = NULL;
+}
+
+int vpn_ctx_init_mock(vpn_ctx_t *ctx, shadowvpn_args_t *args,
+                      vpn_io_mock_t *mock) {
+  struct sockaddr_in *peer = (struct sockaddr_in *)&mock->peer_addr;
+  int i;
+
+  bzero(ctx, sizeof(vpn_ctx_t));
+  bzero(mock, sizeof(vpn_io_mock_t));
+  ctx->remote_addrp = (struct sockaddr *)&ctx->remote_addr;
+  ctx->args = args;
+  ctx->io_ops = &mock_ops;
+  ctx->io_data = mock;
+  ctx->tun = -1;
+  ctx->addr_fd = -1;
+
+  // any address will do, it is never used for routing
+  peer->sin_family = AF_INET;
+  peer->sin_port = htons(args->port ? args->port : 1123);
+  peer->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  mock->peer_addrlen = sizeof(struct sockaddr_in);
+  if (args->mode == SHADOWVPN_MODE_CLIENT) {
+    memcpy(ctx->remote_addrp, peer, mock->peer_addrlen);
+    ctx->remote_addrlen = mock->peer_addrlen;
+  }
+
+  if (-1 == pipe(ctx->control_pipe)) {
+    err("pipe");
+    return -1;
+  }
+  if (-1 == mock_pair(&ctx->tun, &mock->tun_peer)) {
+    mock_undo(ctx, mock, 0);
+    return -1;
+  }
+  ctx->nsock = mock->nsock = 1;
+  if (args->mode == SHADOWVPN_MODE_CLIENT && args->paths_len > 0) {
+    // one socket per path, all of them reach the same peer
+    if (-1 == multipath_init(&ctx->multipath, args)) {
+      mock_undo(ctx, mock, 0);
+      return -1;
+    }
+    for (i = 0; i < ctx->multipath.npaths; i++) {
+      memcpy(&ctx->multipath.paths[i].addr, peer, mock->peer_addrlen);
+      ctx->multipath.paths[i].addrlen = mock->peer_addrlen;
+    }
+    ctx->nsock = mock->nsock = args->paths_len;
+  }
+  ctx->socks = calloc(ctx->nsock, sizeof(int));
+  ctx->sock_drops = calloc(ctx->nsock, sizeof(uint64_t));
+  ctx->sock_dscp = calloc(ctx->nsock, sizeof(uint8_t));
+  mock->udp_peers = calloc(ctx->nsock, sizeof(int));
+  if (ctx->socks == NULL || ctx->sock_drops == NULL ||
+      ctx->sock_dscp == NULL || mock->udp_peers == NULL) {
+    err("calloc");
+    mock_undo(ctx, mock, 0);
+    return -1;
+  }
+  for (i = 0; i < ctx->nsock; i++) {
+    if (-1 == mock_pair(&ctx->socks[i], &mock->udp_peers[i])) {
+      mock_undo(ctx, mock, i);
+      return -1;
+    }
+  }
+  if (args->mode == SHADOWVPN_MODE_CLIENT && args->roaming &&
+      -1 == mock_pair(&ctx->addr_fd, &mock->addr_peer)) {
+    mock_undo(ctx, mock, ctx->nsock);
+    return -1;
+  }
+  return 0;
+}
+
+#else
+
+int vpn_ctx_init_mock(vpn_ctx_t *ctx, shadowvpn_args_t *args,
+                      vpn_io_mock_t *mock) {
+  errf("the mock backend is currently not supported on Windows");
+  return -1;
+}
+
+#endif
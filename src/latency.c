@@ -0,0 +1,134 @@
+/**
+  latency.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "shadowvpn.h"
+
+#include <time.h>
+#ifndef TARGET_WIN32
+#include <sys/time.h>
+#endif
+
+static const char *stage_names[LATENCY_STAGES] = {
+  "tun_read",
+  "nat_down",
+  "queue",
+  "encrypt",
+  "sendto",
+  "recvfrom",
+  "decrypt",
+  "nat_up",
+  "tun_write"
+};
+
+void latency_init(latency_t *latency, uint32_t every) {
+  bzero(latency, sizeof(latency_t));
+  latency->every = every;
+  latency->countdown_down = every;
+  latency->countdown_up = every;
+}
+
+uint64_t latency_now_ns() {
+#ifdef TARGET_WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER counter;
+  if (freq.QuadPart == 0)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)((double)counter.QuadPart * 1e9 / freq.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/*
+   values below LATENCY_SUB get a bucket each, after that every power of
+   two is split into LATENCY_SUB buckets
+*/
+static int bucket_of(uint64_t ns) {
+  int msb, shift, i;
+  if (ns < LATENCY_SUB)
+    return ns;
+  msb = 63 - __builtin_clzll(ns);
+  shift = msb - LATENCY_SUB_BITS;
+  i = (shift + 1) * LATENCY_SUB + ((ns >> shift) & (LATENCY_SUB - 1));
+  return i < LATENCY_BUCKETS ? i : LATENCY_BUCKETS - 1;
+}
+
+static uint64_t bucket_upper(int i) {
+  int shift;
+  if (i < LATENCY_SUB)
+    return i;
+  shift = i / LATENCY_SUB - 1;
+  return (((uint64_t)LATENCY_SUB + i % LATENCY_SUB + 1) << shift) - 1;
+}
+
+void latency_record(latency_t *latency, latency_stage_t stage, uint64_t ns) {
+  latency_hist_record(&latency->hists[stage], ns);
+}
+
+void latency_hist_record(latency_hist_t *hist, uint64_t ns) {
+  STATS_ADD(hist->count, 1);
+  STATS_ADD(hist->sum_ns, ns);
+  STATS_ADD(hist->buckets[bucket_of(ns)], 1);
+  if (ns > hist->max_ns)
+    STATS_ADD(hist->max_ns, ns - hist->max_ns);
+}
+
+const char *latency_stage_name(latency_stage_t stage) {
+  return stage_names[stage];
+}
+
+void latency_read(const latency_hist_t *hist, latency_hist_t *out) {
+  int i;
+  out->count = STATS_LOAD(hist->count);
+  out->sum_ns = STATS_LOAD(hist->sum_ns);
+  out->max_ns = STATS_LOAD(hist->max_ns);
+  for (i = 0; i < LATENCY_BUCKETS; i++) {
+    out->buckets[i] = STATS_LOAD(hist->buckets[i]);
+  }
+}
+
+uint64_t latency_quantile(const latency_hist_t *hist, double q) {
+  uint64_t total = 0, seen = 0, want;
+  int i;
+  for (i = 0; i < LATENCY_BUCKETS; i++) {
+    total += hist->buckets[i];
+  }
+  if (total == 0)
+    return 0;
+  want = (uint64_t)(q * total);
+  if (want < 1)
+    want = 1;
+  for (i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= want) {
+      // nothing was above max_ns, which also caps the last bucket
+      uint64_t upper = bucket_upper(i);
+      return upper < hist->max_ns ? upper : hist->max_ns;
+    }
+  }
+  return hist->max_ns;
+}
@@ -0,0 +1,107 @@
+/**
+  latency.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+#include "stats.h"
+
+/**
+  Latency histograms of each stage of the packet path.
+
+  One in every `latency_sample` packets is timed with a monotonic clock at
+  each stage it goes through. Each stage has a log-linear histogram in the
+  spirit of HdrHistogram: LATENCY_SUB buckets per power of two, so any
+  recorded value is off by at most 1/LATENCY_SUB. With sampling disabled
+  the datapath only pays for one branch per packet.
+
+  Like metrics_t, histograms are written only by the thread running
+  vpn_run() and can be read from any thread.
+*/
+
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+
+/* covers up to 2^42 ns, about 73 minutes */
+#define LATENCY_BUCKETS (40 * LATENCY_SUB)
+
+typedef enum {
+  // downstream, tun to UDP
+  LATENCY_TUN_READ = 0,
+  LATENCY_NAT_DOWN,
+  LATENCY_QUEUE,
+  LATENCY_ENCRYPT,
+  LATENCY_SENDTO,
+  // upstream, UDP to tun
+  LATENCY_RECVFROM,
+  LATENCY_DECRYPT,
+  LATENCY_NAT_UP,
+  LATENCY_TUN_WRITE,
+  LATENCY_STAGES
+} latency_stage_t;
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t buckets[LATENCY_BUCKETS];
+} latency_hist_t;
+
+typedef struct {
+  // sample one in every this many packets, 0 disables sampling
+  uint32_t every;
+  // packets to go until the next sample, for each direction
+  uint32_t countdown_down;
+  uint32_t countdown_up;
+  latency_hist_t hists[LATENCY_STAGES];
+} latency_t;
+
+void latency_init(latency_t *latency, uint32_t every);
+
+/* monotonic time in ns */
+uint64_t latency_now_ns();
+
+/* return 1 if the next packet should be timed */
+static inline int latency_sample(latency_t *latency, uint32_t *countdown) {
+  if (!latency->every)
+    return 0;
+  if (--*countdown)
+    return 0;
+  *countdown = latency->every;
+  return 1;
+}
+
+void latency_record(latency_t *latency, latency_stage_t stage, uint64_t ns);
+
+/* add a value to a histogram that is not one of the stages */
+void latency_hist_record(latency_hist_t *hist, uint64_t ns);
+
+/* name of a stage, e.g. "encrypt" */
+const char *latency_stage_name(latency_stage_t stage);
+
+/* copy a histogram written by another thread */
+void latency_read(const latency_hist_t *hist, latency_hist_t *out);
+
+/* upper bound of the bucket holding the q-th quantile, in ns */
+uint64_t latency_quantile(const latency_hist_t *hist, double q);
+
+#endif
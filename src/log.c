@@ -19,10 +19,271 @@
 */
 
 #include <time.h>
+#include <stdarg.h>
+#include <stdlib.h>
 #include "shadowvpn.h"
 
+#ifndef TARGET_WIN32
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
+#define LOG_ASYNC
+#endif
+
 int verbose_mode;
 
+/* must be a power of 2 */
+#define LOG_RING_SIZE 512
+#define LOG_LINE_LEN 256
+
+static int async_running;
+
+/* call sites that have suppressed something, see log_limit_t */
+static log_limit_t *limits;
+
+#ifdef LOG_ASYNC
+
+typedef struct {
+  // == position + 1 when the line is ready for the log thread
+  unsigned long seq;
+  FILE *out;
+  time_t time;
+  char line[LOG_LINE_LEN];
+} log_slot_t;
+
+/*
+   a bounded multi-producer ring (D. Vyukov's), producers may be any thread
+   or a signal handler, the log thread is the only consumer
+*/
+static log_slot_t ring[LOG_RING_SIZE];
+static unsigned long ring_head;
+static unsigned long ring_tail;
+/* lines lost because the ring was full */
+static unsigned long ring_dropped;
+
+static int async_stopping;
+static pthread_t log_thread_id;
+
+/*
+   the log thread blocks on wake_pipe while the ring is empty, and sets
+   log_waiting before it does, so that only the first line after that
+   costs a write()
+*/
+static int wake_pipe[2] = {-1, -1};
+static int log_waiting;
+
+#endif
+
+static void log_register(log_limit_t *limit) {
+  int expected = 0;
+  if (limit->registered ||
+      !__atomic_compare_exchange_n(&limit->registered, &expected, 1, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    return;
+  limit->next = __atomic_load_n(&limits, __ATOMIC_ACQUIRE);
+  while (!__atomic_compare_exchange_n(&limits, &limit->next, limit, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+   return 0 if this line should be suppressed, otherwise set *suppressed
+   to the number of lines suppressed since the last one
+   races between threads only make the count a bit off
+*/
+static int log_limit_pass(log_limit_t *limit, unsigned int *suppressed) {
+  time_t now = time(NULL);
+  *suppressed = 0;
+  if (limit->second != now) {
+    limit->second = now;
+    limit->count = 0;
+    *suppressed = __atomic_exchange_n(&limit->suppressed, 0,
+                                      __ATOMIC_RELAXED);
+  }
+  if (limit->count >= LOG_RATE_LIMIT) {
+    __atomic_add_fetch(&limit->suppressed, 1, __ATOMIC_RELAXED);
+    log_register(limit);
+    return 0;
+  }
+  limit->count++;
+  return 1;
+}
+
+#ifdef LOG_ASYNC
+
+/* return -1 if the ring is full */
+static int ring_push(FILE *out, unsigned int suppressed, const char *fmt,
+                     va_list ap) {
+  log_slot_t *slot;
+  unsigned long pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+  int len;
+
+  while (1) {
+    slot = &ring[pos & (LOG_RING_SIZE - 1)];
+    long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      __atomic_add_fetch(&ring_dropped, 1, __ATOMIC_RELAXED);
+      return -1;
+    } else {
+      pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    }
+  }
+  slot->out = out;
+  slot->time = time(NULL);
+  len = vsnprintf(slot->line, LOG_LINE_LEN, fmt, ap);
+  if (suppressed && len >= 0 && len < LOG_LINE_LEN)
+    snprintf(slot->line + len, LOG_LINE_LEN - len,
+             " (%u similar messages suppressed)", suppressed);
+  // ordered with log_waiting, see log_wait()
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&log_waiting, 0, __ATOMIC_SEQ_CST)) {
+    char c = 0;
+    // async-signal-safe, and the pipe is non-blocking
+    if (-1 == write(wake_pipe[1], &c, 1)) {
+      // full, the log thread is being woken anyway
+    }
+  }
+  return 0;
+}
+
+/* ctime() format, only called by the log thread */
+static const char *format_time(time_t t) {
+  static time_t last_time;
+  static char time_str[32];
+  // most lines come in bursts within the same second
+  if (t != last_time || time_str[0] == 0) {
+    struct tm tm;
+    last_time = t;
+    localtime_r(&t, &tm);
+    strftime(time_str, sizeof(time_str), "%a %b %e %H:%M:%S %Y", &tm);
+  }
+  return time_str;
+}
+
+/* write out ready lines, return how many */
+static int ring_drain() {
+  int n = 0;
+
+  while (1) {
+    log_slot_t *slot = &ring[ring_tail & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring_tail + 1)
+      break;
+    fprintf(slot->out, "%s %s\n", format_time(slot->time), slot->line);
+    __atomic_store_n(&slot->seq, ring_tail + LOG_RING_SIZE,
+                     __ATOMIC_RELEASE);
+    ring_tail++;
+    n++;
+  }
+  return n;
+}
+
+/* return 1 if some call site has suppressed lines left to report */
+static int report_suppressed(time_t now) {
+  log_limit_t *limit = __atomic_load_n(&limits, __ATOMIC_ACQUIRE);
+  unsigned long dropped;
+  int pending = 0;
+  for (; limit; limit = limit->next) {
+    unsigned int n;
+    // the call site reports by itself while it is still logging
+    if (limit->second == now) {
+      if (__atomic_load_n(&limit->suppressed, __ATOMIC_RELAXED))
+        pending = 1;
+      continue;
+    }
+    n = __atomic_exchange_n(&limit->suppressed, 0, __ATOMIC_RELAXED);
+    if (n)
+      fprintf(stderr, "%s %s:%d %u similar messages suppressed\n",
+              format_time(now), limit->file, limit->line, n);
+  }
+  dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped)
+    fprintf(stderr, "%s %lu log messages dropped\n", format_time(now),
+            dropped);
+  return pending;
+}
+
+/*
+   block until a line is pushed or log_stop_async() is called, or for at
+   most a second if pending, so that suppressed lines get reported
+*/
+static void log_wait(int pending) {
+  log_slot_t *slot = &ring[ring_tail & (LOG_RING_SIZE - 1)];
+  struct timeval tv;
+  fd_set readset;
+  char buf[64];
+
+  // a producer that pushed before it could see log_waiting is seen here
+  __atomic_store_n(&log_waiting, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != ring_tail + 1) {
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    FD_ZERO(&readset);
+    FD_SET(wake_pipe[0], &readset);
+    select(wake_pipe[0] + 1, &readset, NULL, NULL, pending ? &tv : NULL);
+  }
+  __atomic_store_n(&log_waiting, 0, __ATOMIC_SEQ_CST);
+  while (read(wake_pipe[0], buf, sizeof(buf)) > 0);
+}
+
+static void *log_thread(void *data) {
+  time_t last_report = 0;
+  int pending = 0;
+
+  while (1) {
+    int stopping = __atomic_load_n(&async_stopping, __ATOMIC_ACQUIRE);
+    int n;
+    time_t now = time(NULL);
+    n = ring_drain();
+    if (now != last_report) {
+      pending = report_suppressed(now);
+      last_report = now;
+    }
+    if (n) {
+      fflush(stdout);
+      fflush(stderr);
+    } else if (stopping) {
+      break;
+    } else {
+      log_wait(pending);
+    }
+  }
+  return NULL;
+}
+
+#endif
+
+static void log_vwrite(FILE *out, unsigned int suppressed, const char *fmt,
+                       va_list ap) {
+#ifdef LOG_ASYNC
+  if (__atomic_load_n(&async_running, __ATOMIC_ACQUIRE)) {
+    // when full the line is counted and dropped, never block
+    ring_push(out, suppressed, fmt, ap);
+    return;
+  }
+#endif
+  log_timestamp(out);
+  vfprintf(out, fmt, ap);
+  if (suppressed)
+    fprintf(out, " (%u similar messages suppressed)", suppressed);
+  fprintf(out, "\n");
+  fflush(out);
+}
+
+void log_printf(FILE *out, log_limit_t *limit, const char *fmt, ...) {
+  va_list ap;
+  unsigned int suppressed = 0;
+  if (limit && !log_limit_pass(limit, &suppressed))
+    return;
+  va_start(ap, fmt);
+  log_vwrite(out, suppressed, fmt, ap);
+  va_end(ap);
+}
+
 void log_timestamp(FILE *out) {
   time_t now;
   time(&now);
@@ -31,22 +292,26 @@ void log_timestamp(FILE *out) {
   fprintf(out, "%s ", time_str);
 }
 
-void perror_timestamp(const char *msg, const char *file, int line) {
-  log_timestamp(stderr);
-  fprintf(stderr, "%s:%d ", file, line);
+void perror_timestamp(const char *msg, const char *file, int line,
+                      log_limit_t *limit) {
 #ifdef TARGET_WIN32
+  int e = WSAGetLastError();
   LPVOID *err_str = NULL;
   FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |
                 FORMAT_MESSAGE_IGNORE_INSERTS,
-                NULL, WSAGetLastError(),
+                NULL, e,
                 MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
                 (LPTSTR) &err_str, 0, NULL);
   if (err_str != NULL) {
-    fprintf(stderr, "%s: %s\n", msg, (char *)err_str);
+    // the message ends with \r\n
+    strtok((char *)err_str, "\r\n");
+    log_printf(stderr, limit, "%s:%d %s: %s", file, line, msg,
+               (char *)err_str);
     LocalFree(err_str);
   }
 #else
-  perror(msg);
+  int e = errno;
+  log_printf(stderr, limit, "%s:%d %s: %s", file, line, msg, strerror(e));
 #endif
 }
 
@@ -61,3 +326,66 @@ void print_hex_memory(void *mem, size_t len) {
   printf("\n");
 }
 
+#ifdef LOG_ASYNC
+
+int log_start_async() {
+  sigset_t all, old;
+  int i, r;
+
+  if (async_running)
+    return 0;
+  for (i = 0; i < LOG_RING_SIZE; i++) {
+    ring[i].seq = i;
+  }
+  ring_head = ring_tail = 0;
+  async_stopping = 0;
+  log_waiting = 0;
+  // kept open once made, a producer that raced log_stop_async() may
+  // still write to it
+  if (wake_pipe[0] == -1) {
+    if (-1 == pipe(wake_pipe)) {
+      err("pipe");
+      return -1;
+    }
+    for (i = 0; i < 2; i++) {
+      fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+      fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+  }
+  // signals are for the datapath thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  r = pthread_create(&log_thread_id, NULL, log_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (r != 0) {
+    errf("can not create log thread");
+    return -1;
+  }
+  __atomic_store_n(&async_running, 1, __ATOMIC_RELEASE);
+  atexit(log_stop_async);
+  return 0;
+}
+
+void log_stop_async() {
+  char c = 0;
+  if (!__atomic_exchange_n(&async_running, 0, __ATOMIC_ACQ_REL))
+    return;
+  // new lines are written synchronously from now on, the thread writes
+  // out what is left in the ring
+  __atomic_store_n(&async_stopping, 1, __ATOMIC_RELEASE);
+  if (-1 == write(wake_pipe[1], &c, 1)) {
+    // full, the log thread is being woken anyway
+  }
+  pthread_join(log_thread_id, NULL);
+}
+
+#else
+
+int log_start_async() {
+  return 0;
+}
+
+void log_stop_async() {
+}
+
+#endif
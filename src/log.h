@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 
 extern int verbose_mode;
 
@@ -33,17 +34,44 @@ extern int verbose_mode;
    logf:   same as printf to stdout with timestamp and \n,
            and only enabled when verbose is on
    debugf: same as logf but only compiles with DEBUG flag
+
+   err and errf are rate limited per call site, so that a flood of bad
+   packets can not turn into a flood of log lines. After log_start_async(),
+   messages are formatted into a lock-free ring and written out by a
+   background thread, so the datapath never blocks on a log write.
 */
 
-#define __LOG(o, not_stderr, s...) do {                           \
+/* max lines per second from one err or errf call site */
+#define LOG_RATE_LIMIT 10
+
+typedef struct log_limit_s log_limit_t;
+
+/* one per call site, static and zero initialized */
+struct log_limit_s {
+  const char *file;
+  int line;
+  // suppressed messages are reported by the log thread, which keeps
+  // every call site that ever suppressed anything in a list
+  int registered;
+  log_limit_t *next;
+  time_t second;
+  unsigned int count;
+  unsigned int suppressed;
+};
+
+#define __LOG(o, not_stderr, limit, s...) do {                    \
   if (not_stderr || verbose_mode) {                               \
-    log_timestamp(o);                                             \
-    fprintf(o, s);                                                \
-    fprintf(o, "\n");                                             \
-    fflush(o);                                                    \
+    log_printf(o, limit, s);                                      \
   }                                                               \
 } while (0)
 
+#define __LOG_LIMITED(o, s...) do {                               \
+  static log_limit_t log_limit_ = {                               \
+    .file = __FILE__, .line = __LINE__                            \
+  };                                                              \
+  __LOG(o, 1, &log_limit_, s);                                    \
+} while (0)
+
 #ifdef HAVE_ANDROID_LOG
 #include <android/log.h>
 #define logf(s...) \
@@ -57,9 +85,14 @@ extern int verbose_mode;
 
 #else
 
-#define logf(s...) __LOG(stdout, 0, s)
-#define errf(s...) __LOG(stderr, 1, s)
-#define err(s) perror_timestamp(s, __FILE__, __LINE__)
+#define logf(s...) __LOG(stdout, 0, NULL, s)
+#define errf(s...) __LOG_LIMITED(stderr, s)
+#define err(s) do {                                               \
+  static log_limit_t log_limit_ = {                               \
+    .file = __FILE__, .line = __LINE__                            \
+  };                                                              \
+  perror_timestamp(s, __FILE__, __LINE__, &log_limit_);           \
+} while (0)
 
 #endif
 
@@ -69,8 +102,22 @@ extern int verbose_mode;
 #define debugf(s...)
 #endif
 
+/* write a line with timestamp, limit may be NULL */
+void log_printf(FILE *out, log_limit_t *limit, const char *fmt, ...)
+  __attribute__ ((format (printf, 3, 4)));
+
 void log_timestamp(FILE *out);
-void perror_timestamp(const char *msg, const char *file, int line);
+void perror_timestamp(const char *msg, const char *file, int line,
+                      log_limit_t *limit);
 void print_hex_memory(void *mem, size_t len);
 
+/*
+   start the log thread, call it after daemon_start() since threads do not
+   survive fork(). return -1 on error, logging stays synchronous then
+*/
+int log_start_async();
+
+/* write out everything pending and stop the log thread */
+void log_stop_async();
+
 #endif
@@ -46,6 +46,8 @@ BOOL WINAPI sig_handler(DWORD signo)
 static void sig_handler(int signo) {
   if (signo == SIGINT)
     exit(1);  // for gprof
+  else if (signo == SIGUSR1)
+    vpn_request_stats(&vpn_ctx);
   else
     vpn_stop(&vpn_ctx);
 }
@@ -99,10 +101,17 @@ int main(int argc, char **argv) {
 #else
   signal(SIGINT, sig_handler);
   signal(SIGTERM, sig_handler);
+  signal(SIGUSR1, sig_handler);
 #endif
 
+  // after daemon_start(), the log thread would not survive fork()
+  log_start_async();
+
   if (-1 == vpn_ctx_init(&vpn_ctx, &args)) {
+    log_stop_async();
     return EXIT_FAILURE;
   }
-  return vpn_run(&vpn_ctx);
+  int r = vpn_run(&vpn_ctx);
+  log_stop_async();
+  return r;
 }
@@ -0,0 +1,704 @@
+/**
+  metrics.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "shadowvpn.h"
+#include "portable_endian.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifndef TARGET_WIN32
+#include <signal.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#ifdef TARGET_LINUX
+#include <linux/sock_diag.h>
+#endif
+
+void metrics_printf(metrics_buf_t *buf, const char *fmt, ...) {
+  va_list ap;
+  int n;
+  while (1) {
+    va_start(ap, fmt);
+    n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      return;
+    if (buf->len + n < buf->cap) {
+      buf->len += n;
+      return;
+    }
+    char *data = realloc(buf->data, buf->cap * 2 + n);
+    if (data == NULL)
+      return;
+    buf->data = data;
+    buf->cap = buf->cap * 2 + n;
+  }
+}
+
+void metrics_append(metrics_buf_t *buf, const void *data, size_t len) {
+  if (buf->len + len > buf->cap) {
+    char *grown = realloc(buf->data, buf->cap * 2 + len);
+    if (grown == NULL)
+      return;
+    buf->data = grown;
+    buf->cap = buf->cap * 2 + len;
+  }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+void metrics_write(metrics_buf_t *buf, const char *name, const char *type,
+                   const char *help, uint64_t value) {
+  metrics_printf(buf, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+                 name, help, name, type, name, (unsigned long long)value);
+}
+
+#ifndef TARGET_WIN32
+
+#define METRICS_TEXT "text/plain; version=0.0.4"
+
+static void metrics_render_users(metrics_buf_t *buf, vpn_ctx_t *ctx) {
+  static const char *names[] = {
+    "shadowvpn_user_rx_packets_total",
+    "shadowvpn_user_rx_bytes_total",
+    "shadowvpn_user_tx_packets_total",
+    "shadowvpn_user_tx_bytes_total",
+    "shadowvpn_user_drops_total",
+    "shadowvpn_user_roams_total",
+    "shadowvpn_user_rtt_us",
+    "shadowvpn_user_jitter_us",
+    "shadowvpn_user_loss_permille",
+    "shadowvpn_user_mtu_bytes"
+  };
+  static const char *helps[] = {
+    "IP packets received from the user.",
+    "IP bytes received from the user.",
+    "IP packets sent to the user.",
+    "IP bytes sent to the user.",
+    "Packets to or from the user that were dropped.",
+    "Times the address of the user changed.",
+    "Smoothed RTT to the user, from keepalive probes.",
+    "RTT jitter to the user, from keepalive probes.",
+    "Keepalive probes to the user that were lost, in 1/1000.",
+    "Largest IP packet that gets through to the user."
+  };
+  client_info_t *client, *tmp;
+  client_stats_t stats;
+  int i;
+
+  if (ctx->nat_ctx == NULL) {
+    // the only peer
+    stats_read(&ctx->stats, &stats);
+    metrics_write(buf, "shadowvpn_peer_rtt_us", "gauge",
+                  "Smoothed RTT to the peer, from keepalive probes.",
+                  stats.rtt_us);
+    metrics_write(buf, "shadowvpn_peer_jitter_us", "gauge",
+                  "RTT jitter to the peer, from keepalive probes.",
+                  stats.jitter_us);
+    metrics_write(buf, "shadowvpn_peer_loss_permille", "gauge",
+                  "Keepalive probes to the peer that were lost, in 1/1000.",
+                  stats.loss_permille);
+    metrics_write(buf, "shadowvpn_peer_mtu_bytes", "gauge",
+                  "Largest IP packet that gets through to the peer.",
+                  stats.mtu);
+    metrics_write(buf, "shadowvpn_peer_roams_total", "counter",
+                  "Times the address of the client changed.", stats.roams);
+    return;
+  }
+  metrics_write(buf, "shadowvpn_users_connected", "gauge",
+                "Users with a known address.", ctx->nat_ctx->nconnected);
+  for (i = 0; i < 10; i++) {
+    metrics_printf(buf, "# HELP %s %s\n# TYPE %s %s\n",
+                   names[i], helps[i], names[i], i < 6 ? "counter" : "gauge");
+    // clients are never added or removed after nat_init, so it is safe
+    // to walk the hash from this thread
+    HASH_ITER(hh1, ctx->nat_ctx->token_to_clients, client, tmp) {
+      uint64_t values[10];
+      stats_read(&client->stats, &stats);
+      values[0] = stats.rx_packets;
+      values[1] = stats.rx_bytes;
+      values[2] = stats.tx_packets;
+      values[3] = stats.tx_bytes;
+      values[4] = stats.drops;
+      values[5] = stats.roams;
+      values[6] = stats.rtt_us;
+      values[7] = stats.jitter_us;
+      values[8] = stats.loss_permille;
+      values[9] = stats.mtu;
+      metrics_printf(buf, "%s{user=\"%016llx\"} %llu\n", names[i],
+                     (unsigned long long)htobe64(
+                       *((uint64_t *)client->user_token)),
+                     (unsigned long long)values[i]);
+    }
+  }
+}
+
+#ifdef TARGET_LINUX
+/* read a counter of the tun device from sysfs, -1 if not available */
+static int64_t read_tun_stat(const char *intf, const char *name) {
+  char path[128];
+  FILE *fp;
+  long long value;
+  snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s", intf,
+           name);
+  if (NULL == (fp = fopen(path, "r")))
+    return -1;
+  if (1 != fscanf(fp, "%lld", &value))
+    value = -1;
+  fclose(fp);
+  return value;
+}
+#endif
+
+/* what the kernel knows about our sockets and tun, sampled on each scrape */
+static void metrics_render_kernel(metrics_buf_t *buf, vpn_ctx_t *ctx) {
+  int i;
+
+  metrics_printf(buf, "# HELP shadowvpn_socket_rxq_overflow_total "
+                 "Datagrams dropped because the receive queue was full.\n"
+                 "# TYPE shadowvpn_socket_rxq_overflow_total counter\n");
+  for (i = 0; i < ctx->nsock; i++) {
+    metrics_printf(buf, "shadowvpn_socket_rxq_overflow_total{sock=\"%d\"} "
+                   "%llu\n", i,
+                   (unsigned long long)STATS_LOAD(ctx->sock_drops[i]));
+  }
+
+#if defined(TARGET_LINUX) && defined(SO_MEMINFO)
+  static const struct {
+    int index;
+    const char *name;
+    const char *type;
+    const char *help;
+  } meminfo[] = {
+    { SK_MEMINFO_RMEM_ALLOC, "shadowvpn_socket_rmem_bytes", "gauge",
+      "Bytes queued in the receive buffer." },
+    { SK_MEMINFO_RCVBUF, "shadowvpn_socket_rcvbuf_bytes", "gauge",
+      "Size of the receive buffer." },
+    { SK_MEMINFO_WMEM_ALLOC, "shadowvpn_socket_wmem_bytes", "gauge",
+      "Bytes queued in the send buffer." },
+    { SK_MEMINFO_SNDBUF, "shadowvpn_socket_sndbuf_bytes", "gauge",
+      "Size of the send buffer." },
+    { SK_MEMINFO_DROPS, "shadowvpn_socket_drops_total", "counter",
+      "Datagrams the kernel dropped on the socket." }
+  };
+  uint32_t (*mem)[SK_MEMINFO_VARS];
+  int j;
+
+  if (NULL == (mem = calloc(ctx->nsock, sizeof(*mem))))
+    return;
+  for (i = 0; i < ctx->nsock; i++) {
+    socklen_t len = sizeof(mem[i]);
+    getsockopt(ctx->socks[i], SOL_SOCKET, SO_MEMINFO, mem[i], &len);
+  }
+  for (j = 0; j < sizeof(meminfo) / sizeof(meminfo[0]); j++) {
+    metrics_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", meminfo[j].name,
+                   meminfo[j].help, meminfo[j].name, meminfo[j].type);
+    for (i = 0; i < ctx->nsock; i++) {
+      metrics_printf(buf, "%s{sock=\"%d\"} %u\n", meminfo[j].name, i,
+                     mem[i][meminfo[j].index]);
+    }
+  }
+  free(mem);
+#endif
+
+#ifdef TARGET_LINUX
+  // tun tx is towards us, it drops when we do not read fast enough
+  int64_t tx_dropped = read_tun_stat(ctx->args->intf, "tx_dropped");
+  int64_t rx_dropped = read_tun_stat(ctx->args->intf, "rx_dropped");
+  if (tx_dropped >= 0)
+    metrics_write(buf, "shadowvpn_tun_kernel_tx_dropped_total", "counter",
+                  "Packets the tun device dropped before we read them.",
+                  tx_dropped);
+  if (rx_dropped >= 0)
+    metrics_write(buf, "shadowvpn_tun_kernel_rx_dropped_total", "counter",
+                  "Packets we wrote that the tun device dropped.",
+                  rx_dropped);
+#endif
+}
+
+static void metrics_render_latency(metrics_buf_t *buf, vpn_ctx_t *ctx) {
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1 };
+  latency_hist_t *hist;
+  int i, j;
+
+  if (!ctx->latency.every)
+    return;
+  // 2.5KB per copy, keep it off the stack of this small thread
+  if (NULL == (hist = malloc(sizeof(latency_hist_t))))
+    return;
+  metrics_printf(buf, "# HELP shadowvpn_latency_seconds "
+                 "Time sampled packets spent in each stage.\n"
+                 "# TYPE shadowvpn_latency_seconds summary\n");
+  for (i = 0; i < LATENCY_STAGES; i++) {
+    const char *stage = latency_stage_name(i);
+    latency_read(&ctx->latency.hists[i], hist);
+    for (j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); j++) {
+      uint64_t ns = quantiles[j] < 1 ? latency_quantile(hist, quantiles[j]) :
+                    hist->max_ns;
+      metrics_printf(buf, "shadowvpn_latency_seconds{stage=\"%s\","
+                     "quantile=\"%g\"} %.9f\n", stage, quantiles[j],
+                     ns / 1e9);
+    }
+    metrics_printf(buf, "shadowvpn_latency_seconds_sum{stage=\"%s\"} %.9f\n"
+                   "shadowvpn_latency_seconds_count{stage=\"%s\"} %llu\n",
+                   stage, hist->sum_ns / 1e9, stage,
+                   (unsigned long long)hist->count);
+  }
+  free(hist);
+}
+
+static void metrics_render(metrics_buf_t *buf, vpn_ctx_t *ctx) {
+  metrics_t *m = &ctx->metrics;
+  uint64_t cumulative = 0;
+  int i;
+
+  metrics_write(buf, "shadowvpn_select_wakeups_total", "counter",
+                "Wakeups of the event loop.", STATS_LOAD(m->select_wakeups));
+  metrics_write(buf, "shadowvpn_tun_rx_packets_total", "counter",
+                "Packets read from tun.", STATS_LOAD(m->tun_rx_packets));
+  metrics_write(buf, "shadowvpn_tun_rx_bytes_total", "counter",
+                "Bytes read from tun.", STATS_LOAD(m->tun_rx_bytes));
+  metrics_write(buf, "shadowvpn_tun_tx_packets_total", "counter",
+                "Packets written to tun.", STATS_LOAD(m->tun_tx_packets));
+  metrics_write(buf, "shadowvpn_tun_tx_bytes_total", "counter",
+                "Bytes written to tun.", STATS_LOAD(m->tun_tx_bytes));
+  metrics_write(buf, "shadowvpn_udp_rx_packets_total", "counter",
+                "Datagrams received.", STATS_LOAD(m->udp_rx_packets));
+  metrics_write(buf, "shadowvpn_udp_rx_bytes_total", "counter",
+                "Bytes of datagrams received.", STATS_LOAD(m->udp_rx_bytes));
+  metrics_write(buf, "shadowvpn_udp_tx_packets_total", "counter",
+                "Datagrams sent.", STATS_LOAD(m->udp_tx_packets));
+  metrics_write(buf, "shadowvpn_udp_tx_bytes_total", "counter",
+                "Bytes of datagrams sent.", STATS_LOAD(m->udp_tx_bytes));
+  metrics_write(buf, "shadowvpn_decrypt_failures_total", "counter",
+                "Datagrams that failed to decrypt.",
+                STATS_LOAD(m->decrypt_failures));
+  metrics_write(buf, "shadowvpn_nat_misses_total", "counter",
+                "Packets NAT could not map to a user.",
+                STATS_LOAD(m->nat_misses));
+  metrics_write(buf, "shadowvpn_eagain_drops_total", "counter",
+                "Packets dropped because sendto or tun would block.",
+                STATS_LOAD(m->eagain_drops));
+  metrics_write(buf, "shadowvpn_queue_drops_total", "counter",
+                "Packets from tun dropped because queues are full.",
+                STATS_LOAD(m->queue_drops));
+  metrics_write(buf, "shadowvpn_bundles_tx_total", "counter",
+                "Datagrams sent with several packets in them.",
+                STATS_LOAD(m->bundles_tx));
+  metrics_write(buf, "shadowvpn_bundled_packets_total", "counter",
+                "Packets sent in bundles.", STATS_LOAD(m->bundled_packets));
+  metrics_write(buf, "shadowvpn_frame_errors_total", "counter",
+                "Received frames that were malformed or unknown.",
+                STATS_LOAD(m->frame_errors));
+  metrics_write(buf, "shadowvpn_fec_parity_tx_total", "counter",
+                "FEC parity datagrams sent.", STATS_LOAD(m->fec_parity_tx));
+  metrics_write(buf, "shadowvpn_fec_recovered_total", "counter",
+                "Lost datagrams rebuilt from FEC parity.",
+                STATS_LOAD(m->fec_recovered));
+  metrics_write(buf, "shadowvpn_compressed_tx_total", "counter",
+                "Datagrams sent compressed.", STATS_LOAD(m->compressed_tx));
+  metrics_write(buf, "shadowvpn_compress_saved_bytes_total", "counter",
+                "Bytes saved by compression.",
+                STATS_LOAD(m->compress_saved_bytes));
+  metrics_write(buf, "shadowvpn_compress_bypassed_total", "counter",
+                "Datagrams not compressed because similar traffic did not "
+                "compress.", STATS_LOAD(m->compress_bypassed));
+  metrics_write(buf, "shadowvpn_pmtu_probes_tx_total", "counter",
+                "Path MTU probes sent.", STATS_LOAD(m->pmtu_probes_tx));
+  metrics_write(buf, "shadowvpn_pmtu_too_big_total", "counter",
+                "Packets over the path MTU answered with an ICMP error.",
+                STATS_LOAD(m->pmtu_too_big));
+  metrics_write(buf, "shadowvpn_pacer_delays_total", "counter",
+                "Times the pacer held datagrams back.",
+                STATS_LOAD(m->pacer_delays));
+  metrics_write(buf, "shadowvpn_roam_announces_total", "counter",
+                "Announces of where we are sent to the server.",
+                STATS_LOAD(m->roam_announces_tx));
+  metrics_write(buf, "shadowvpn_fragmented_total", "counter",
+                "Datagrams sent in pieces because the path is too small.",
+                STATS_LOAD(m->fragmented_tx));
+  metrics_write(buf, "shadowvpn_reassembled_total", "counter",
+                "Datagrams put back together from pieces.",
+                STATS_LOAD(m->reassembled));
+  metrics_write(buf, "shadowvpn_reassembly_drops_total", "counter",
+                "Datagrams dropped with pieces missing.",
+                STATS_LOAD(m->reassembly_drops));
+  metrics_write(buf, "shadowvpn_pacing_rate_bytes", "gauge",
+                "Rate datagrams are paced to, in bytes per second, 0 if not "
+                "paced.", STATS_LOAD(m->pacing_rate));
+
+  metrics_printf(buf, "# HELP shadowvpn_sendto_errors_total "
+                 "Failed sendto calls by errno.\n"
+                 "# TYPE shadowvpn_sendto_errors_total counter\n");
+  for (i = 0; i <= METRICS_ERRNO_MAX; i++) {
+    uint64_t value = STATS_LOAD(m->sendto_errors[i]);
+    if (value)
+      metrics_printf(buf, "shadowvpn_sendto_errors_total{errno=\"%d\"} %llu\n",
+                     i, (unsigned long long)value);
+  }
+
+  metrics_printf(buf, "# HELP shadowvpn_tun_batch_size "
+                 "Packets read from tun per wakeup.\n"
+                 "# TYPE shadowvpn_tun_batch_size histogram\n");
+  for (i = 0; i < METRICS_BATCH_BUCKETS; i++) {
+    cumulative += STATS_LOAD(m->tun_batches[i]);
+    if (i < METRICS_BATCH_BUCKETS - 1)
+      metrics_printf(buf, "shadowvpn_tun_batch_size_bucket{le=\"%d\"} %llu\n",
+                     (2 << i) - 1, (unsigned long long)cumulative);
+  }
+  metrics_printf(buf, "shadowvpn_tun_batch_size_bucket{le=\"+Inf\"} %llu\n"
+                 "shadowvpn_tun_batch_size_sum %llu\n"
+                 "shadowvpn_tun_batch_size_count %llu\n",
+                 (unsigned long long)cumulative,
+                 (unsigned long long)STATS_LOAD(m->tun_rx_packets),
+                 (unsigned long long)cumulative);
+
+  metrics_render_kernel(buf, ctx);
+  metrics_render_users(buf, ctx);
+  metrics_render_latency(buf, ctx);
+}
+
+static void metrics_reply(int fd, const char *status, const char *type,
+                          metrics_buf_t *body) {
+  char header[256];
+  int flags = 0;
+  size_t sent = 0;
+#ifdef MSG_NOSIGNAL
+  flags = MSG_NOSIGNAL;
+#endif
+  snprintf(header, sizeof(header), "HTTP/1.0 %s\r\n"
+           "Content-Type: %s\r\n"
+           "Content-Length: %lu\r\n\r\n", status, type,
+           (unsigned long)body->len);
+  if (-1 == send(fd, header, strlen(header), flags))
+    return;
+  while (sent < body->len) {
+    ssize_t r = send(fd, body->data + sent, body->len - sent, flags);
+    if (r <= 0)
+      return;
+    sent += r;
+  }
+}
+
+/*
+   POST /capture/start?user=<token>&encrypted=1, both optional
+   POST /capture/stop
+   GET /capture.pcapng
+*/
+static void metrics_handle_capture(int fd, vpn_ctx_t *ctx, int post,
+                                   char *path, char *query,
+                                   metrics_buf_t *body) {
+  capture_t *capture = &ctx->capture;
+
+  if ((strcmp(path, ".pcapng") == 0) == post) {
+    // a GET must not change anything
+    metrics_printf(body, "method not allowed\n");
+    metrics_reply(fd, "405 Method Not Allowed", METRICS_TEXT, body);
+  } else if (strcmp(path, ".pcapng") == 0) {
+    capture_dump(capture, body);
+    metrics_reply(fd, "200 OK", "application/octet-stream", body);
+  } else if (strcmp(path, "/start") == 0) {
+    char *user = NULL, *param, *saveptr = NULL;
+    int encrypted = 0;
+    for (param = query ? strtok_r(query, "&", &saveptr) : NULL; param;
+         param = strtok_r(NULL, "&", &saveptr)) {
+      if (strncmp(param, "user=", 5) == 0)
+        user = param + 5;
+      else if (strcmp(param, "encrypted=1") == 0)
+        encrypted = 1;
+    }
+    if (-1 == capture_start(capture, user, encrypted)) {
+      metrics_printf(body, "can not start capture\n");
+      metrics_reply(fd, "400 Bad Request", METRICS_TEXT, body);
+      return;
+    }
+    metrics_printf(body, "capture started\n");
+    metrics_reply(fd, "200 OK", METRICS_TEXT, body);
+  } else if (strcmp(path, "/stop") == 0) {
+    capture_stop(capture);
+    metrics_printf(body, "capture stopped\n");
+    metrics_reply(fd, "200 OK", METRICS_TEXT, body);
+  } else {
+    metrics_printf(body, "not found\n");
+    metrics_reply(fd, "404 Not Found", METRICS_TEXT, body);
+  }
+}
+
+static void metrics_handle(metrics_server_t *server, int fd) {
+  char req[1024];
+  size_t len = 0;
+  char *path, *end, *query;
+  metrics_buf_t body;
+  int post;
+  struct timeval tv;
+
+  tv.tv_sec = 1;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+  // we only need the request line
+  while (len < sizeof(req) - 1) {
+    ssize_t r = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+    if (r <= 0)
+      return;
+    len += r;
+    req[len] = 0;
+    if (strstr(req, "\r\n") || strchr(req, '\n'))
+      break;
+  }
+  req[len] = 0;
+
+  body.len = 0;
+  body.cap = 4096;
+  if (NULL == (body.data = malloc(body.cap)))
+    return;
+
+  post = strncmp(req, "POST ", 5) == 0;
+  path = strchr(req, ' ');
+  if ((strncmp(req, "GET ", 4) != 0 && !post) || path == NULL) {
+    metrics_printf(&body, "bad request\n");
+    metrics_reply(fd, "400 Bad Request", METRICS_TEXT, &body);
+  } else {
+    path++;
+    end = strpbrk(path, " \r\n");
+    if (end)
+      *end = 0;
+    query = strchr(path, '?');
+    if (query)
+      *query++ = 0;
+    if (strcmp(path, "/metrics") == 0 || strcmp(path, "/") == 0) {
+      metrics_render(&body, server->vpn_ctx);
+      metrics_reply(fd, "200 OK", METRICS_TEXT, &body);
+    } else if (strncmp(path, "/capture", 8) == 0 && server->unix_path) {
+      // packets are in the clear, only for who can reach the socket file
+      metrics_handle_capture(fd, ((vpn_ctx_t *)server->vpn_ctx), post,
+                             path + 8, query, &body);
+    } else {
+      metrics_printf(&body, "not found\n");
+      metrics_reply(fd, "404 Not Found", METRICS_TEXT, &body);
+    }
+  }
+  free(body.data);
+}
+
+static void *metrics_thread(void *data) {
+  metrics_server_t *server = data;
+  fd_set readset;
+  int max_fd = server->fd > server->stop_pipe[0] ?
+               server->fd : server->stop_pipe[0];
+
+  while (1) {
+    FD_ZERO(&readset);
+    FD_SET(server->fd, &readset);
+    FD_SET(server->stop_pipe[0], &readset);
+    if (-1 == select(max_fd + 1, &readset, NULL, NULL, NULL)) {
+      if (errno == EINTR)
+        continue;
+      err("select");
+      break;
+    }
+    if (FD_ISSET(server->stop_pipe[0], &readset))
+      break;
+    if (FD_ISSET(server->fd, &readset)) {
+      int fd = accept(server->fd, NULL, NULL);
+      if (fd == -1)
+        continue;
+      metrics_handle(server, fd);
+      close(fd);
+    }
+  }
+  return NULL;
+}
+
+// the metrics are not authenticated, TCP is only served to this host
+static int metrics_loopback(const struct sockaddr *addr) {
+  if (addr->sa_family == AF_INET) {
+    const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+    return (ntohl(in->sin_addr.s_addr) >> 24) == 127;
+  }
+  if (addr->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+    return IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr);
+  }
+  return 0;
+}
+
+static int metrics_listen(metrics_server_t *server, const char *listen_addr) {
+  int fd;
+  if (strncmp(listen_addr, "unix:", 5) == 0) {
+    struct sockaddr_un addr;
+    const char *path = listen_addr + 5;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      errf("metrics: socket path too long: %s", path);
+      return -1;
+    }
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (-1 == (fd = socket(AF_UNIX, SOCK_STREAM, 0))) {
+      err("socket");
+      return -1;
+    }
+    // left by a previous run
+    unlink(path);
+    if (0 != bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+      err("bind");
+      errf("metrics: can not bind %s", path);
+      close(fd);
+      return -1;
+    }
+    chmod(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    server->unix_path = strdup(path);
+  } else {
+    struct addrinfo hints;
+    struct addrinfo *res;
+    char host[256];
+    char *port;
+    int r, on = 1;
+
+    strncpy(host, listen_addr, sizeof(host) - 1);
+    host[sizeof(host) - 1] = 0;
+    port = strrchr(host, ':');
+    if (port == NULL) {
+      errf("metrics: expect unix:/path or host:port, got %s", listen_addr);
+      return -1;
+    }
+    *port++ = 0;
+    // [::1]:9100
+    if (host[0] == '[' && port - host >= 3 && port[-2] == ']') {
+      port[-2] = 0;
+      memmove(host, host + 1, strlen(host));
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (0 != (r = getaddrinfo(host, port, &hints, &res))) {
+      errf("getaddrinfo: %s", gai_strerror(r));
+      return -1;
+    }
+    if (!metrics_loopback(res->ai_addr)) {
+      errf("metrics: %s is not a loopback address", listen_addr);
+      freeaddrinfo(res);
+      return -1;
+    }
+    if (-1 == (fd = socket(res->ai_family, SOCK_STREAM, 0))) {
+      err("socket");
+      freeaddrinfo(res);
+      return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (0 != bind(fd, res->ai_addr, res->ai_addrlen)) {
+      err("bind");
+      errf("metrics: can not bind %s", listen_addr);
+      freeaddrinfo(res);
+      close(fd);
+      return -1;
+    }
+    freeaddrinfo(res);
+  }
+  if (0 != listen(fd, 16)) {
+    err("listen");
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+static void metrics_close(metrics_server_t *server) {
+  close(server->fd);
+  if (server->stop_pipe[0] != -1) {
+    close(server->stop_pipe[0]);
+    close(server->stop_pipe[1]);
+  }
+  if (server->unix_path) {
+    unlink(server->unix_path);
+    free(server->unix_path);
+    server->unix_path = NULL;
+  }
+}
+
+int metrics_server_start(metrics_server_t *server, const char *listen_addr,
+                         void *vpn_ctx) {
+  sigset_t all, old;
+  int r;
+
+  bzero(server, sizeof(metrics_server_t));
+  server->vpn_ctx = vpn_ctx;
+  if (-1 == (server->fd = metrics_listen(server, listen_addr)))
+    return -1;
+  if (-1 == pipe(server->stop_pipe)) {
+    err("pipe");
+    server->stop_pipe[0] = server->stop_pipe[1] = -1;
+    metrics_close(server);
+    return -1;
+  }
+  // signals are for the datapath thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  r = pthread_create(&server->thread, NULL, metrics_thread, server);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (r != 0) {
+    errf("metrics: can not create thread");
+    metrics_close(server);
+    return -1;
+  }
+  server->running = 1;
+  logf("metrics: listening on %s", listen_addr);
+  return 0;
+}
+
+void metrics_server_stop(metrics_server_t *server) {
+  char buf = 0;
+  if (!server->running)
+    return;
+  if (1 == write(server->stop_pipe[1], &buf, 1))
+    pthread_join(server->thread, NULL);
+  metrics_close(server);
+  server->running = 0;
+}
+
+#else
+
+int metrics_server_start(metrics_server_t *server, const char *listen_addr,
+                         void *vpn_ctx) {
+  errf("warning: metrics is currently not supported on Windows");
+  bzero(server, sizeof(metrics_server_t));
+  return 0;
+}
+
+void metrics_server_stop(metrics_server_t *server) {
+}
+
+#endif
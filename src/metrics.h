@@ -0,0 +1,142 @@
+/**
+  metrics.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef TARGET_WIN32
+#include <pthread.h>
+#endif
+
+#include "stats.h"
+
+/**
+  Datapath counters, served in Prometheus text format.
+
+  Like client_stats_t, counters are written only by the thread running
+  vpn_run() and read by the metrics thread, which listens on a Unix socket
+  or a loopback TCP port and answers each HTTP request with a snapshot.
+  metrics_server_start() fails for a TCP address that is not loopback.
+*/
+
+#define METRICS_ADD(field, n) STATS_ADD(field, n)
+
+/* errno >= this is counted as METRICS_ERRNO_MAX */
+#define METRICS_ERRNO_MAX 128
+
+/* tun read batch sizes, 1, 2-3, 4-7, ..., 64 */
+#define METRICS_BATCH_BUCKETS 8
+
+typedef struct {
+  uint64_t select_wakeups;
+  uint64_t tun_rx_packets;
+  uint64_t tun_rx_bytes;
+  uint64_t tun_tx_packets;
+  uint64_t tun_tx_bytes;
+  uint64_t udp_rx_packets;
+  uint64_t udp_rx_bytes;
+  uint64_t udp_tx_packets;
+  uint64_t udp_tx_bytes;
+  uint64_t decrypt_failures;
+  uint64_t nat_misses;
+  // sendto or write to tun would block
+  uint64_t eagain_drops;
+  // queue full or no free packet
+  uint64_t queue_drops;
+  // datagrams carrying several packets, and the packets in them
+  uint64_t bundles_tx;
+  uint64_t bundled_packets;
+  // frames that could not be parsed
+  uint64_t frame_errors;
+  // FEC parity datagrams sent, and lost datagrams rebuilt from parity
+  uint64_t fec_parity_tx;
+  uint64_t fec_recovered;
+  // datagrams sent compressed and the bytes it saved, and those sent as is
+  // because their class does not compress
+  uint64_t compressed_tx;
+  uint64_t compress_saved_bytes;
+  uint64_t compress_bypassed;
+  // path MTU probes sent, and ICMP errors sent back for packets over it
+  uint64_t pmtu_probes_tx;
+  uint64_t pmtu_too_big;
+  // times the pacer held datagrams back, and its rate in bytes per second
+  uint64_t pacer_delays;
+  uint64_t pacing_rate;
+  // announces of where we are, see roam.h
+  uint64_t roam_announces_tx;
+  // datagrams sent in pieces, put back together, and dropped incomplete
+  uint64_t fragmented_tx;
+  uint64_t reassembled;
+  uint64_t reassembly_drops;
+  uint64_t sendto_errors[METRICS_ERRNO_MAX + 1];
+  uint64_t tun_batches[METRICS_BATCH_BUCKETS];
+} __attribute__((aligned(STATS_CACHE_LINE))) metrics_t;
+
+/* a growing buffer that metrics are rendered into */
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} metrics_buf_t;
+
+void metrics_printf(metrics_buf_t *buf, const char *fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+
+void metrics_append(metrics_buf_t *buf, const void *data, size_t len);
+
+/* write # HELP, # TYPE and the value of a metric without labels */
+void metrics_write(metrics_buf_t *buf, const char *name, const char *type,
+                   const char *help, uint64_t value);
+
+static inline void metrics_add_batch(metrics_t *metrics, int n) {
+  int i = 0;
+  while (n > 1 && i < METRICS_BATCH_BUCKETS - 1) {
+    n >>= 1;
+    i++;
+  }
+  METRICS_ADD(metrics->tun_batches[i], 1);
+}
+
+typedef struct {
+  int fd;
+#ifndef TARGET_WIN32
+  int stop_pipe[2];
+  pthread_t thread;
+#endif
+  int running;
+  // vpn_ctx_t to render
+  void *vpn_ctx;
+  // unlinked on stop
+  char *unix_path;
+} metrics_server_t;
+
+/*
+   listen on "unix:/path/to/socket" or "host:port"
+   return -1 on error
+*/
+int metrics_server_start(metrics_server_t *server, const char *listen,
+                         void *vpn_ctx);
+
+void metrics_server_stop(metrics_server_t *server);
+
+#endif
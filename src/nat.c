@@ -34,14 +34,35 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+static void ip6_assign(uint8_t *out, const uint8_t *net, const uint8_t *mask,
+                       uint64_t n, int shift);
+
+static void nat_client_idle(tw_timer_t *timer, void *data);
+
 int nat_init(nat_ctx_t *ctx, shadowvpn_args_t *args) {
   int i;
   bzero(ctx, sizeof(nat_ctx_t));
+  ctx->idle_timeout = (uint64_t)args->idle_timeout * 1000;
+  if (args->has_net6) {
+    ctx->has_net6 = 1;
+    for (i = 0; i < args->user_prefix6; i++) {
+      ctx->prefix6_mask[i / 8] |= 0x80 >> (i % 8);
+    }
+  }
   for (i = 0; i < args->user_tokens_len; i++) {
-    client_info_t *client = malloc(sizeof(client_info_t));
+    client_info_t *client;
+    // stats must not share a cache line with anything else
+    if (0 != posix_memalign((void **)&client, STATS_CACHE_LINE,
+                            sizeof(client_info_t))) {
+      errf("nat: can not allocate client");
+      return -1;
+    }
     bzero(client, sizeof(client_info_t));
 
     memcpy(client->user_token, args->user_tokens[i], SHADOWVPN_USERTOKEN_LEN);
+    client->id = i;
+    client->ctx = ctx;
+    timer_init(&client->idle_timer, nat_client_idle, client);
 
     // assign IP based on tun IP and user tokens
     // for example:
@@ -53,7 +74,7 @@ int nat_init(nat_ctx_t *ctx, shadowvpn_args_t *args) {
     in.s_addr = client->output_tun_ip;
     logf("assigning %s to user %16llx",
          inet_ntoa(in),
-         htobe64(*((uint64_t *)args->user_tokens[i])));
+         (unsigned long long)htobe64(*((uint64_t *)args->user_tokens[i])));
 
     // add to hash: ctx->token_to_clients[user_token] = client
     HASH_ADD(hh1, ctx->token_to_clients, user_token,
@@ -61,10 +82,96 @@ int nat_init(nat_ctx_t *ctx, shadowvpn_args_t *args) {
 
     // add to hash: ctx->ip_to_clients[output_tun_ip] = client
     HASH_ADD(hh2, ctx->ip_to_clients, output_tun_ip, 4, client);
+
+    if (ctx->has_net6) {
+      // assign IPv6 prefix the same way
+      // for example, with user_prefix6=128:
+      //     tun IP is fd00:7::1
+      //     client IPs will be fd00:7::2, fd00:7::3, etc
+      // with user_prefix6=64:
+      //     tun IP is fd00:7::1/48
+      //     client prefixes will be fd00:7:0:1::/64, fd00:7:0:2::/64, etc
+      char ip6_str[INET6_ADDRSTRLEN];
+      ip6_assign(client->output_tun_ip6, args->netip6, ctx->prefix6_mask,
+                 i + 1, 128 - args->user_prefix6);
+      inet_ntop(AF_INET6, client->output_tun_ip6, ip6_str, sizeof(ip6_str));
+      logf("assigning %s/%d to user %16llx", ip6_str, args->user_prefix6,
+           (unsigned long long)htobe64(*((uint64_t *)args->user_tokens[i])));
+
+      // add to hash: ctx->ip6_to_clients[output_tun_ip6] = client
+      HASH_ADD(hh3, ctx->ip6_to_clients, output_tun_ip6, 16, client);
+    }
   }
   return 0;
 }
 
+void nat_dump_stats(nat_ctx_t *ctx, FILE *out) {
+  client_info_t *client, *tmp;
+  client_stats_t stats;
+  struct in_addr in;
+
+  fprintf(out, "%d users connected\n", ctx->nconnected);
+  HASH_ITER(hh1, ctx->token_to_clients, client, tmp) {
+    stats_read(&client->stats, &stats);
+    in.s_addr = client->output_tun_ip;
+    fprintf(out, "user %016llx %s connected=%d rx_packets=%llu "
+            "rx_bytes=%llu tx_packets=%llu tx_bytes=%llu drops=%llu "
+            "rtt=%lluus jitter=%lluus loss=%.1f%% mtu=%llu roams=%llu\n",
+            (unsigned long long)htobe64(*((uint64_t *)client->user_token)),
+            inet_ntoa(in), client->source_addr.addrlen != 0,
+            (unsigned long long)stats.rx_packets,
+            (unsigned long long)stats.rx_bytes,
+            (unsigned long long)stats.tx_packets,
+            (unsigned long long)stats.tx_bytes,
+            (unsigned long long)stats.drops,
+            (unsigned long long)stats.rtt_us,
+            (unsigned long long)stats.jitter_us,
+            stats.loss_permille / 10.0,
+            (unsigned long long)stats.mtu,
+            (unsigned long long)stats.roams);
+  }
+  fflush(out);
+}
+
+static void nat_client_idle(tw_timer_t *timer, void *data) {
+  client_info_t *client = data;
+  nat_ctx_t *ctx = client->ctx;
+  uint64_t idle = ctx->now - client->last_seen;
+
+  // last_seen is updated without touching the timer, check it here
+  if (idle < ctx->idle_timeout) {
+    timer_start(ctx->timer_wheel, timer, ctx->idle_timeout - idle);
+    return;
+  }
+  logf("user %16llx idle for %llus, evicted",
+       (unsigned long long)htobe64(*((uint64_t *)client->user_token)),
+       (unsigned long long)idle / 1000);
+  client->source_addr.addrlen = 0;
+  ctx->nconnected--;
+}
+
+/*
+   out = net + (n << shift), where net is masked with mask unless shift is
+   0, in which case the host part of net is kept, just like IPv4 does
+*/
+static void ip6_assign(uint8_t *out, const uint8_t *net, const uint8_t *mask,
+                       uint64_t n, int shift) {
+  uint8_t v[16];
+  int i, carry = 0;
+  bzero(v, sizeof(v));
+  for (i = 0; i < 64; i++) {
+    int bit = i + shift;
+    if ((n >> i) & 1 && bit < 128) {
+      v[15 - bit / 8] |= 1 << (bit % 8);
+    }
+  }
+  for (i = 15; i >= 0; i--) {
+    int sum = (shift ? (net[i] & mask[i]) : net[i]) + v[i] + carry;
+    out[i] = sum & 0xff;
+    carry = sum >> 8;
+  }
+}
+
 /*
    RFC791
    0                   1                   2                   3
@@ -97,6 +204,36 @@ typedef struct {
   uint32_t daddr;
 } ipv4_hdr_t;
 
+/*
+   RFC2460
+   0                   1                   2                   3
+   0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   |Version| Traffic Class |           Flow Label                  |
+   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   |         Payload Length        |  Next Header  |   Hop Limit   |
+   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   |                                                               |
+   +                         Source Address                        +
+   |                           (128 bits)                          |
+   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   |                                                               |
+   +                      Destination Address                      +
+   |                           (128 bits)                          |
+   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+*/
+
+typedef struct {
+  uint8_t ver;
+  uint8_t tc_fl;
+  uint16_t fl;
+  uint16_t payload_len;
+  uint8_t next_hdr;
+  uint8_t hop_limit;
+  uint8_t saddr[16];
+  uint8_t daddr[16];
+} ipv6_hdr_t;
+
 typedef struct {
   uint16_t sport;
   uint16_t dport;
@@ -114,6 +251,19 @@ typedef struct {
   uint16_t checksum;
 } udp_hdr_t;
 
+typedef struct {
+  uint8_t type;
+  uint8_t code;
+  uint16_t checksum;
+} icmp_hdr_t;
+
+#define IPV6_NEXT_HOP_BY_HOP 0
+#define IPV6_NEXT_ROUTING 43
+#define IPV6_NEXT_FRAGMENT 44
+#define IPV6_NEXT_AH 51
+#define IPV6_NEXT_ICMPV6 58
+#define IPV6_NEXT_DEST_OPTS 60
+
 // from OpenVPN
 // acc is the changes (+ old - new)
 // cksum is the checksum to adjust
@@ -132,20 +282,361 @@ typedef struct {
   } \
 }
 
+/* returns the changes (+ old - new) of a 16 bytes address */
+static int32_t ip6_checksum_acc(const uint8_t *old_addr,
+                                const uint8_t *new_addr) {
+  int32_t acc = 0;
+  int i;
+  for (i = 0; i < 16; i += 2) {
+    uint16_t o, n;
+    memcpy(&o, old_addr + i, 2);
+    memcpy(&n, new_addr + i, 2);
+    acc += o;
+    acc -= n;
+  }
+  return acc;
+}
+
+/* adjust TCP, UDP or ICMPv6 checksum, l4len is the bytes left in buf */
+static int nat_fix_l4(uint8_t proto, void *l4, size_t l4len, int32_t acc) {
+  if (proto == IPPROTO_TCP) {
+    if (l4len < 20) {
+      errf("nat: tcp packet too short");
+      return -1;
+    }
+    tcp_hdr_t *tcphdr = l4;
+    ADJUST_CHECKSUM(acc, tcphdr->checksum);
+  } else if (proto == IPPROTO_UDP) {
+    if (l4len < 8) {
+      errf("nat: udp packet too short");
+      return -1;
+    }
+    udp_hdr_t *udphdr = l4;
+    // zero checksum means no checksum over IPv4, keep it that way
+    if (udphdr->checksum) {
+      ADJUST_CHECKSUM(acc, udphdr->checksum);
+    }
+  } else if (proto == IPV6_NEXT_ICMPV6) {
+    if (l4len < 4) {
+      errf("nat: icmpv6 packet too short");
+      return -1;
+    }
+    icmp_hdr_t *icmphdr = l4;
+    ADJUST_CHECKSUM(acc, icmphdr->checksum);
+  }
+  return 0;
+}
+
+/*
+   skip IPv6 extension headers, returns offset of the upper layer header
+   from iphdr and store its protocol in proto
+   returns 0 if the packet is a non-first fragment or can not be parsed,
+   in which case the upper layer header should not be touched
+*/
+static size_t ip6_l4_offset(const ipv6_hdr_t *iphdr, size_t len,
+                            uint8_t *proto) {
+  const uint8_t *p = (const uint8_t *)iphdr;
+  size_t off = sizeof(ipv6_hdr_t);
+  uint8_t next = iphdr->next_hdr;
+  while (1) {
+    if (next == IPV6_NEXT_HOP_BY_HOP || next == IPV6_NEXT_ROUTING ||
+        next == IPV6_NEXT_DEST_OPTS) {
+      if (off + 8 > len)
+        return 0;
+      next = p[off];
+      off += (p[off + 1] + 1) * 8;
+    } else if (next == IPV6_NEXT_FRAGMENT) {
+      uint16_t frag;
+      if (off + 8 > len)
+        return 0;
+      memcpy(&frag, p + off + 2, 2);
+      if (frag & htons(0xfff8))
+        return 0;
+      next = p[off];
+      off += 8;
+    } else if (next == IPV6_NEXT_AH) {
+      if (off + 8 > len)
+        return 0;
+      next = p[off];
+      off += (p[off + 1] + 2) * 4;
+    } else {
+      break;
+    }
+  }
+  if (off > len)
+    return 0;
+  *proto = next;
+  return off;
+}
+
+/* returns the changes (+ old - new) of a 4 bytes address */
+static int32_t ip4_checksum_acc(uint32_t old_addr, uint32_t new_addr) {
+  uint16_t o[2], n[2];
+  memcpy(o, &old_addr, 4);
+  memcpy(n, &new_addr, 4);
+  return (int32_t)o[0] + o[1] - n[0] - n[1];
+}
+
+/*
+   adjust a checksum at offset of a header that may have been truncated
+   when quoted in an ICMP error
+   returns the changes (+ old - new) of the checksum field itself
+*/
+static int32_t nat_fix_quoted_checksum(uint8_t *l4, size_t l4len,
+                                       size_t offset, int32_t acc) {
+  uint16_t old_sum, new_sum;
+  if (l4len < offset + 2)
+    return 0;
+  memcpy(&old_sum, l4 + offset, 2);
+  new_sum = old_sum;
+  ADJUST_CHECKSUM(acc, new_sum);
+  memcpy(l4 + offset, &new_sum, 2);
+  return (int32_t)old_sum - new_sum;
+}
+
+/*
+   ICMP errors carry the header of the packet that caused them, which has
+   the address of the client before NAT (upstream) or after NAT (downstream).
+   Rewrite that address and the checksums that cover it, and adjust the
+   ICMP checksum accordingly. Quoted headers may be truncated, so anything
+   not quoted is left alone.
+
+   src: rewrite the source address of the quoted packet if 1, otherwise
+        the destination address
+   from, to: the address is rewritten only if it equals from
+*/
+static void nat_fix_icmp4(uint8_t *icmp, size_t len, int src,
+                          uint32_t from, uint32_t to) {
+  icmp_hdr_t *icmphdr = (icmp_hdr_t *)icmp;
+  ipv4_hdr_t *inner = (ipv4_hdr_t *)(icmp + 8);
+  uint8_t inner_len;
+  uint32_t *addr;
+  uint16_t old_sum;
+  int32_t acc, icmp_acc;
+
+  if (len < 8 + 20)
+    return;
+  if (icmphdr->type != 3 && icmphdr->type != 4 && icmphdr->type != 5 &&
+      icmphdr->type != 11 && icmphdr->type != 12) {
+    // not an error, nothing is quoted
+    return;
+  }
+  if ((inner->ver & 0xf0) != 0x40)
+    return;
+  inner_len = (inner->ver & 0x0f) * 4;
+  if (inner_len < 20 || len < 8 + inner_len)
+    return;
+  addr = src ? &inner->saddr : &inner->daddr;
+  if (*addr != from)
+    return;
+
+  acc = ip4_checksum_acc(from, to);
+  icmp_acc = acc;
+  *addr = to;
+
+  old_sum = inner->checksum;
+  ADJUST_CHECKSUM(acc, inner->checksum);
+  icmp_acc += (int32_t)old_sum - inner->checksum;
+
+  if (0 == (inner->frag & htons(0x1fff))) {
+    uint8_t *l4 = icmp + 8 + inner_len;
+    size_t l4len = len - 8 - inner_len;
+    if (inner->proto == IPPROTO_TCP) {
+      icmp_acc += nat_fix_quoted_checksum(l4, l4len, 16, acc);
+    } else if (inner->proto == IPPROTO_UDP) {
+      // zero checksum means no checksum over IPv4
+      if (l4len >= 8 && (l4[6] || l4[7]))
+        icmp_acc += nat_fix_quoted_checksum(l4, l4len, 6, acc);
+    }
+  }
+  ADJUST_CHECKSUM(icmp_acc, icmphdr->checksum);
+}
+
+/*
+   same as nat_fix_icmp4 but for ICMPv6, the address is rewritten only if
+   its first bits in mask equal from, and those bits are replaced with to
+*/
+static void nat_fix_icmp6(uint8_t *icmp, size_t len, int src,
+                          const uint8_t *from, const uint8_t *to,
+                          const uint8_t *mask) {
+  icmp_hdr_t *icmphdr = (icmp_hdr_t *)icmp;
+  ipv6_hdr_t *inner = (ipv6_hdr_t *)(icmp + 8);
+  uint8_t new_addr[16];
+  uint8_t *addr;
+  uint8_t proto;
+  size_t l4_off;
+  int32_t acc, icmp_acc;
+  int i;
+
+  if (len < 8 + sizeof(ipv6_hdr_t))
+    return;
+  if (icmphdr->type < 1 || icmphdr->type > 4) {
+    // not an error, nothing is quoted
+    return;
+  }
+  if ((inner->ver & 0xf0) != 0x60)
+    return;
+  addr = src ? inner->saddr : inner->daddr;
+  for (i = 0; i < 16; i++) {
+    if ((addr[i] & mask[i]) != from[i])
+      return;
+    new_addr[i] = to[i] | (addr[i] & ~mask[i]);
+  }
+
+  acc = ip6_checksum_acc(addr, new_addr);
+  icmp_acc = acc;
+  memcpy(addr, new_addr, 16);
+
+  if (0 != (l4_off = ip6_l4_offset(inner, len - 8, &proto))) {
+    uint8_t *l4 = (uint8_t *)inner + l4_off;
+    size_t l4len = len - 8 - l4_off;
+    if (proto == IPPROTO_TCP) {
+      icmp_acc += nat_fix_quoted_checksum(l4, l4len, 16, acc);
+    } else if (proto == IPPROTO_UDP) {
+      icmp_acc += nat_fix_quoted_checksum(l4, l4len, 6, acc);
+    } else if (proto == IPV6_NEXT_ICMPV6) {
+      icmp_acc += nat_fix_quoted_checksum(l4, l4len, 2, acc);
+    }
+  }
+  ADJUST_CHECKSUM(icmp_acc, icmphdr->checksum);
+}
+
+static int nat_fix_upstream6(nat_ctx_t *ctx, client_info_t *client,
+                             unsigned char *buf, size_t buflen) {
+  ipv6_hdr_t *iphdr = (ipv6_hdr_t *)(buf + SHADOWVPN_USERTOKEN_LEN);
+  size_t iplen = buflen - SHADOWVPN_USERTOKEN_LEN;
+  uint8_t new_saddr[16];
+  uint8_t proto;
+  size_t l4_off;
+  int i;
+
+  if (iplen < sizeof(ipv6_hdr_t)) {
+    errf("nat: ipv6 packet too short");
+    return -1;
+  }
+  if (!ctx->has_net6) {
+    errf("nat: dropping ipv6 packet since net6 is not set");
+    return -1;
+  }
+
+  // save tun input prefix to client, keep the host part of the address
+  for (i = 0; i < 16; i++) {
+    client->input_tun_ip6[i] = iphdr->saddr[i] & ctx->prefix6_mask[i];
+    new_saddr[i] = client->output_tun_ip6[i] |
+                   (iphdr->saddr[i] & ~ctx->prefix6_mask[i]);
+  }
+
+  // add old, sub new
+  int32_t acc = ip6_checksum_acc(iphdr->saddr, new_saddr);
+
+  // overwrite IP, there is no header checksum in IPv6
+  memcpy(iphdr->saddr, new_saddr, 16);
+
+  if (0 != (l4_off = ip6_l4_offset(iphdr, iplen, &proto))) {
+    uint8_t *l4 = (uint8_t *)iphdr + l4_off;
+    if (-1 == nat_fix_l4(proto, l4, iplen - l4_off, acc))
+      return -1;
+    if (proto == IPV6_NEXT_ICMPV6) {
+      // the quoted packet was sent to the client by nat_fix_downstream6
+      nat_fix_icmp6(l4, iplen - l4_off, 0, client->input_tun_ip6,
+                    client->output_tun_ip6, ctx->prefix6_mask);
+    }
+  }
+  return 0;
+}
+
+static int nat_fix_upstream4(nat_ctx_t *ctx, client_info_t *client,
+                             unsigned char *buf, size_t buflen) {
+  ipv4_hdr_t *iphdr = (ipv4_hdr_t *)(buf + SHADOWVPN_USERTOKEN_LEN);
+  uint8_t iphdr_len = (iphdr->ver & 0x0f) * 4;
+
+  int32_t acc = 0;
+  // save tun input ip to client
+  client->input_tun_ip = iphdr->saddr;
+
+  // overwrite IP
+  iphdr->saddr = client->output_tun_ip;
+
+  // add old, sub new
+  acc = client->input_tun_ip - iphdr->saddr;
+  ADJUST_CHECKSUM(acc, iphdr->checksum);
+
+  if (0 == (iphdr->frag & htons(0x1fff))) {
+    // only adjust tcp, udp & icmp when frag offset == 0
+    void *ip_payload = buf + SHADOWVPN_USERTOKEN_LEN + iphdr_len;
+    if (buflen < SHADOWVPN_USERTOKEN_LEN + iphdr_len) {
+      errf("nat: ip packet too short");
+      return -1;
+    }
+    size_t l4len = buflen - SHADOWVPN_USERTOKEN_LEN - iphdr_len;
+    if (-1 == nat_fix_l4(iphdr->proto, ip_payload, l4len, acc))
+      return -1;
+    if (iphdr->proto == IPPROTO_ICMP) {
+      // the quoted packet was sent to the client by nat_fix_downstream
+      nat_fix_icmp4(ip_payload, l4len, 0, client->input_tun_ip,
+                    client->output_tun_ip);
+    }
+  }
+  return 0;
+}
+
+int nat_client_seen(nat_ctx_t *ctx, client_info_t *client,
+                    const struct sockaddr *addr, socklen_t addrlen) {
+  if (client->source_addr.addrlen == 0) {
+    logf("user %16llx connected",
+         (unsigned long long)htobe64(*((uint64_t *)client->user_token)));
+    ctx->nconnected++;
+    if (ctx->timer_wheel && ctx->idle_timeout) {
+      timer_start(ctx->timer_wheel, &client->idle_timer, ctx->idle_timeout);
+    }
+  }
+  client->last_seen = ctx->now;
+
+  // save source address
+  if (roam_follow(&client->source_addr.addr, &client->source_addr.addrlen,
+                  addr, addrlen)) {
+    STATS_ADD(client->stats.roams, 1);
+    return 1;
+  }
+  return 0;
+}
+
+client_info_t *nat_find_client(nat_ctx_t *ctx, const char *token) {
+  client_info_t *client = NULL;
+  HASH_FIND(hh1, ctx->token_to_clients, token, SHADOWVPN_USERTOKEN_LEN,
+            client);
+  return client;
+}
+
+client_info_t *nat_find_downstream(nat_ctx_t *ctx, const unsigned char *ip,
+                                   size_t len) {
+  client_info_t *client = NULL;
+  uint8_t key[16];
+  int i;
+
+  if (len >= 20 && (ip[0] & 0xf0) == 0x40) {
+    HASH_FIND(hh2, ctx->ip_to_clients, ip + 16, 4, client);
+  } else if (len >= 40 && (ip[0] & 0xf0) == 0x60 && ctx->has_net6) {
+    for (i = 0; i < 16; i++) {
+      key[i] = ip[24 + i] & ctx->prefix6_mask[i];
+    }
+    HASH_FIND(hh3, ctx->ip6_to_clients, key, 16, client);
+  }
+  return client;
+}
+
 int nat_fix_upstream(nat_ctx_t *ctx, unsigned char *buf, size_t buflen,
                      const struct sockaddr *addr, socklen_t addrlen) {
-  uint8_t iphdr_len;
+  int r;
   if (buflen < SHADOWVPN_USERTOKEN_LEN + 20) {
     errf("nat: ip packet too short");
     return -1;
   }
   ipv4_hdr_t *iphdr = (ipv4_hdr_t *)(buf + SHADOWVPN_USERTOKEN_LEN);
-  if ((iphdr->ver & 0xf0) != 0x40) {
-    // check header, currently IPv4 only
-    // bypass IPv6
-    return 0;
+  if ((iphdr->ver & 0xf0) != 0x40 && (iphdr->ver & 0xf0) != 0x60) {
+    errf("nat: unknown ip version");
+    return -1;
   }
-  iphdr_len = (iphdr->ver & 0x0f) * 4;
 
   // print_hex_memory(buf, SHADOWVPN_USERTOKEN_LEN);
   client_info_t *client = NULL;
@@ -156,55 +647,96 @@ int nat_fix_upstream(nat_ctx_t *ctx, unsigned char *buf, size_t buflen,
   }
   // print_hex_memory(iphdr, buflen - SHADOWVPN_USERTOKEN_LEN);
 
-  // save source address
-  client->source_addr.addrlen =  addrlen;
-  memcpy(&client->source_addr.addr, addr, addrlen);
+  nat_client_seen(ctx, client, addr, addrlen);
 
-  int32_t acc = 0;
-  // save tun input ip to client
-  client->input_tun_ip = iphdr->saddr;
+  if ((iphdr->ver & 0xf0) == 0x60) {
+    r = nat_fix_upstream6(ctx, client, buf, buflen);
+  } else {
+    r = nat_fix_upstream4(ctx, client, buf, buflen);
+  }
+  if (r == 0) {
+    STATS_ADD(client->stats.rx_packets, 1);
+    STATS_ADD(client->stats.rx_bytes, buflen - SHADOWVPN_USERTOKEN_LEN);
+  } else {
+    STATS_ADD(client->stats.drops, 1);
+  }
+  return r;
+}
 
-  // overwrite IP
-  iphdr->saddr = client->output_tun_ip;
+static int nat_fix_downstream6(nat_ctx_t *ctx, unsigned char *buf,
+                               size_t buflen, client_info_t **clientp) {
+  ipv6_hdr_t *iphdr = (ipv6_hdr_t *)(buf + SHADOWVPN_USERTOKEN_LEN);
+  size_t iplen = buflen - SHADOWVPN_USERTOKEN_LEN;
+  uint8_t key[16];
+  uint8_t new_daddr[16];
+  uint8_t proto;
+  size_t l4_off;
+  int i;
+
+  if (iplen < sizeof(ipv6_hdr_t)) {
+    errf("nat: ipv6 packet too short");
+    return -1;
+  }
+  if (!ctx->has_net6) {
+    errf("nat: dropping ipv6 packet since net6 is not set");
+    return -1;
+  }
+
+  for (i = 0; i < 16; i++) {
+    key[i] = iphdr->daddr[i] & ctx->prefix6_mask[i];
+  }
+
+  client_info_t *client = NULL;
+  HASH_FIND(hh3, ctx->ip6_to_clients, key, 16, client);
+  if (client == NULL) {
+    errf("nat: client not found for given user ipv6");
+    return -1;
+  }
+
+  *clientp = client;
+
+  // copy usertoken back
+  memcpy(buf, client->user_token, SHADOWVPN_USERTOKEN_LEN);
+
+  for (i = 0; i < 16; i++) {
+    new_daddr[i] = client->input_tun_ip6[i] |
+                   (iphdr->daddr[i] & ~ctx->prefix6_mask[i]);
+  }
 
   // add old, sub new
-  acc = client->input_tun_ip - iphdr->saddr;
-  ADJUST_CHECKSUM(acc, iphdr->checksum);
+  int32_t acc = ip6_checksum_acc(iphdr->daddr, new_daddr);
 
-  if (0 == (iphdr->frag & htons(0x1fff))) {
-    // only adjust tcp & udp when frag offset == 0
-    void *ip_payload = buf + SHADOWVPN_USERTOKEN_LEN + iphdr_len;
-    if (iphdr->proto == IPPROTO_TCP) {
-      if (buflen < iphdr_len + 20) {
-        errf("nat: tcp packet too short");
-        return -1;
-      }
-      tcp_hdr_t *tcphdr = ip_payload;
-      ADJUST_CHECKSUM(acc, tcphdr->checksum);
-    } else if (iphdr->proto == IPPROTO_UDP) {
-      if (buflen < iphdr_len + 8) {
-        errf("nat: udp packet too short");
-        return -1;
-      }
-      udp_hdr_t *udphdr = ip_payload;
-      ADJUST_CHECKSUM(acc, udphdr->checksum);
+  // overwrite IP
+  memcpy(iphdr->daddr, new_daddr, 16);
+
+  if (0 != (l4_off = ip6_l4_offset(iphdr, iplen, &proto))) {
+    uint8_t *l4 = (uint8_t *)iphdr + l4_off;
+    if (-1 == nat_fix_l4(proto, l4, iplen - l4_off, acc))
+      return -1;
+    if (proto == IPV6_NEXT_ICMPV6) {
+      // the quoted packet was sent by the client and went through
+      // nat_fix_upstream6
+      nat_fix_icmp6(l4, iplen - l4_off, 1, client->output_tun_ip6,
+                    client->input_tun_ip6, ctx->prefix6_mask);
     }
   }
   return 0;
 }
 
 int nat_fix_downstream(nat_ctx_t *ctx, unsigned char *buf, size_t buflen,
-                       struct sockaddr *addr, socklen_t *addrlen) {
+                       client_info_t **clientp) {
   uint8_t iphdr_len;
   if (buflen < SHADOWVPN_USERTOKEN_LEN + 20) {
     errf("nat: ip packet too short");
     return -1;
   }
   ipv4_hdr_t *iphdr = (ipv4_hdr_t *)(buf + SHADOWVPN_USERTOKEN_LEN);
+  if ((iphdr->ver & 0xf0) == 0x60) {
+    return nat_fix_downstream6(ctx, buf, buflen, clientp);
+  }
   if ((iphdr->ver & 0xf0) != 0x40) {
-    // check header, currently IPv4 only
-    // bypass IPv6
-    return 0;
+    errf("nat: unknown ip version");
+    return -1;
   }
   iphdr_len = (iphdr->ver & 0x0f) * 4;
 
@@ -219,9 +751,7 @@ int nat_fix_downstream(nat_ctx_t *ctx, unsigned char *buf, size_t buflen,
 
   // print_hex_memory(client->user_token, SHADOWVPN_USERTOKEN_LEN);
 
-  // update dest address
-  *addrlen = client->source_addr.addrlen;
-  memcpy(addr, &client->source_addr.addr, *addrlen);
+  *clientp = client;
 
   // copy usertoken back
   memcpy(buf, client->user_token, SHADOWVPN_USERTOKEN_LEN);
@@ -237,22 +767,20 @@ int nat_fix_downstream(nat_ctx_t *ctx, unsigned char *buf, size_t buflen,
   ADJUST_CHECKSUM(acc, iphdr->checksum);
 
   if (0 == (iphdr->frag & htons(0x1fff))) {
-    // only adjust tcp & udp when frag offset == 0
+    // only adjust tcp, udp & icmp when frag offset == 0
     void *ip_payload = buf + SHADOWVPN_USERTOKEN_LEN + iphdr_len;
-    if (iphdr->proto == IPPROTO_TCP) {
-      if (buflen < iphdr_len + 20) {
-        errf("nat: tcp packet too short");
-        return -1;
-      }
-      tcp_hdr_t *tcphdr = ip_payload;
-      ADJUST_CHECKSUM(acc, tcphdr->checksum);
-    } else if (iphdr->proto == IPPROTO_UDP) {
-      if (buflen < iphdr_len + 8) {
-        errf("nat: udp packet too short");
-        return -1;
-      }
-      udp_hdr_t *udphdr = ip_payload;
-      ADJUST_CHECKSUM(acc, udphdr->checksum);
+    if (buflen < SHADOWVPN_USERTOKEN_LEN + iphdr_len) {
+      errf("nat: ip packet too short");
+      return -1;
+    }
+    size_t l4len = buflen - SHADOWVPN_USERTOKEN_LEN - iphdr_len;
+    if (-1 == nat_fix_l4(iphdr->proto, ip_payload, l4len, acc))
+      return -1;
+    if (iphdr->proto == IPPROTO_ICMP) {
+      // the quoted packet was sent by the client and went through
+      // nat_fix_upstream
+      nat_fix_icmp4(ip_payload, l4len, 1, client->output_tun_ip,
+                    client->input_tun_ip);
     }
   }
   return 0;
@@ -265,13 +793,30 @@ int nat_init(nat_ctx_t *ctx, shadowvpn_args_t *args) {
   return 0;
 }
 
+void nat_dump_stats(nat_ctx_t *ctx, FILE *out) {
+}
+
+client_info_t *nat_find_client(nat_ctx_t *ctx, const char *token) {
+  return NULL;
+}
+
+client_info_t *nat_find_downstream(nat_ctx_t *ctx, const unsigned char *ip,
+                                   size_t len) {
+  return NULL;
+}
+
+int nat_client_seen(nat_ctx_t *ctx, client_info_t *client,
+                    const struct sockaddr *addr, socklen_t addrlen) {
+  return 0;
+}
+
 int nat_fix_upstream(nat_ctx_t *ctx, unsigned char *buf, size_t buflen,
                      const struct sockaddr *addr, socklen_t addrlen) {
   return 0;
 }
 
 int nat_fix_downstream(nat_ctx_t *ctx, unsigned char *buf, size_t buflen,
-                       struct sockaddr *addr, socklen_t *addrlen) {
+                       client_info_t **client) {
   return 0;
 }
 
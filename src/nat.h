@@ -31,6 +31,10 @@
 #endif
 
 #include "uthash.h"
+#include "timer.h"
+#include "sched.h"
+#include "stats.h"
+#include "peer.h"
 
 /**
   This module maps any IP from the client net to the server net
@@ -43,6 +47,8 @@ typedef struct {
   socklen_t addrlen;
 } addr_info_t;
 
+typedef struct nat_ctx_s nat_ctx_t;
+
 /* the structure to store known client addresses for the server */
 typedef struct {
   int id;
@@ -53,18 +59,36 @@ typedef struct {
 
   // input tun IP
   // in network order
-  // TODO support IPv6 address on tun
   uint32_t input_tun_ip;
 
   // output tun IP
   // in network order
   uint32_t output_tun_ip;
 
+  // input tun IPv6 prefix, only the first user_prefix6 bits are used
+  uint8_t input_tun_ip6[16];
+
+  // output tun IPv6 prefix, bits after user_prefix6 are always zero
+  uint8_t output_tun_ip6[16];
+
+  // when we last received a packet from this client, in ms
+  uint64_t last_seen;
+  // source_addr is cleared when this fires and the client is still idle
+  tw_timer_t idle_timer;
+  nat_ctx_t *ctx;
+
+  // downstream packets wait here, rate limited per user
+  sched_queue_t queue;
+  peer_t peer;
+
+  client_stats_t stats;
+
   UT_hash_handle hh1;
   UT_hash_handle hh2;
+  UT_hash_handle hh3;
 } client_info_t;
 
-typedef struct {
+struct nat_ctx_s {
   /* clients map
      key: user token */
   client_info_t *token_to_clients;
@@ -73,21 +97,62 @@ typedef struct {
      TODO: use index instead of hash
      key: IP */
   client_info_t *ip_to_clients;
-} nat_ctx_t;
+
+  /* clients map
+     key: IPv6 prefix of user_prefix6 bits, rest zeroed */
+  client_info_t *ip6_to_clients;
+
+  /* netmask of user_prefix6, all zero if net6 is not set */
+  uint8_t prefix6_mask[16];
+  int has_net6;
+
+  /* idle clients are evicted by timers on this wheel, set by the caller
+     before any packet is processed, NULL to disable */
+  timer_wheel_t *timer_wheel;
+  /* in ms, 0 means never */
+  uint64_t idle_timeout;
+  /* current time in ms, updated by the caller */
+  uint64_t now;
+  /* number of clients with a known source address */
+  int nconnected;
+};
 
 /* init hash tables */
 int nat_init(nat_ctx_t *ctx, shadowvpn_args_t *args);
 
+/* print counters of every user */
+void nat_dump_stats(nat_ctx_t *ctx, FILE *out);
+
+/* return the client of a user token, NULL if the token is unknown */
+client_info_t *nat_find_client(nat_ctx_t *ctx, const char *token);
+
+/*
+   return the client an IP packet from tun goes to, NULL if none. ip is
+   the packet before nat_fix_downstream()
+*/
+client_info_t *nat_find_downstream(nat_ctx_t *ctx, const unsigned char *ip,
+                                   size_t len);
+
+/*
+   the client sent something from addr, remember the address, see roam.h,
+   and that it is not idle. nat_fix_upstream() does this for IP packets
+   return 1 if the client moved, 0 otherwise
+*/
+int nat_client_seen(nat_ctx_t *ctx, client_info_t *client,
+                    const struct sockaddr *addr, socklen_t addrlen);
+
 /* UDP -> TUN NAT
    buf starts from payload
+   also counts the packet in the stats of the client
 */
 int nat_fix_upstream(nat_ctx_t *ctx, unsigned char *buf, size_t buflen,
                      const struct sockaddr *addr, socklen_t addrlen);
 
 /* TUN -> UDP NAT 
    buf starts from payload
+   client is set to the user the packet should be sent to
 */
 int nat_fix_downstream(nat_ctx_t *ctx, unsigned char *buf, size_t buflen,
-                       struct sockaddr *addr, socklen_t *addrlen);
+                       client_info_t **client);
 
 #endif
@@ -0,0 +1,157 @@
+/**
+  path.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+
+#include "shadowvpn.h"
+
+static void multipath_update(multipath_t *mp);
+
+int multipath_init(multipath_t *mp, const shadowvpn_args_t *args) {
+  int i;
+  bzero(mp, sizeof(multipath_t));
+  if (args->paths_len > PATH_SLOTS) {
+    errf("at most %d paths are supported", PATH_SLOTS);
+    return -1;
+  }
+  mp->paths = calloc(args->paths_len, sizeof(path_t));
+  if (mp->paths == NULL) {
+    err("calloc");
+    return -1;
+  }
+  mp->npaths = args->paths_len;
+  for (i = 0; i < mp->npaths; i++) {
+    mp->paths[i].weight = args->paths[i].weight;
+    // until proven otherwise
+    mp->paths[i].up = 1;
+  }
+  multipath_update(mp);
+  return 0;
+}
+
+/* give the slots to paths that are up, in proportion to their quality */
+static void multipath_update(multipath_t *mp) {
+  uint64_t quality[PATH_SLOTS], total = 0, min_srtt = 0;
+  int i, j, given = 0, nup = 0;
+
+  for (i = 0; i < mp->npaths; i++) {
+    path_t *path = &mp->paths[i];
+    if (path->up) {
+      nup++;
+      if (path->rtt.srtt && (min_srtt == 0 || path->rtt.srtt < min_srtt))
+        min_srtt = path->rtt.srtt;
+    }
+  }
+  for (i = 0; i < mp->npaths; i++) {
+    path_t *path = &mp->paths[i];
+    // when everything is down, keep trying all of them
+    if (!path->up && nup) {
+      quality[i] = 0;
+      continue;
+    }
+    quality[i] = (uint64_t)path->weight * (RTT_LOSS_ONE - path->rtt.loss);
+    // 1ms more on both, so that jitter on fast paths does not move flows
+    if (min_srtt && path->rtt.srtt) {
+      quality[i] = quality[i] * (min_srtt + 1000) /
+                   (path->rtt.srtt + 1000);
+    }
+    // a path that is up always gets some flows, to keep it measured by
+    // real traffic
+    if (quality[i] == 0)
+      quality[i] = 1;
+    total += quality[i];
+  }
+  for (i = 0; i < mp->npaths; i++) {
+    mp->paths[i].slots = quality[i] * PATH_SLOTS / total;
+    given += mp->paths[i].slots;
+  }
+  // hand out what rounding left to the best paths
+  while (given < PATH_SLOTS) {
+    int best = 0;
+    for (i = 1; i < mp->npaths; i++) {
+      if (quality[i] * PATH_SLOTS - mp->paths[i].slots * total >
+          quality[best] * PATH_SLOTS - mp->paths[best].slots * total)
+        best = i;
+    }
+    mp->paths[best].slots++;
+    given++;
+  }
+  // contiguous, so that a small change only moves a few flows
+  for (i = 0, given = 0; i < mp->npaths; i++) {
+    for (j = 0; j < mp->paths[i].slots; j++)
+      mp->slots[given++] = i;
+  }
+}
+
+uint32_t multipath_probe(multipath_t *mp, int i) {
+  path_t *path = &mp->paths[i];
+  int missed = path->rtt.probe_pending;
+  uint32_t seq = rtt_probe(&path->rtt);
+  if (missed) {
+    if (path->rtt.misses == PATH_DOWN_MISSES && path->up) {
+      path->up = 0;
+      mp->failovers++;
+      logf("path %d is down", i);
+    }
+    multipath_update(mp);
+  }
+  return seq;
+}
+
+void multipath_answer(multipath_t *mp, int i, uint32_t seq, uint64_t rtt) {
+  path_t *path = &mp->paths[i];
+  if (!rtt_answer(&path->rtt, seq, rtt))
+    return;
+  if (!path->up) {
+    path->up = 1;
+    logf("path %d is up", i);
+  }
+  multipath_update(mp);
+}
+
+uint32_t multipath_flow(const unsigned char *pkt, size_t len) {
+  uint32_t h = 2166136261U;
+  size_t i, n = 0, l4 = 0;
+  uint8_t proto = 0;
+
+  // FNV-1a over the addresses, protocol and ports
+  if ((pkt[0] & 0xf0) == 0x40 && len >= 20) {
+    i = 12;
+    n = 20;
+    l4 = (pkt[0] & 0x0f) * 4;
+    proto = pkt[9];
+  } else if ((pkt[0] & 0xf0) == 0x60 && len >= 40) {
+    i = 8;
+    n = 40;
+    l4 = 40;
+    proto = pkt[6];
+  } else {
+    return 0;
+  }
+  for (; i < n; i++)
+    h = (h ^ pkt[i]) * 16777619U;
+  h = (h ^ proto) * 16777619U;
+  if ((proto == 6 || proto == 17) && l4 + 4 <= len) {
+    for (i = l4; i < l4 + 4; i++)
+      h = (h ^ pkt[i]) * 16777619U;
+  }
+  // the low bits pick the slot, mix the high ones into them
+  return h ^ (h >> 16);
+}
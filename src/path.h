@@ -0,0 +1,95 @@
+/**
+  path.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef PATH_H
+#define PATH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef TARGET_WIN32
+#include "win32.h"
+#else
+#include <sys/socket.h>
+#endif
+
+#include "args.h"
+#include "rtt.h"
+
+/**
+  Multipath for clients: several server addresses, or the same one through
+  several local interfaces, each with a UDP socket of its own.
+
+  Every path is probed with a FRAME_PING every path_probe_interval, which
+  the server answers with a FRAME_PONG, to keep a smoothed RTT and loss
+  rate. A path that misses PATH_DOWN_MISSES probes in a row is down until
+  it answers again.
+
+  Flows, by hash of their addresses and ports, are spread over the paths
+  that are up through a table of PATH_SLOTS slots, in proportion to the
+  weight of each path, lowered by its loss and by how much slower it is
+  than the fastest. Packets of a flow stick to one path, so that they are
+  not reordered, until the table changes.
+*/
+
+#define PATH_SLOTS 64
+
+#define PATH_DOWN_MISSES 3
+
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int weight;
+  int up;
+  rtt_t rtt;
+  // slots of the table that go to this path
+  int slots;
+} path_t;
+
+typedef struct {
+  path_t *paths;
+  int npaths;
+  // path of each slot
+  uint8_t slots[PATH_SLOTS];
+  // times a path went down
+  uint64_t failovers;
+} multipath_t;
+
+/* return -1 on error */
+int multipath_init(multipath_t *mp, const shadowvpn_args_t *args);
+
+/*
+   a probe is about to be sent on path i, return its sequence number
+   the previous one counts as lost if it has not been answered
+*/
+uint32_t multipath_probe(multipath_t *mp, int i);
+
+/* path i answered probe seq, sent rtt us ago */
+void multipath_answer(multipath_t *mp, int i, uint32_t seq, uint64_t rtt);
+
+/* the path for a flow, see multipath_flow() */
+static inline int multipath_pick(const multipath_t *mp, uint32_t flow) {
+  return mp->slots[flow % PATH_SLOTS];
+}
+
+/* hash of the addresses, protocol and ports of an IP packet */
+uint32_t multipath_flow(const unsigned char *pkt, size_t len);
+
+#endif
@@ -0,0 +1,55 @@
+/**
+  peer.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "shadowvpn.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void peer_init(peer_t *peer, sched_queue_t *queue, const char *token,
+               uint32_t mtu, tw_callback_t fec_timeout,
+               tw_callback_t frag_timeout, void *data) {
+  bzero(peer, sizeof(peer_t));
+  peer->queue = queue;
+  if (token)
+    memcpy(peer->token, token, SHADOWVPN_USERTOKEN_LEN);
+  timer_init(&peer->fec_timer, fec_timeout, peer);
+  timer_init(&peer->frag_timer, frag_timeout, peer);
+  pmtu_init(&peer->pmtu, mtu);
+  peer->data = data;
+}
+
+void peer_destroy(peer_t *peer) {
+  if (peer->fec_tx) {
+    fec_encoder_destroy(peer->fec_tx);
+    free(peer->fec_tx);
+    peer->fec_tx = NULL;
+  }
+  if (peer->fec_rx) {
+    fec_decoder_destroy(peer->fec_rx);
+    free(peer->fec_rx);
+    peer->fec_rx = NULL;
+  }
+  if (peer->frag_rx) {
+    frag_rx_destroy(peer->frag_rx);
+    free(peer->frag_rx);
+    peer->frag_rx = NULL;
+  }
+}
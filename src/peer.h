@@ -0,0 +1,83 @@
+/**
+  peer.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef PEER_H
+#define PEER_H
+
+#include "crypto.h"
+#include "timer.h"
+#include "sched.h"
+#include "fec.h"
+#include "compress.h"
+#include "rtt.h"
+#include "pmtu.h"
+#include "roam.h"
+#include "frag.h"
+
+/**
+  Protocol state of a remote end we exchange frames with, that is the
+  server for a client, and each user (or the only client) for a server.
+*/
+
+typedef struct peer_s {
+  // packets to this peer are queued here, it also has the peer address
+  sched_queue_t *queue;
+  // in front of every datagram sent to this peer, if user tokens are used
+  char token[SHADOWVPN_USERTOKEN_LEN];
+
+  // allocated on first use, NULL unless FEC is enabled
+  fec_encoder_t *fec_tx;
+  fec_decoder_t *fec_rx;
+  // sends parity of a group that does not fill up in time
+  tw_timer_t fec_timer;
+
+  // from keepalive probes
+  rtt_t rtt;
+  // how large datagrams to this peer can be
+  pmtu_t pmtu;
+  // where the client is, announced by it
+  roam_t roam;
+
+  // of the next datagram cut into pieces
+  uint16_t frag_id;
+  // allocated on first use, datagrams from this peer being put together
+  frag_rx_t *frag_rx;
+  // drops the ones that do not complete in time
+  tw_timer_t frag_timer;
+
+  // how well each class of traffic to this peer compresses
+  compress_class_t compress[COMPRESS_CLASSES];
+
+  // passed to the timer callbacks of the owner
+  void *data;
+} peer_t;
+
+/*
+   token may be NULL, timer callbacks are given the peer. mtu is what is
+   sent until path MTU discovery finds otherwise
+*/
+void peer_init(peer_t *peer, sched_queue_t *queue, const char *token,
+               uint32_t mtu, tw_callback_t fec_timeout,
+               tw_callback_t frag_timeout, void *data);
+
+/* free what the peer allocated */
+void peer_destroy(peer_t *peer);
+
+#endif
@@ -0,0 +1,210 @@
+/**
+  pmtu.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "shadowvpn.h"
+
+#include <string.h>
+
+void pmtu_init(pmtu_t *pmtu, uint32_t max) {
+  bzero(pmtu, sizeof(pmtu_t));
+  pmtu->mtu = max;
+  pmtu->max = max;
+  pmtu->min = max < PMTU_MIN ? max : PMTU_MIN;
+  pmtu->lo = pmtu->min;
+  pmtu->lo_ok = 1;
+  pmtu->hi = max + 1;
+  pmtu->searching = 1;
+}
+
+/* the next size to probe in this search, 0 when it is over */
+static uint32_t pmtu_next_size(pmtu_t *pmtu) {
+  if (pmtu->hi > pmtu->max && pmtu->lo < pmtu->max)
+    return pmtu->max;
+  if (pmtu->hi - pmtu->lo > PMTU_STEP)
+    return (pmtu->lo + pmtu->hi) / 2;
+  // what got through last time may not any more
+  if (!pmtu->lo_ok)
+    return pmtu->lo;
+  return 0;
+}
+
+void pmtu_fail(pmtu_t *pmtu) {
+  uint32_t size = pmtu->size;
+  if (size == 0)
+    return;
+  pmtu->size = 0;
+  pmtu->hi = size;
+  if (size <= pmtu->lo) {
+    pmtu->lo = pmtu->min;
+    pmtu->lo_ok = 1;
+    if (pmtu->hi < pmtu->lo)
+      pmtu->hi = pmtu->lo;
+  }
+  if (pmtu->mtu >= size)
+    pmtu->mtu = pmtu->lo;
+}
+
+uint32_t pmtu_probe(pmtu_t *pmtu, uint64_t now, uint32_t *seq) {
+  if (pmtu->size) {
+    // the last probe was not answered in time
+    if (++pmtu->misses < PMTU_MAX_PROBES) {
+      *seq = ++pmtu->probe_seq;
+      return pmtu->size;
+    }
+    pmtu_fail(pmtu);
+  }
+  if (!pmtu->searching) {
+    if (now < pmtu->next_search)
+      return 0;
+    pmtu->searching = 1;
+    pmtu->hi = pmtu->max + 1;
+    pmtu->lo_ok = pmtu->lo == pmtu->min;
+  }
+  if (0 == (pmtu->size = pmtu_next_size(pmtu))) {
+    pmtu->searching = 0;
+    pmtu->next_search = now + PMTU_SEARCH_INTERVAL;
+    return 0;
+  }
+  pmtu->misses = 0;
+  *seq = ++pmtu->probe_seq;
+  return pmtu->size;
+}
+
+int pmtu_answer(pmtu_t *pmtu, uint32_t seq, uint32_t size) {
+  if (pmtu->size == 0 || seq != pmtu->probe_seq || size != pmtu->size)
+    return 0;
+  if (--pmtu->answers > 0)
+    return 1;
+  pmtu->size = 0;
+  if (size >= pmtu->lo) {
+    pmtu->lo = size;
+    pmtu->lo_ok = 1;
+  }
+  if (size > pmtu->mtu)
+    pmtu->mtu = size;
+  return 1;
+}
+
+/* one's complement sum of buf, to be folded by pmtu_csum */
+static uint32_t pmtu_sum(const unsigned char *buf, size_t len, uint32_t sum) {
+  size_t i;
+  for (i = 0; i + 1 < len; i += 2)
+    sum += (buf[i] << 8) | buf[i + 1];
+  if (len & 1)
+    sum += buf[len - 1] << 8;
+  return sum;
+}
+
+/* fold sum and store its complement at p in network order */
+static void pmtu_csum(unsigned char *p, uint32_t sum) {
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  sum = ~sum & 0xffff;
+  p[0] = sum >> 8;
+  p[1] = sum;
+}
+
+/* the most of a packet of len bytes that an ICMP error of max bytes quotes */
+static size_t pmtu_quote(size_t len, size_t max, size_t out_len,
+                         size_t hdr_len) {
+  if (max > out_len)
+    max = out_len;
+  return len < max - hdr_len ? len : max - hdr_len;
+}
+
+static size_t pmtu_icmp4(unsigned char *out, size_t out_len,
+                         const unsigned char *ip, size_t len, uint32_t mtu) {
+  size_t ihl = (ip[0] & 0x0f) * 4;
+  // what RFC 1812 asks routers to quote, at most
+  size_t quote = pmtu_quote(len, 576, out_len, 28);
+  unsigned char *icmp = out + 20;
+
+  // routers fragment what does not have DF set
+  if (len < 20 || ihl < 20 || !(ip[6] & 0x40))
+    return 0;
+  if (ip[12] == 0 || (ip[12] & 0xf0) == 0xe0)
+    return 0;
+  if (ip[9] == 1 && len > ihl) {
+    uint8_t type = ip[ihl];
+    if (type == 3 || type == 4 || type == 5 || type == 11 || type == 12)
+      return 0;
+  }
+  bzero(out, 28);
+  out[0] = 0x45;
+  out[2] = (28 + quote) >> 8;
+  out[3] = 28 + quote;
+  out[8] = 64;
+  out[9] = 1;
+  memcpy(out + 12, ip + 16, 4);
+  memcpy(out + 16, ip + 12, 4);
+  pmtu_csum(out + 10, pmtu_sum(out, 20, 0));
+  icmp[0] = 3;
+  icmp[1] = 4;
+  icmp[6] = mtu >> 8;
+  icmp[7] = mtu;
+  memcpy(icmp + 8, ip, quote);
+  pmtu_csum(icmp + 2, pmtu_sum(icmp, 8 + quote, 0));
+  return 28 + quote;
+}
+
+static size_t pmtu_icmp6(unsigned char *out, size_t out_len,
+                         const unsigned char *ip, size_t len, uint32_t mtu) {
+  // RFC 4443 fills the minimum IPv6 MTU
+  size_t quote = pmtu_quote(len, 1280, out_len, 48);
+  unsigned char *icmp = out + 40;
+  uint32_t sum;
+
+  if (len < 40 || ip[8] == 0xff)
+    return 0;
+  if (ip[6] == 58 && len > 40 && ip[40] < 128)
+    return 0;
+  // IPv6 links carry at least 1280 bytes, less is not taken
+  if (mtu < 1280)
+    mtu = 1280;
+  bzero(out, 48);
+  out[0] = 0x60;
+  out[4] = (8 + quote) >> 8;
+  out[5] = 8 + quote;
+  out[6] = 58;
+  out[7] = 64;
+  memcpy(out + 8, ip + 24, 16);
+  memcpy(out + 24, ip + 8, 16);
+  icmp[0] = 2;
+  icmp[4] = mtu >> 24;
+  icmp[5] = mtu >> 16;
+  icmp[6] = mtu >> 8;
+  icmp[7] = mtu;
+  memcpy(icmp + 8, ip, quote);
+  // pseudo header: addresses, length and next header
+  sum = pmtu_sum(out + 8, 32, 8 + quote + 58);
+  pmtu_csum(icmp + 2, pmtu_sum(icmp, 8 + quote, sum));
+  return 48 + quote;
+}
+
+size_t pmtu_icmp_too_big(unsigned char *out, size_t out_len,
+                         const unsigned char *ip, size_t len, uint32_t mtu) {
+  if (len == 0 || out_len < 48 + 8)
+    return 0;
+  if ((ip[0] & 0xf0) == 0x40)
+    return pmtu_icmp4(out, out_len, ip, len, mtu);
+  if ((ip[0] & 0xf0) == 0x60)
+    return pmtu_icmp6(out, out_len, ip, len, mtu);
+  return 0;
+}
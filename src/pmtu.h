@@ -0,0 +1,112 @@
+/**
+  pmtu.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef PMTU_H
+#define PMTU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+  Path MTU discovery to a peer, in the spirit of RFC 8899 (PLPMTUD): the
+  sender probes with padded FRAME_PMTU_PROBE datagrams of a given size, the
+  peer acknowledges the ones that arrive, and a size is too big for the
+  path when PMTU_MAX_PROBES probes of it in a row get no answer. Sockets
+  are set to never fragment, and ICMP from the network is not needed, so
+  it also works where ICMP is filtered.
+
+  Sizes are of the plaintext after the user token, which is what mtu
+  limits, and include nothing that FEC adds, the caller pads probes for
+  that. The configured mtu is tried first and assumed to work until it
+  is found too big, then the largest size that got through is searched
+  for between PMTU_MIN and the smallest size that did not. The search is
+  repeated every PMTU_SEARCH_INTERVAL, since the path may have changed
+  either way.
+*/
+
+/* in ms, probes are sent at most this often, and time out after it */
+#define PMTU_PROBE_INTERVAL 1000
+
+/*
+   in ms, between the end of one search and the start of the next, which
+   is also how long a path that got smaller may drop the largest packets
+*/
+#define PMTU_SEARCH_INTERVAL 60000
+
+#define PMTU_MAX_PROBES 3
+
+/* never searched below this, it is assumed to always get through */
+#define PMTU_MIN 1200
+
+/* the search stops when it is this close */
+#define PMTU_STEP 8
+
+typedef struct {
+  // the largest size that should be sent
+  uint32_t mtu;
+  // the configured mtu, and PMTU_MIN unless mtu is lower
+  uint32_t max;
+  uint32_t min;
+  // lo got through, hi did not, or is max + 1 before max is tried.
+  // lo_ok is 0 until lo got through in this search
+  uint32_t lo;
+  uint32_t hi;
+  int lo_ok;
+  int searching;
+  // in ms, when the next search starts
+  uint64_t next_search;
+  // the size being probed and its last probe, size is 0 if none
+  uint32_t size;
+  uint32_t probe_seq;
+  int misses;
+  // answers the last probe still waits for, when sent over several paths
+  int answers;
+} pmtu_t;
+
+void pmtu_init(pmtu_t *pmtu, uint32_t max);
+
+/*
+   called every PMTU_PROBE_INTERVAL. return the size to probe now and its
+   sequence number in *seq, 0 if there is nothing to probe. pmtu->mtu may
+   go down when a probe was not answered
+*/
+uint32_t pmtu_probe(pmtu_t *pmtu, uint64_t now, uint32_t *seq);
+
+/* the last probe could not be sent because it is too big */
+void pmtu_fail(pmtu_t *pmtu);
+
+/*
+   a probe of size was answered
+   return 1 if it was the one waited for, pmtu->mtu may have gone up
+*/
+int pmtu_answer(pmtu_t *pmtu, uint32_t seq, uint32_t size);
+
+/*
+   build in out the ICMP "fragmentation needed" or ICMPv6 "packet too big"
+   that tells the sender of the IP packet ip of len bytes to send at most
+   mtu bytes. out has room for out_len bytes, less of ip is quoted if
+   it does not fit
+   return the length of the ICMP packet, 0 if none should be sent: if ip
+   may be fragmented, or is itself an ICMP error
+*/
+size_t pmtu_icmp_too_big(unsigned char *out, size_t out_len,
+                         const unsigned char *ip, size_t len, uint32_t mtu);
+
+#endif
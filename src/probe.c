@@ -0,0 +1,407 @@
+/**
+  probe.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+   shadowvpn-probe sends UDP probes at a fixed rate and size to a reflector
+   on the other side of the tunnel, and reports RTT, one-way delay, jitter
+   and loss, e.g. with the server's tun address 10.7.0.1:
+
+       server$ shadowvpn-probe -l 10.7.0.1:7007
+       client$ shadowvpn-probe -r 1000 -s 1200 -t 10 10.7.0.1:7007
+
+   Each probe carries its sequence number, the sender's monotonic send
+   time, which comes back untouched for the RTT, and the sender's wall
+   clock, which the reflector compares with its own. One-way delays are
+   only meaningful when both clocks are synchronized, e.g. two network
+   namespaces on the same host.
+*/
+
+#include "shadowvpn.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include "portable_endian.h"
+
+#define PROBE_MAGIC 0x53565052
+
+/* how far the sender may fall behind its schedule before skipping ahead */
+#define PROBE_MAX_LAG_NS 10000000
+
+/* largest UDP payload */
+#define PROBE_MAX_SIZE 65507
+
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+  uint64_t sent_ns;
+  uint64_t sent_wall_ns;
+  uint64_t reflected_wall_ns;
+} probe_hdr_t;
+
+typedef struct {
+  uint64_t sent;
+  uint64_t received;
+  uint64_t duplicates;
+  uint64_t reordered;
+  // times the sender fell more than PROBE_MAX_LAG_NS behind
+  uint64_t late;
+  uint64_t rtt_min_ns;
+  // RFC 3550 interarrival jitter, computed on the RTT, in ns
+  double jitter_ns;
+  uint64_t last_rtt_ns;
+  // one-way delays that came out negative because of clock offset
+  uint64_t clock_skewed;
+  latency_hist_t rtt;
+  latency_hist_t up;
+  latency_hist_t down;
+} probe_stats_t;
+
+static volatile sig_atomic_t running = 1;
+
+static void sig_handler(int signo) {
+  running = 0;
+}
+
+static uint64_t wall_ns() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+}
+
+/* split [host]:port or host:port in place */
+static int parse_addr(char *s, char **host, int *port) {
+  char *colon = strrchr(s, ':');
+  if (colon == NULL) {
+    errf("address must be host:port: %s", s);
+    return -1;
+  }
+  *colon = 0;
+  *port = atoi(colon + 1);
+  if (*port <= 0 || *port > 65535) {
+    errf("bad port: %s", colon + 1);
+    return -1;
+  }
+  *host = s;
+  if (s[0] == '[' && colon[-1] == ']') {
+    colon[-1] = 0;
+    *host = s + 1;
+  }
+  return 0;
+}
+
+static int probe_reflect(char *listen_addr) {
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  unsigned char *buf;
+  probe_hdr_t *hdr;
+  char *host;
+  int sock, port;
+
+  if (0 != parse_addr(listen_addr, &host, &port))
+    return -1;
+  if (-1 == (sock = vpn_udp_alloc(1, host, port, (struct sockaddr *)&addr,
+                                  &addrlen)))
+    return -1;
+  buf = malloc(PROBE_MAX_SIZE);
+  hdr = (probe_hdr_t *)buf;
+  logf("reflecting probes on %s:%d", host, port);
+
+  while (running) {
+    fd_set readset;
+    ssize_t r;
+    FD_ZERO(&readset);
+    FD_SET(sock, &readset);
+    if (-1 == select(sock + 1, &readset, NULL, NULL, NULL)) {
+      if (errno == EINTR)
+        continue;
+      err("select");
+      break;
+    }
+    addrlen = sizeof(addr);
+    r = recvfrom(sock, buf, PROBE_MAX_SIZE, 0, (struct sockaddr *)&addr,
+                 &addrlen);
+    if (r < (ssize_t)sizeof(probe_hdr_t) || ntohl(hdr->magic) != PROBE_MAGIC)
+      continue;
+    hdr->reflected_wall_ns = htobe64(wall_ns());
+    if (-1 == sendto(sock, buf, r, 0, (struct sockaddr *)&addr, addrlen)) {
+      err("sendto");
+    }
+  }
+  free(buf);
+  close(sock);
+  return 0;
+}
+
+static void probe_receive(probe_stats_t *stats, unsigned char *received,
+                          uint32_t *highest, unsigned char *buf, ssize_t r) {
+  probe_hdr_t *hdr = (probe_hdr_t *)buf;
+  uint64_t now = latency_now_ns(), now_wall = wall_ns();
+  uint64_t rtt, sent_wall, reflected_wall;
+  uint32_t seq;
+
+  if (r < (ssize_t)sizeof(probe_hdr_t) || ntohl(hdr->magic) != PROBE_MAGIC)
+    return;
+  seq = ntohl(hdr->seq);
+  if (seq >= stats->sent)
+    return;
+  if (received[seq]) {
+    stats->duplicates++;
+    return;
+  }
+  received[seq] = 1;
+  stats->received++;
+  if (stats->received > 1 && seq < *highest)
+    stats->reordered++;
+  else
+    *highest = seq;
+
+  rtt = now - be64toh(hdr->sent_ns);
+  latency_hist_record(&stats->rtt, rtt);
+  if (stats->received == 1 || rtt < stats->rtt_min_ns)
+    stats->rtt_min_ns = rtt;
+  if (stats->received > 1) {
+    double d = rtt > stats->last_rtt_ns ? rtt - stats->last_rtt_ns :
+                                          stats->last_rtt_ns - rtt;
+    stats->jitter_ns += (d - stats->jitter_ns) / 16;
+  }
+  stats->last_rtt_ns = rtt;
+
+  sent_wall = be64toh(hdr->sent_wall_ns);
+  reflected_wall = be64toh(hdr->reflected_wall_ns);
+  if (reflected_wall >= sent_wall && now_wall >= reflected_wall) {
+    latency_hist_record(&stats->up, reflected_wall - sent_wall);
+    latency_hist_record(&stats->down, now_wall - reflected_wall);
+  } else {
+    stats->clock_skewed++;
+  }
+}
+
+static void print_hist(const char *name, const latency_hist_t *hist) {
+  if (!hist->count)
+    return;
+  printf("%-10s avg %.1f  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f us\n",
+         name, hist->sum_ns / 1e3 / hist->count,
+         latency_quantile(hist, 0.5) / 1e3,
+         latency_quantile(hist, 0.9) / 1e3,
+         latency_quantile(hist, 0.99) / 1e3, hist->max_ns / 1e3);
+}
+
+static void print_stats(probe_stats_t *stats, int rate, int size, int json) {
+  double loss = stats->sent ?
+                100.0 * (stats->sent - stats->received) / stats->sent : 0;
+  if (json) {
+    const latency_hist_t *rtt = &stats->rtt;
+    printf("{\"name\": \"probe\", \"rate\": %d, \"size\": %d, "
+           "\"sent\": %llu, \"received\": %llu, \"loss_pct\": %.3f, "
+           "\"duplicates\": %llu, \"reordered\": %llu, \"late\": %llu, "
+           "\"rtt_min_us\": %.1f, \"rtt_avg_us\": %.1f, "
+           "\"rtt_p50_us\": %.1f, \"rtt_p99_us\": %.1f, "
+           "\"rtt_max_us\": %.1f, \"jitter_us\": %.1f, "
+           "\"up_p50_us\": %.1f, \"down_p50_us\": %.1f}\n",
+           rate, size, (unsigned long long)stats->sent,
+           (unsigned long long)stats->received, loss,
+           (unsigned long long)stats->duplicates,
+           (unsigned long long)stats->reordered,
+           (unsigned long long)stats->late,
+           stats->rtt_min_ns / 1e3,
+           rtt->count ? rtt->sum_ns / 1e3 / rtt->count : 0,
+           latency_quantile(rtt, 0.5) / 1e3,
+           latency_quantile(rtt, 0.99) / 1e3, rtt->max_ns / 1e3,
+           stats->jitter_ns / 1e3,
+           stats->up.count ? latency_quantile(&stats->up, 0.5) / 1e3 : -1,
+           stats->down.count ? latency_quantile(&stats->down, 0.5) / 1e3 :
+                               -1);
+    return;
+  }
+  printf("%llu sent, %llu received, %.3f%% loss, %llu duplicates, "
+         "%llu reordered\n", (unsigned long long)stats->sent,
+         (unsigned long long)stats->received, loss,
+         (unsigned long long)stats->duplicates,
+         (unsigned long long)stats->reordered);
+  if (stats->late)
+    printf("%llu probes were sent late, the sender could not keep up\n",
+           (unsigned long long)stats->late);
+  if (!stats->received)
+    return;
+  printf("rtt min    %.1f us, jitter %.1f us\n", stats->rtt_min_ns / 1e3,
+         stats->jitter_ns / 1e3);
+  print_hist("rtt", &stats->rtt);
+  print_hist("one-way up", &stats->up);
+  print_hist("one-way dn", &stats->down);
+  if (stats->clock_skewed)
+    printf("%llu one-way delays were negative, clocks are not in sync\n",
+           (unsigned long long)stats->clock_skewed);
+}
+
+static int probe_send(char *target, int rate, int size, int seconds,
+                      int wait_ms, int json) {
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  probe_stats_t *stats;
+  unsigned char *buf, *received;
+  probe_hdr_t *hdr;
+  uint64_t total, interval, next, now, deadline = 0;
+  uint32_t highest = 0;
+  char *host;
+  int sock, port;
+
+  if (0 != parse_addr(target, &host, &port))
+    return -1;
+  if (-1 == (sock = vpn_udp_alloc(0, host, port, (struct sockaddr *)&addr,
+                                  &addrlen)))
+    return -1;
+
+  total = (uint64_t)rate * seconds;
+  interval = 1000000000 / rate;
+  stats = calloc(1, sizeof(probe_stats_t));
+  received = calloc(total, 1);
+  buf = calloc(1, PROBE_MAX_SIZE);
+  hdr = (probe_hdr_t *)buf;
+  hdr->magic = htonl(PROBE_MAGIC);
+  if (!json)
+    printf("probing %s:%d, %d probes/s of %d bytes for %d s\n", host, port,
+           rate, size, seconds);
+
+  next = latency_now_ns();
+  while (running) {
+    struct timeval tv;
+    fd_set readset;
+    uint64_t timeout;
+
+    now = latency_now_ns();
+    if (stats->sent < total && now >= next) {
+      hdr->seq = htonl(stats->sent);
+      hdr->sent_ns = htobe64(now);
+      hdr->sent_wall_ns = htobe64(wall_ns());
+      if (-1 == sendto(sock, buf, size, 0, (struct sockaddr *)&addr,
+                       addrlen)) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+          err("sendto");
+      }
+      stats->sent++;
+      next += interval;
+      // a short lag is caught up with, a long one would become a burst
+      if (now > next + PROBE_MAX_LAG_NS) {
+        stats->late++;
+        next = now + interval;
+      }
+      if (stats->sent == total)
+        deadline = now + (uint64_t)wait_ms * 1000000;
+      continue;
+    }
+    if (stats->sent == total) {
+      if (now >= deadline || stats->received == total)
+        break;
+      timeout = deadline - now;
+    } else {
+      timeout = next - now;
+    }
+
+    FD_ZERO(&readset);
+    FD_SET(sock, &readset);
+    tv.tv_sec = timeout / 1000000000;
+    tv.tv_usec = (timeout % 1000000000) / 1000;
+    if (-1 == select(sock + 1, &readset, NULL, NULL, &tv)) {
+      if (errno == EINTR)
+        continue;
+      err("select");
+      break;
+    }
+    if (FD_ISSET(sock, &readset)) {
+      ssize_t r;
+      while ((r = recv(sock, buf + PROBE_MAX_SIZE / 2,
+                       PROBE_MAX_SIZE / 2, 0)) > 0) {
+        probe_receive(stats, received, &highest, buf + PROBE_MAX_SIZE / 2,
+                      r);
+      }
+    }
+  }
+
+  print_stats(stats, rate, size, json);
+  close(sock);
+  free(buf);
+  free(received);
+  free(stats);
+  return 0;
+}
+
+static void print_help() {
+  printf("usage: shadowvpn-probe [-r rate] [-s size] [-t seconds] [-w ms] "
+         "[-j] host:port\n"
+         "       shadowvpn-probe -l host:port\n"
+         "\n"
+         "  -l host:port  reflect probes sent to this address\n"
+         "  -r rate       probes per second, default 100\n"
+         "  -s size       UDP payload size in bytes, default 64\n"
+         "  -t seconds    how long to send, default 10\n"
+         "  -w ms         how long to wait for the last replies, "
+         "default 1000\n"
+         "  -j            print results as JSON\n");
+}
+
+int main(int argc, char **argv) {
+  char *listen_addr = NULL;
+  int rate = 100, size = 64, seconds = 10, wait_ms = 1000, json = 0;
+  int c;
+
+  while ((c = getopt(argc, argv, "l:r:s:t:w:jh")) != -1) {
+    switch (c) {
+      case 'l':
+        listen_addr = optarg;
+        break;
+      case 'r':
+        rate = atoi(optarg);
+        break;
+      case 's':
+        size = atoi(optarg);
+        break;
+      case 't':
+        seconds = atoi(optarg);
+        break;
+      case 'w':
+        wait_ms = atoi(optarg);
+        break;
+      case 'j':
+        json = 1;
+        break;
+      default:
+        print_help();
+        return EXIT_FAILURE;
+    }
+  }
+  if (rate <= 0 || rate > 1000000000 || seconds <= 0 || wait_ms < 0 ||
+      size < (int)sizeof(probe_hdr_t) || size > PROBE_MAX_SIZE / 2 ||
+      (listen_addr == NULL && optind != argc - 1)) {
+    print_help();
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGINT, sig_handler);
+  signal(SIGTERM, sig_handler);
+  if (listen_addr)
+    return probe_reflect(listen_addr) ? EXIT_FAILURE : 0;
+  return probe_send(argv[optind], rate, size, seconds, wait_ms, json) ?
+         EXIT_FAILURE : 0;
+}
@@ -0,0 +1,66 @@
+/**
+  roam.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "shadowvpn.h"
+
+#include <sys/time.h>
+
+uint64_t roam_announce(roam_t *roam) {
+  struct timeval tv;
+  uint64_t now_us;
+
+  // wall clock time, so that it is still newer after a restart
+  gettimeofday(&tv, NULL);
+  now_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  // strictly growing, even if the clock is not
+  roam->seq = now_us > roam->seq ? now_us : roam->seq + 1;
+  roam->acked = 0;
+  roam->retries = 0;
+  return roam->seq;
+}
+
+int roam_ack(roam_t *roam, uint64_t seq) {
+  if (seq == roam->seq) {
+    roam->acked = 1;
+    return 0;
+  }
+  if (seq < roam->seq)
+    return 0;
+  // our clock went back since the server last heard of us, catch up
+  roam->seq = seq;
+  return 1;
+}
+
+int roam_accept(roam_t *roam, uint64_t seq) {
+  if (seq <= roam->seq)
+    return 0;
+  roam->seq = seq;
+  return 1;
+}
+
+int roam_follow(struct sockaddr_storage *cur, socklen_t *cur_len,
+                const struct sockaddr *addr, socklen_t addrlen) {
+  int moved = *cur_len != 0;
+  if (*cur_len == addrlen && 0 == memcmp(cur, addr, addrlen))
+    return 0;
+  memcpy(cur, addr, addrlen);
+  *cur_len = addrlen;
+  return moved;
+}
@@ -0,0 +1,90 @@
+/**
+  roam.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef ROAM_H
+#define ROAM_H
+
+#include <stdint.h>
+
+#ifdef TARGET_WIN32
+#include "win32.h"
+#else
+#include <sys/socket.h>
+#endif
+
+/**
+  Roaming: a client that moves to another network tells the server right
+  away, instead of waiting for the server to notice where its packets come
+  from.
+
+  The client sends a FRAME_ANNOUNCE whenever a local address or route
+  changes, and every ROAM_REFRESH_INTERVAL in case a NAT on the way moved
+  it, and resends it every ROAM_RETRY_INTERVAL until the server answers
+  with a FRAME_ANNOUNCE_ACK. Sequence numbers are times in us, so that they
+  keep growing when the client restarts.
+
+  The server sends to wherever the last authenticated datagram of a client
+  came from, so that a NAT that rebinds it is followed at once. An announce
+  only moves it if it is newer than the last one, so that an old one
+  replayed or late does not.
+*/
+
+/* in ms */
+#define ROAM_RETRY_INTERVAL 200
+#define ROAM_REFRESH_INTERVAL 15000
+
+/* unanswered announces resent before a new one is made */
+#define ROAM_MAX_RETRIES 10
+
+typedef struct {
+  // the client: the last announce sent. the server: the newest received,
+  // 0 if none
+  uint64_t seq;
+  // the client only
+  int acked;
+  int retries;
+} roam_t;
+
+/* the client moved, return the sequence number of a new announce */
+uint64_t roam_announce(roam_t *roam);
+
+/*
+   the client got an answer to announce seq
+   return 1 if the server knows a newer one, then a new announce has to be
+   made, 0 otherwise
+*/
+int roam_ack(roam_t *roam, uint64_t seq);
+
+/*
+   the server got announce seq
+   return 1 if it is the newest so far, 0 if it is old or repeated
+*/
+int roam_accept(roam_t *roam, uint64_t seq);
+
+/*
+   the server got an authenticated datagram of the client from addr, and
+   not an announce roam_accept() refused. move *cur, the address of the
+   client, there. *cur_len is 0 if the address is not known yet
+   return 1 if the client moved, 0 otherwise
+*/
+int roam_follow(struct sockaddr_storage *cur, socklen_t *cur_len,
+                const struct sockaddr *addr, socklen_t addrlen);
+
+#endif
@@ -0,0 +1,49 @@
+/**
+  rtt.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "shadowvpn.h"
+
+uint32_t rtt_probe(rtt_t *rtt) {
+  if (rtt->probe_pending) {
+    rtt->loss += (RTT_LOSS_ONE - rtt->loss) / 8;
+    rtt->misses++;
+  }
+  rtt->probe_pending = 1;
+  return ++rtt->probe_seq;
+}
+
+int rtt_answer(rtt_t *rtt, uint32_t seq, uint64_t rtt_us) {
+  // late answers are lost as far as loss is concerned
+  if (seq != rtt->probe_seq || !rtt->probe_pending)
+    return 0;
+  rtt->probe_pending = 0;
+  rtt->misses = 0;
+  rtt->loss -= rtt->loss / 8;
+  if (rtt->srtt == 0) {
+    rtt->srtt = rtt_us;
+  } else {
+    uint64_t d = rtt_us > rtt->last_rtt ? rtt_us - rtt->last_rtt :
+                                          rtt->last_rtt - rtt_us;
+    rtt->srtt = rtt->srtt - rtt->srtt / 8 + rtt_us / 8;
+    rtt->jitter = rtt->jitter - rtt->jitter / 16 + d / 16;
+  }
+  rtt->last_rtt = rtt_us;
+  return 1;
+}
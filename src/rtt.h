@@ -0,0 +1,64 @@
+/**
+  rtt.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef RTT_H
+#define RTT_H
+
+#include <stdint.h>
+
+/**
+  RTT, jitter and loss of a peer or a path, from FRAME_PING probes sent at
+  intervals and echoed back as FRAME_PONG.
+
+  srtt is smoothed like TCP does, jitter is the mean difference between
+  consecutive RTT samples like RFC 3550 does. A probe that has not been
+  answered by the time the next one goes out is lost, loss is smoothed
+  over about the last 8 probes.
+*/
+
+/* loss is in 1/RTT_LOSS_ONE */
+#define RTT_LOSS_ONE 1024
+
+typedef struct {
+  // in us, 0 until the first answer
+  uint64_t srtt;
+  uint64_t jitter;
+  uint64_t last_rtt;
+  uint32_t loss;
+  // the last probe sent, and whether it still waits for an answer
+  uint32_t probe_seq;
+  int probe_pending;
+  // probes in a row that were not answered
+  int misses;
+} rtt_t;
+
+/*
+   a probe is about to be sent, return its sequence number. the previous
+   one is lost if it has not been answered
+*/
+uint32_t rtt_probe(rtt_t *rtt);
+
+/*
+   probe seq was answered rtt_us after it was sent
+   return 1 if it was the last probe sent, 0 if it came too late
+*/
+int rtt_answer(rtt_t *rtt, uint32_t seq, uint64_t rtt_us);
+
+#endif
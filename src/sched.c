@@ -0,0 +1,342 @@
+/**
+  sched.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdlib.h>
+#include "shadowvpn.h"
+
+static void sched_refill(tw_timer_t *timer, void *data) {
+  // nothing to do here, sched_dequeue() is called after timers anyway
+}
+
+int sched_init(sched_t *sched, size_t pkt_size, int npkts,
+               timer_wheel_t *timer_wheel) {
+  int i;
+  size_t size = (sizeof(sched_pkt_t) + pkt_size + 7) & ~(size_t)7;
+  bzero(sched, sizeof(sched_t));
+  if (NULL == (sched->pool = malloc(size * npkts))) {
+    errf("can not allocate %d packets", npkts);
+    return -1;
+  }
+  for (i = 0; i < npkts; i++) {
+    sched_free(sched, (sched_pkt_t *)((char *)sched->pool + size * i));
+  }
+  sched->quantum = pkt_size;
+  sched->timer_wheel = timer_wheel;
+  timer_init(&sched->refill_timer, sched_refill, sched);
+  return 0;
+}
+
+void sched_destroy(sched_t *sched) {
+  if (sched->timer_wheel)
+    timer_stop(sched->timer_wheel, &sched->refill_timer);
+  free(sched->pool);
+  bzero(sched, sizeof(sched_t));
+}
+
+void sched_queue_init(sched_t *sched, sched_queue_t *queue, uint64_t rate,
+                      struct sockaddr_storage *addr, socklen_t *addrlen,
+                      client_stats_t *stats) {
+  bzero(queue, sizeof(sched_queue_t));
+  queue->bucket.rate = rate;
+  // allow 100ms worth of burst, but at least a few packets
+  queue->bucket.burst = rate / 10;
+  if (queue->bucket.burst < sched->quantum * 4)
+    queue->bucket.burst = sched->quantum * 4;
+  queue->bucket.tokens = queue->bucket.burst;
+  queue->addr = addr;
+  queue->addrlen = addrlen;
+  queue->stats = stats;
+}
+
+sched_pkt_t *sched_alloc(sched_t *sched) {
+  sched_pkt_t *pkt = sched->free_pkts;
+  if (pkt) {
+    sched->free_pkts = pkt->next;
+    sched->npkts--;
+    pkt->next = NULL;
+  }
+  return pkt;
+}
+
+void sched_free(sched_t *sched, sched_pkt_t *pkt) {
+  pkt->next = sched->free_pkts;
+  sched->free_pkts = pkt;
+  sched->npkts++;
+}
+
+/* the band of queue to serve next, NULL if the queue is empty */
+static sched_band_t *top_band(sched_queue_t *queue) {
+  int prio;
+  for (prio = 0; prio < SCHED_PRIOS; prio++) {
+    if (queue->bands[prio].head)
+      return &queue->bands[prio];
+  }
+  return NULL;
+}
+
+/*
+   drop the oldest packet of the lowest band below prio, to make room
+   return -1 if there is none
+*/
+static int push_out(sched_t *sched, sched_queue_t *queue, int prio) {
+  int low;
+  for (low = SCHED_PRIOS - 1; low > prio; low--) {
+    sched_band_t *band = &queue->bands[low];
+    sched_pkt_t *pkt = band->head;
+    if (pkt == NULL)
+      continue;
+    band->head = pkt->next;
+    if (band->head == NULL)
+      band->tail = NULL;
+    queue->len--;
+    sched->queued_bytes -= pkt->len;
+    sched_free(sched, pkt);
+    return 0;
+  }
+  return -1;
+}
+
+int sched_enqueue(sched_t *sched, sched_queue_t *queue, sched_pkt_t *pkt) {
+  sched_band_t *band = &queue->bands[pkt->prio];
+  int r = 0;
+  if (queue->len >= SCHED_QUEUE_LIMIT) {
+    if (-1 == push_out(sched, queue, pkt->prio))
+      return -1;
+    r = 1;
+  }
+  pkt->next = NULL;
+  if (band->tail) {
+    band->tail->next = pkt;
+  } else {
+    band->head = pkt;
+  }
+  band->tail = pkt;
+  queue->len++;
+  sched->queued_bytes += pkt->len;
+  if (!queue->active) {
+    queue->active = 1;
+    queue->in_round = 0;
+    queue->deficit = 0;
+    queue->next_active = NULL;
+    if (sched->active_tail) {
+      sched->active_tail->next_active = queue;
+    } else {
+      sched->active_head = queue;
+    }
+    sched->active_tail = queue;
+    sched->nactive++;
+  }
+  return r;
+}
+
+/* return 0 if the bucket has tokens, otherwise ms until it will have */
+static uint64_t bucket_wait(token_bucket_t *bucket, uint64_t now) {
+  if (bucket->rate == 0)
+    return 0;
+  if (now - bucket->last >= 1000000) {
+    // idle for long, also keeps the product below from overflowing
+    bucket->tokens = bucket->burst;
+    bucket->last = now;
+  } else if (now > bucket->last) {
+    uint64_t refill = bucket->rate * (now - bucket->last);
+    bucket->tokens += refill / 1000;
+    if (bucket->tokens > bucket->burst)
+      bucket->tokens = bucket->burst;
+    // what is less than a byte counts next time, or slow rates never
+    // refill when called every ms
+    bucket->last = now - refill % 1000 / bucket->rate;
+  }
+  if (bucket->tokens >= 0)
+    return 0;
+  return (-bucket->tokens * 1000) / bucket->rate + 1;
+}
+
+/* move the head of the active list to its tail */
+static void rotate(sched_t *sched) {
+  sched_queue_t *queue = sched->active_head;
+  queue->in_round = 0;
+  if (queue == sched->active_tail)
+    return;
+  sched->active_head = queue->next_active;
+  queue->next_active = NULL;
+  sched->active_tail->next_active = queue;
+  sched->active_tail = queue;
+}
+
+/*
+   remove the head of band, the top band of q, which is the head of the
+   active list
+*/
+static sched_pkt_t *take_head(sched_t *sched, sched_queue_t *q,
+                              sched_band_t *band) {
+  sched_pkt_t *pkt = band->head;
+  q->deficit -= pkt->len;
+  if (q->bucket.rate)
+    q->bucket.tokens -= pkt->len;
+  band->head = pkt->next;
+  if (band->head == NULL)
+    band->tail = NULL;
+  q->len--;
+  sched->queued_bytes -= pkt->len;
+  if (q->len == 0) {
+    // queue drained, leave the active list
+    q->active = 0;
+    q->deficit = 0;
+    sched->active_head = q->next_active;
+    if (sched->active_head == NULL)
+      sched->active_tail = NULL;
+    q->next_active = NULL;
+    sched->nactive--;
+  }
+  pkt->next = NULL;
+  return pkt;
+}
+
+sched_pkt_t *sched_dequeue(sched_t *sched, uint64_t now,
+                           sched_queue_t **queue) {
+  // queues in a row out of tokens, and the soonest of them to refill
+  int throttled = 0;
+  uint64_t earliest = 0;
+  sched_queue_t *q;
+  sched_band_t *band;
+
+  while (NULL != (q = sched->active_head)) {
+    uint64_t wait;
+    if (throttled >= sched->nactive) {
+      // every queue is waiting for tokens
+      timer_start(sched->timer_wheel, &sched->refill_timer, earliest);
+      return NULL;
+    }
+    if (0 != (wait = bucket_wait(&q->bucket, now))) {
+      if (earliest == 0 || wait < earliest)
+        earliest = wait;
+      throttled++;
+      rotate(sched);
+      continue;
+    }
+    // has tokens, at worst it sends once its deficit is topped up
+    throttled = 0;
+    if (!q->in_round) {
+      q->in_round = 1;
+      q->deficit += sched->quantum;
+    }
+    band = top_band(q);
+    if ((int64_t)band->head->len > q->deficit) {
+      rotate(sched);
+      continue;
+    }
+    *queue = q;
+    return take_head(sched, q, band);
+  }
+  return NULL;
+}
+
+sched_pkt_t *sched_dequeue_more(sched_t *sched, sched_queue_t *queue,
+                                size_t max_len) {
+  // a drained queue has left the active list, otherwise it is still at
+  // its head
+  sched_band_t *band = top_band(queue);
+  if (band == NULL || band->head->len > max_len)
+    return NULL;
+  // the deficit may go negative, which the next round pays back
+  return take_head(sched, queue, band);
+}
+
+void pacer_set_rate(pacer_t *pacer, uint64_t rate, uint64_t now_ns) {
+  if (pacer->rate == 0) {
+    pacer->tokens = 0;
+    pacer->last = now_ns;
+  }
+  pacer->rate = rate;
+  pacer->burst = rate * PACER_BURST_NS / 1000000000;
+  if (pacer->burst < PACER_MIN_BURST)
+    pacer->burst = PACER_MIN_BURST;
+  if (pacer->tokens > pacer->burst)
+    pacer->tokens = pacer->burst;
+}
+
+uint64_t pacer_wait(pacer_t *pacer, uint64_t now_ns) {
+  if (pacer->rate == 0)
+    return 0;
+  if (now_ns - pacer->last >= 1000000000) {
+    // idle for long, also keeps the product below from overflowing
+    pacer->tokens = pacer->burst;
+    pacer->last = now_ns;
+  } else if (now_ns > pacer->last) {
+    uint64_t refill = pacer->rate * (now_ns - pacer->last);
+    pacer->tokens += refill / 1000000000;
+    if (pacer->tokens > pacer->burst)
+      pacer->tokens = pacer->burst;
+    // what is less than a byte counts next time
+    pacer->last = now_ns - refill % 1000000000 / pacer->rate;
+  }
+  if (pacer->tokens >= 0)
+    return 0;
+  return (uint64_t)-pacer->tokens * 1000000000 / pacer->rate + 1;
+}
+
+/* return 1 if a TCP or UDP packet is from or to port */
+static int has_port(const unsigned char *l4, uint16_t port) {
+  return ((l4[0] << 8) | l4[1]) == port || ((l4[2] << 8) | l4[3]) == port;
+}
+
+int sched_classify(const unsigned char *ip, size_t len, uint8_t *dscp) {
+  const unsigned char *l4 = NULL;
+  size_t l4_len = 0;
+  uint8_t proto;
+
+  if (len >= 20 && (ip[0] & 0xf0) == 0x40) {
+    size_t ihl = (ip[0] & 0x0f) * 4;
+    *dscp = ip[1] >> 2;
+    proto = ip[9];
+    // fragments go by protocol alone, only the first one has ports
+    if (ihl >= 20 && len >= ihl && 0 == (((ip[6] & 0x3f) << 8) | ip[7])) {
+      l4 = ip + ihl;
+      l4_len = len - ihl;
+    }
+  } else if (len >= 40 && (ip[0] & 0xf0) == 0x60) {
+    *dscp = ((ip[0] & 0x0f) << 2) | (ip[1] >> 6);
+    // extension headers are rare enough to be normal
+    proto = ip[6];
+    l4 = ip + 40;
+    l4_len = len - 40;
+  } else {
+    *dscp = 0;
+    return SCHED_PRIO_NORMAL;
+  }
+
+  if (*dscp >= 32)
+    return SCHED_PRIO_HIGH;
+  if (*dscp == 8 || *dscp == 1)
+    return SCHED_PRIO_LOW;
+  if (*dscp != 0)
+    return SCHED_PRIO_NORMAL;
+
+  if (proto == IPPROTO_ICMP || proto == 58)
+    return SCHED_PRIO_HIGH;
+  // not by length or flags, a small packet must not overtake the data of
+  // its own flow
+  if (proto == IPPROTO_TCP && l4_len >= 4 && has_port(l4, 53))
+    return SCHED_PRIO_HIGH;
+  if (proto == IPPROTO_UDP && l4_len >= 4 &&
+      (has_port(l4, 53) || has_port(l4, 123)))
+    return SCHED_PRIO_HIGH;
+  return SCHED_PRIO_NORMAL;
+}
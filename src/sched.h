@@ -0,0 +1,238 @@
+/**
+  sched.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef TARGET_WIN32
+#include "win32.h"
+#else
+#include <sys/socket.h>
+#endif
+
+#include "timer.h"
+#include "stats.h"
+
+/**
+  This module queues packets read from tun before they are sent over UDP.
+
+  Each user has its own queue and its own token bucket. Queues with packets
+  are served by deficit round robin, so that a heavy user does not add
+  latency to the others. A queue out of tokens is skipped, and when all of
+  them are, a timer fires when the first one has tokens again.
+
+  Within a queue, packets wait in one of SCHED_PRIOS bands by priority, as
+  sched_classify() tells from their DSCP, protocol and ports, and the
+  highest band with packets is always served first. So interactive
+  traffic of a user does not wait behind its bulk traffic, and when the
+  queue is full, the oldest packet of a lower band makes room for it.
+*/
+
+/* max packets read from tun in one go */
+#define SCHED_BATCH 64
+
+/* max packets waiting in one queue */
+#define SCHED_QUEUE_LIMIT 64
+
+/* max packets waiting in all queues */
+#define SCHED_POOL_LIMIT 1024
+
+/* priorities, the lower the sooner */
+#define SCHED_PRIO_HIGH 0
+#define SCHED_PRIO_NORMAL 1
+#define SCHED_PRIO_LOW 2
+#define SCHED_PRIOS 3
+
+typedef struct sched_pkt_s sched_pkt_t;
+
+/* buf has the same layout as tun_buf, see crypto.h */
+struct sched_pkt_s {
+  sched_pkt_t *next;
+  // usertoken + payload
+  size_t len;
+  // in ns, when a packet sampled by latency_t was enqueued, 0 otherwise
+  uint64_t stamp;
+  // SCHED_PRIO_*, set before it is enqueued
+  uint8_t prio;
+  // of the IP packet, without ECN
+  uint8_t dscp;
+  unsigned char buf[];
+};
+
+typedef struct {
+  // in bytes, may go negative after a large packet
+  int64_t tokens;
+  // in bytes per second, 0 means unlimited
+  uint64_t rate;
+  // in bytes
+  int64_t burst;
+  // last refill, in ms
+  uint64_t last;
+} token_bucket_t;
+
+/*
+   spaces out all datagrams sent to rate, in bytes per second, with bursts
+   of at most PACER_BURST_NS worth. unlike token_bucket_t it counts in ns,
+   a ms at link speed is many datagrams
+*/
+typedef struct {
+  // 0 means not paced
+  uint64_t rate;
+  int64_t burst;
+  // in bytes, may go negative after a datagram
+  int64_t tokens;
+  // last refill, in ns
+  uint64_t last;
+} pacer_t;
+
+#define PACER_BURST_NS 1000000
+
+/* bursts are at least this many bytes, two full datagrams */
+#define PACER_MIN_BURST 3000
+
+/* bytes IPv4 and UDP headers add to a datagram on the wire */
+#define PACER_HDR_LEN 28
+
+/* in ms, how often pacing_auto sets the rate, and the least it sets */
+#define PACER_AUTO_INTERVAL 100
+#define PACER_AUTO_MIN_RATE 125000
+
+typedef struct sched_queue_s sched_queue_t;
+
+typedef struct {
+  sched_pkt_t *head;
+  sched_pkt_t *tail;
+} sched_band_t;
+
+struct sched_queue_s {
+  sched_band_t bands[SCHED_PRIOS];
+  // packets in all bands
+  int len;
+
+  // bytes this queue may still send in the current round
+  int64_t deficit;
+  // whether deficit has been topped up for the current round
+  int in_round;
+  // whether it is linked in the active list
+  int active;
+  sched_queue_t *next_active;
+
+  token_bucket_t bucket;
+
+  // where packets of this queue go, resolved when they are sent
+  struct sockaddr_storage *addr;
+  socklen_t *addrlen;
+
+  // of the user this queue belongs to
+  client_stats_t *stats;
+  // the peer_t this queue sends to, set by the owner
+  struct peer_s *peer;
+};
+
+typedef struct {
+  sched_pkt_t *free_pkts;
+  int npkts;
+  void *pool;
+
+  // bytes of packets waiting in all queues
+  size_t queued_bytes;
+
+  // queues with packets, served in order
+  sched_queue_t *active_head;
+  sched_queue_t *active_tail;
+  int nactive;
+
+  // in bytes, at least one full packet
+  int64_t quantum;
+  timer_wheel_t *timer_wheel;
+  // when the first queue out of tokens has some again
+  tw_timer_t refill_timer;
+} sched_t;
+
+/*
+   npkts packets of pkt_size bytes each are allocated upfront
+   return -1 on error
+*/
+int sched_init(sched_t *sched, size_t pkt_size, int npkts,
+               timer_wheel_t *timer_wheel);
+
+void sched_destroy(sched_t *sched);
+
+/* rate in bytes per second, 0 means unlimited */
+void sched_queue_init(sched_t *sched, sched_queue_t *queue, uint64_t rate,
+                      struct sockaddr_storage *addr, socklen_t *addrlen,
+                      client_stats_t *stats);
+
+/* return NULL if all packets are in use */
+sched_pkt_t *sched_alloc(sched_t *sched);
+
+void sched_free(sched_t *sched, sched_pkt_t *pkt);
+
+/*
+   return -1 if the queue is full, pkt is not freed in this case
+   return 1 if a packet of lower priority was dropped and freed to make
+   room for pkt
+*/
+int sched_enqueue(sched_t *sched, sched_queue_t *queue, sched_pkt_t *pkt);
+
+/*
+   return the next packet to send, and the queue it comes from
+   return NULL if every queue is out of tokens, refill_timer is started
+   for when the first has some again
+   the caller should free the packet after sending it
+*/
+sched_pkt_t *sched_dequeue(sched_t *sched, uint64_t now,
+                           sched_queue_t **queue);
+
+/*
+   return the next packet of the queue sched_dequeue() just returned a
+   packet from, if it is at most max_len bytes, so that it can go out in
+   the same datagram. it is charged like any other packet
+   return NULL otherwise
+*/
+sched_pkt_t *sched_dequeue_more(sched_t *sched, sched_queue_t *queue,
+                                size_t max_len);
+
+/* rate in bytes per second, 0 to stop pacing */
+void pacer_set_rate(pacer_t *pacer, uint64_t rate, uint64_t now_ns);
+
+/* return 0 if a datagram may be sent now, otherwise ns until one may */
+uint64_t pacer_wait(pacer_t *pacer, uint64_t now_ns);
+
+/* a datagram of len bytes, without IP and UDP headers, was sent */
+static inline void pacer_charge(pacer_t *pacer, size_t len) {
+  pacer->tokens -= len + PACER_HDR_LEN;
+}
+
+/*
+   return the SCHED_PRIO_* of the IP packet ip of len bytes, and its DSCP
+   in *dscp. only the DSCP, protocol and ports are looked at, so that all
+   packets of a flow land in the same band and are never reordered:
+   - high for DSCP CS4 and above, which is voice, video and network
+     control, and with no DSCP, for ICMP, DNS and NTP
+   - low for DSCP CS1 and LE, which ask for less than best effort
+   - normal for everything else
+*/
+int sched_classify(const unsigned char *ip, size_t len, uint8_t *dscp);
+
+#endif
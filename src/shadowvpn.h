@@ -27,9 +27,18 @@
 
 #include "log.h"
 #include "crypto.h"
+#include "frame.h"
+#include "fec.h"
+#include "compress.h"
+#include "rtt.h"
+#include "pmtu.h"
+#include "roam.h"
+#include "frag.h"
+#include "path.h"
 #include "args.h"
 #include "daemon.h"
 #include "shell.h"
+#include "timer.h"
 #include "nat.h"
 #include "vpn.h"
 
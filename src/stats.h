@@ -0,0 +1,84 @@
+/**
+  stats.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/**
+  Traffic counters of a user, and how its link is doing.
+
+  Counters are only written by the thread running vpn_run(), with plain
+  stores, and each user has its own cache line so that nothing is shared
+  on the datapath. Other threads may read them at any time with
+  stats_read().
+*/
+
+#define STATS_CACHE_LINE 64
+
+#if defined(__ATOMIC_RELAXED) && __SIZEOF_POINTER__ >= 8
+/* single writer, so load + store is enough, and compiles to plain moves */
+#define STATS_ADD(field, n) \
+  __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define STATS_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STATS_SET(field, v) __atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+#else
+/* 64 bit atomics may need libatomic here, readers may see a torn value */
+#define STATS_ADD(field, n) ((field) += (n))
+#define STATS_LOAD(field) (*(volatile uint64_t *)&(field))
+#define STATS_SET(field, v) ((field) = (v))
+#endif
+
+typedef struct {
+  // UDP -> TUN, IP packets from the user
+  uint64_t rx_packets;
+  uint64_t rx_bytes;
+  // TUN -> UDP, IP packets to the user
+  uint64_t tx_packets;
+  uint64_t tx_bytes;
+  // packets to or from the user that were dropped
+  uint64_t drops;
+  // from keepalive probes, see rtt.h
+  uint64_t rtt_us;
+  uint64_t jitter_us;
+  uint64_t loss_permille;
+  // largest IP packet that gets through to the user, see pmtu.h
+  uint64_t mtu;
+  // times the address of the user changed, see roam.h
+  uint64_t roams;
+} __attribute__((aligned(STATS_CACHE_LINE))) client_stats_t;
+
+/* copy counters, safe to call from any thread */
+static inline void stats_read(const client_stats_t *stats,
+                              client_stats_t *out) {
+  out->rx_packets = STATS_LOAD(stats->rx_packets);
+  out->rx_bytes = STATS_LOAD(stats->rx_bytes);
+  out->tx_packets = STATS_LOAD(stats->tx_packets);
+  out->tx_bytes = STATS_LOAD(stats->tx_bytes);
+  out->drops = STATS_LOAD(stats->drops);
+  out->rtt_us = STATS_LOAD(stats->rtt_us);
+  out->jitter_us = STATS_LOAD(stats->jitter_us);
+  out->loss_permille = STATS_LOAD(stats->loss_permille);
+  out->mtu = STATS_LOAD(stats->mtu);
+  out->roams = STATS_LOAD(stats->roams);
+}
+
+#endif
@@ -0,0 +1,199 @@
+/**
+  timer.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "shadowvpn.h"
+
+#include <time.h>
+#ifndef TARGET_WIN32
+#include <sys/time.h>
+#endif
+
+#define TIMER_MAX_TICKS ((1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1)
+
+uint64_t timer_now_ms() {
+#ifdef TARGET_WIN32
+  return GetTickCount64();
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+static void list_init(tw_timer_t *head) {
+  head->next = head;
+  head->prev = head;
+}
+
+static void list_append(tw_timer_t *head, tw_timer_t *timer) {
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+static void list_remove(tw_timer_t *timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = NULL;
+  timer->prev = NULL;
+}
+
+/* move all timers from src to dst */
+static void list_take(tw_timer_t *dst, tw_timer_t *src) {
+  if (src->next == src) {
+    list_init(dst);
+    return;
+  }
+  dst->next = src->next;
+  dst->prev = src->prev;
+  dst->next->prev = dst;
+  dst->prev->next = dst;
+  list_init(src);
+}
+
+static void wheel_add(timer_wheel_t *tw, tw_timer_t *timer) {
+  uint64_t expires = timer->expires;
+  uint64_t delta;
+  int level;
+
+  if (expires < tw->tick) {
+    expires = tw->tick;
+  }
+  delta = expires - tw->tick;
+  if (delta > TIMER_MAX_TICKS) {
+    expires = tw->tick + TIMER_MAX_TICKS;
+    delta = TIMER_MAX_TICKS;
+  }
+  timer->expires = expires;
+  for (level = 0; level < TIMER_LEVELS - 1; level++) {
+    if (delta < (1ULL << (TIMER_BITS * (level + 1))))
+      break;
+  }
+  list_append(&tw->slots[level][(expires >> (TIMER_BITS * level)) &
+                                TIMER_MASK], timer);
+}
+
+/* re-add all timers of a slot on a higher level, they go to lower levels */
+static int cascade(timer_wheel_t *tw, int level) {
+  int index = (tw->tick >> (TIMER_BITS * level)) & TIMER_MASK;
+  tw_timer_t list;
+  tw_timer_t *timer;
+
+  list_take(&list, &tw->slots[level][index]);
+  while ((timer = list.next) != &list) {
+    list_remove(timer);
+    wheel_add(tw, timer);
+  }
+  return index;
+}
+
+void timer_wheel_init(timer_wheel_t *tw, uint64_t now_ms) {
+  int level, i;
+  tw->tick = 0;
+  tw->start_ms = now_ms;
+  tw->count = 0;
+  for (level = 0; level < TIMER_LEVELS; level++) {
+    for (i = 0; i < TIMER_SLOTS; i++) {
+      list_init(&tw->slots[level][i]);
+    }
+  }
+}
+
+void timer_wheel_advance(timer_wheel_t *tw, uint64_t now_ms) {
+  uint64_t target = (now_ms - tw->start_ms) / TIMER_TICK_MS;
+  while (tw->tick <= target) {
+    int index = tw->tick & TIMER_MASK;
+    int level;
+    tw_timer_t list;
+    tw_timer_t *timer;
+
+    if (tw->count == 0) {
+      // nothing to fire, just jump to target
+      tw->tick = target + 1;
+      break;
+    }
+    if (index == 0) {
+      for (level = 1; level < TIMER_LEVELS; level++) {
+        if (cascade(tw, level) != 0)
+          break;
+      }
+    }
+    // callbacks may start new timers, take the whole slot first
+    list_take(&list, &tw->slots[0][index]);
+    tw->tick++;
+    while ((timer = list.next) != &list) {
+      list_remove(timer);
+      tw->count--;
+      timer->cb(timer, timer->data);
+    }
+  }
+}
+
+int64_t timer_wheel_timeout(timer_wheel_t *tw, uint64_t now_ms) {
+  uint64_t tick;
+  int64_t timeout;
+
+  if (tw->count == 0)
+    return -1;
+  // look for the next non-empty slot on level 0 before it wraps around,
+  // otherwise wake up at the wrap around, so that cascade can happen
+  tick = tw->tick;
+  if (tick & TIMER_MASK) {
+    for (; tick & TIMER_MASK; tick++) {
+      tw_timer_t *head = &tw->slots[0][tick & TIMER_MASK];
+      if (head->next != head)
+        break;
+    }
+  }
+  timeout = (int64_t)(tw->start_ms + tick * TIMER_TICK_MS) - (int64_t)now_ms;
+  return timeout > 0 ? timeout : 0;
+}
+
+void timer_init(tw_timer_t *timer, tw_callback_t cb, void *data) {
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->expires = 0;
+  timer->cb = cb;
+  timer->data = data;
+}
+
+void timer_start(timer_wheel_t *tw, tw_timer_t *timer, uint64_t timeout_ms) {
+  timer_stop(tw, timer);
+  // round up to whole ticks
+  timer->expires = tw->tick + (timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  wheel_add(tw, timer);
+  tw->count++;
+}
+
+void timer_stop(timer_wheel_t *tw, tw_timer_t *timer) {
+  if (timer_pending(timer)) {
+    list_remove(timer);
+    tw->count--;
+  }
+}
+
+int timer_pending(const tw_timer_t *timer) {
+  return timer->next != NULL;
+}
@@ -0,0 +1,90 @@
+/**
+  timer.h
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/**
+  A hierarchical timer wheel driven by the event loop.
+
+  Timers are kept in TIMER_LEVELS levels of TIMER_SLOTS slots each. Level 0
+  covers the next TIMER_SLOTS ticks, level 1 the next TIMER_SLOTS^2, and so
+  on. Timers on higher levels are cascaded down when the lower level wraps
+  around. Starting and stopping a timer is O(1), so is each tick.
+*/
+
+#define TIMER_TICK_MS 10
+#define TIMER_LEVELS 4
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+typedef struct tw_timer_s tw_timer_t;
+
+typedef void (*tw_callback_t)(tw_timer_t *timer, void *data);
+
+/* embed this into whatever needs a timer */
+struct tw_timer_s {
+  tw_timer_t *next;
+  tw_timer_t *prev;
+  // in ticks
+  uint64_t expires;
+  tw_callback_t cb;
+  void *data;
+};
+
+typedef struct {
+  // current tick, every tick before it has been processed
+  uint64_t tick;
+  // time of tick 0, in ms
+  uint64_t start_ms;
+  // number of pending timers
+  int count;
+  // list heads
+  tw_timer_t slots[TIMER_LEVELS][TIMER_SLOTS];
+} timer_wheel_t;
+
+/* monotonic clock in ms */
+uint64_t timer_now_ms();
+
+void timer_wheel_init(timer_wheel_t *tw, uint64_t now_ms);
+
+/* fire every timer that has expired by now_ms */
+void timer_wheel_advance(timer_wheel_t *tw, uint64_t now_ms);
+
+/*
+   return ms until the next timer may fire, suitable for select()
+   return -1 if no timer is pending
+*/
+int64_t timer_wheel_timeout(timer_wheel_t *tw, uint64_t now_ms);
+
+void timer_init(tw_timer_t *timer, tw_callback_t cb, void *data);
+
+/* (re)start timer, it will fire once after timeout_ms */
+void timer_start(timer_wheel_t *tw, tw_timer_t *timer, uint64_t timeout_ms);
+
+/* no-op if timer is not pending */
+void timer_stop(timer_wheel_t *tw, tw_timer_t *timer);
+
+int timer_pending(const tw_timer_t *timer);
+
+#endif
@@ -21,11 +21,13 @@
 // TODO we want to put shadowvpn.h at the bottom of the imports
 // but TARGET_* is defined in config.h
 #include "shadowvpn.h"
+#include "portable_endian.h"
 
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 
 #ifndef TARGET_WIN32
@@ -48,6 +50,8 @@
 
 #ifdef TARGET_LINUX
 #include <linux/if_tun.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #endif
 
 #ifdef TARGET_FREEBSD
@@ -93,6 +97,10 @@
 
 #endif
 
+/* bytes written to control_pipe / control_fd */
+#define VPN_CONTROL_STOP 0
+#define VPN_CONTROL_STATS 1
+
 #ifdef TARGET_LINUX
 int vpn_tun_alloc(const char *dev) {
   struct ifreq ifr;
@@ -303,6 +311,14 @@ int vpn_udp_alloc(int if_bind, const char *host, int port,
     return -1;
   }
 
+#ifdef SO_RXQ_OVFL
+  // have the kernel tell how many datagrams it dropped, see kernel_udp_recv
+  int on = 1;
+  if (-1 == setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on))) {
+    err("setsockopt[SO_RXQ_OVFL]");
+  }
+#endif
+
   if (if_bind) {
     if (0 != bind(sock, res->ai_addr, res->ai_addrlen)) {
       err("bind");
@@ -332,12 +348,288 @@ int vpn_udp_alloc(int if_bind, const char *host, int port,
   return -1;
 }
 
+/* force_opt ignores rmem_max / wmem_max but needs CAP_NET_ADMIN, -1 if none */
+static void vpn_sock_buf(int sock, int opt, int force_opt, int size,
+                         const char *name) {
+  if (force_opt != -1 &&
+      0 == setsockopt(sock, SOL_SOCKET, force_opt, (const char *)&size,
+                      sizeof(size))) {
+    return;
+  }
+  if (-1 == setsockopt(sock, SOL_SOCKET, opt, (const char *)&size,
+                       sizeof(size))) {
+    err(name);
+  }
+}
+
+/* send from intf whatever the routing table says, return -1 on error */
+static int vpn_sock_bind_intf(int sock, const char *intf) {
+#ifdef SO_BINDTODEVICE
+  if (-1 == setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, intf,
+                       strlen(intf) + 1)) {
+    err("setsockopt[SO_BINDTODEVICE]");
+    return -1;
+  }
+  return 0;
+#else
+  errf("binding to an interface is only supported on Linux");
+  return -1;
+#endif
+}
+
+/* have what sock sends never fragmented, for path MTU discovery */
+static void vpn_sock_dontfrag(int sock, int family) {
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+  // DF, but datagrams are not held to what the kernel thinks the path MTU
+  // is, the probes find out for themselves
+  int val = IP_PMTUDISC_PROBE;
+  if (family == AF_INET6) {
+    int val6 = IPV6_PMTUDISC_PROBE;
+    if (-1 == setsockopt(sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &val6,
+                         sizeof(val6)))
+      err("setsockopt[IPV6_MTU_DISCOVER]");
+    // for IPv4 mapped addresses, fails harmlessly if IPv6 only
+    setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+  } else if (-1 == setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &val,
+                              sizeof(val))) {
+    err("setsockopt[IP_MTU_DISCOVER]");
+  }
+#elif defined(IP_DONTFRAG)
+  int on = 1;
+  if (family == AF_INET6) {
+#ifdef IPV6_DONTFRAG
+    if (-1 == setsockopt(sock, IPPROTO_IPV6, IPV6_DONTFRAG, &on, sizeof(on)))
+      err("setsockopt[IPV6_DONTFRAG]");
+#endif
+  } else if (-1 == setsockopt(sock, IPPROTO_IP, IP_DONTFRAG, &on,
+                              sizeof(on))) {
+    err("setsockopt[IP_DONTFRAG]");
+  }
+#else
+  errf("warning: datagrams may be fragmented, pmtud may find a path MTU "
+       "too large");
+#endif
+}
+
+#ifdef TARGET_LINUX
+static int vpn_tun_txqueuelen(const char *dev, int qlen) {
+  struct ifreq ifr;
+  int fd;
+
+  if (-1 == (fd = socket(AF_INET, SOCK_DGRAM, 0))) {
+    err("socket");
+    return -1;
+  }
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+  ifr.ifr_qlen = qlen;
+  if (-1 == ioctl(fd, SIOCSIFTXQLEN, &ifr)) {
+    err("ioctl[SIOCSIFTXQLEN]");
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+#endif
+
+#ifdef TARGET_LINUX
+/* a netlink socket told about changes of local addresses and routes */
+static int vpn_addr_watch() {
+  struct sockaddr_nl sa;
+  int fd;
+
+  if (-1 == (fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE))) {
+    err("socket[NETLINK_ROUTE]");
+    return -1;
+  }
+  bzero(&sa, sizeof(sa));
+  sa.nl_family = AF_NETLINK;
+  sa.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+                 RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+  if (-1 == bind(fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+      -1 == fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK)) {
+    err("bind[NETLINK_ROUTE]");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* the interface a route goes out of, 0 if not known */
+static int vpn_route_oif(struct nlmsghdr *nh) {
+  struct rtmsg *rtm = NLMSG_DATA(nh);
+  struct rtattr *rta = RTM_RTA(rtm);
+  int len = RTM_PAYLOAD(nh);
+  int oif;
+
+  for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+    if (rta->rta_type == RTA_OIF && RTA_PAYLOAD(rta) >= sizeof(oif)) {
+      memcpy(&oif, RTA_DATA(rta), sizeof(oif));
+      return oif;
+    }
+  }
+  return 0;
+}
+
+static int kernel_addr_changed(vpn_ctx_t *ctx) {
+  char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+  struct nlmsghdr *nh;
+  // routes and addresses of our own tun change when it is set up
+  int tun_index = if_nametoindex(ctx->args->intf);
+  int changed = 0, len;
+  ssize_t r;
+
+  while ((r = recv(ctx->addr_fd, buf, sizeof(buf), 0)) > 0) {
+    len = r;
+    for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+         nh = NLMSG_NEXT(nh, len)) {
+      switch (nh->nlmsg_type) {
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+          if (((struct ifaddrmsg *)NLMSG_DATA(nh))->ifa_index != tun_index)
+            changed = 1;
+          break;
+        case RTM_NEWROUTE:
+        case RTM_DELROUTE:
+          if (vpn_route_oif(nh) != tun_index)
+            changed = 1;
+          break;
+      }
+    }
+  }
+  // ENOBUFS means events were missed, so something did change
+  if (r == -1 && errno == ENOBUFS)
+    changed = 1;
+  return changed;
+}
+#else
+static int kernel_addr_changed(vpn_ctx_t *ctx) {
+  return 0;
+}
+#endif
+
+#ifdef SO_RXQ_OVFL
+/* recvfrom that also keeps the drop counter the kernel sends along */
+static ssize_t kernel_udp_recv(vpn_ctx_t *ctx, int i, void *buf, size_t len,
+                               struct sockaddr *addr, socklen_t *addrlen) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(sizeof(uint32_t))];
+  ssize_t r;
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  bzero(&msg, sizeof(msg));
+  msg.msg_name = addr;
+  msg.msg_namelen = *addrlen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (-1 == (r = recvmsg(ctx->socks[i], &msg, 0)))
+    return -1;
+  *addrlen = msg.msg_namelen;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      // dropped since the socket was created, only sent once non zero
+      uint32_t drops;
+      memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+      STATS_ADD(ctx->sock_drops[i], drops - ctx->sock_drops[i]);
+    }
+  }
+  return r;
+}
+#else
+static ssize_t kernel_udp_recv(vpn_ctx_t *ctx, int i, void *buf, size_t len,
+                               struct sockaddr *addr, socklen_t *addrlen) {
+  return recvfrom(ctx->socks[i], buf, len, 0, addr, addrlen);
+}
+#endif
+
+static ssize_t kernel_udp_send(vpn_ctx_t *ctx, int i, const void *buf,
+                               size_t len, const struct sockaddr *addr,
+                               socklen_t addrlen) {
+  return sendto(ctx->socks[i], buf, len, 0, addr, addrlen);
+}
+
+static int kernel_udp_tos(vpn_ctx_t *ctx, int i, int family, int tos) {
+  if (family == AF_INET6) {
+#ifdef IPV6_TCLASS
+    if (-1 == setsockopt(ctx->socks[i], IPPROTO_IPV6, IPV6_TCLASS,
+                         (const char *)&tos, sizeof(tos)))
+      return -1;
+#endif
+    // for IPv4 mapped addresses, fails harmlessly if IPv6 only
+    setsockopt(ctx->socks[i], IPPROTO_IP, IP_TOS, (const char *)&tos,
+               sizeof(tos));
+    return 0;
+  }
+  return setsockopt(ctx->socks[i], IPPROTO_IP, IP_TOS, (const char *)&tos,
+                    sizeof(tos));
+}
+
+static int kernel_udp_pacing(vpn_ctx_t *ctx, int i, uint64_t rate) {
+#ifdef SO_MAX_PACING_RATE
+  // only the fq qdisc paces, otherwise the userspace pacer still does
+  unsigned int val = rate < UINT_MAX ? rate : UINT_MAX;
+  return setsockopt(ctx->socks[i], SOL_SOCKET, SO_MAX_PACING_RATE, &val,
+                    sizeof(val));
+#else
+  return 0;
+#endif
+}
+
+static ssize_t kernel_tun_read(vpn_ctx_t *ctx, void *buf, size_t len) {
+  return tun_read(ctx->tun, buf, len);
+}
+
+static ssize_t kernel_tun_write(vpn_ctx_t *ctx, void *buf, size_t len) {
+  return tun_write(ctx->tun, buf, len);
+}
+
+static void kernel_close(vpn_ctx_t *ctx) {
+  int i;
+  close(ctx->tun);
+  for (i = 0; i < ctx->nsock; i++) {
+    close(ctx->socks[i]);
+  }
+  if (ctx->addr_fd != -1)
+    close(ctx->addr_fd);
+}
+
+static const vpn_io_ops_t kernel_ops = {
+  kernel_tun_read,
+  kernel_tun_write,
+  kernel_udp_recv,
+  kernel_udp_send,
+  kernel_udp_tos,
+  kernel_udp_pacing,
+  kernel_addr_changed,
+  kernel_close
+};
+
 #ifndef TARGET_WIN32
 static int max(int a, int b) {
   return a > b ? a : b;
 }
 #endif
 
+static void vpn_remote_idle(tw_timer_t *timer, void *data) {
+  vpn_ctx_t *ctx = data;
+  uint64_t idle_timeout = (uint64_t)ctx->args->idle_timeout * 1000;
+  uint64_t idle = ctx->now - ctx->last_seen;
+
+  // last_seen is updated without touching the timer, check it here
+  if (idle < idle_timeout) {
+    timer_start(&ctx->timer_wheel, timer, idle_timeout - idle);
+    return;
+  }
+  logf("client idle for %llus, evicted", (unsigned long long)idle / 1000);
+  ctx->remote_addrlen = 0;
+}
+
 int vpn_ctx_init(vpn_ctx_t *ctx, shadowvpn_args_t *args) {
   int i;
 #ifdef TARGET_WIN32
@@ -360,6 +652,7 @@ int vpn_ctx_init(vpn_ctx_t *ctx, shadowvpn_args_t *args) {
 
   bzero(ctx, sizeof(vpn_ctx_t));
   ctx->remote_addrp = (struct sockaddr *)&ctx->remote_addr;
+  ctx->addr_fd = -1;
 
 #ifndef TARGET_WIN32
   if (-1 == pipe(ctx->control_pipe)) {
@@ -370,6 +663,13 @@ int vpn_ctx_init(vpn_ctx_t *ctx, shadowvpn_args_t *args) {
     errf("failed to create tun device");
     return -1;
   }
+  if (args->txqueuelen) {
+#ifdef TARGET_LINUX
+    vpn_tun_txqueuelen(args->intf, args->txqueuelen);
+#else
+    errf("warning: txqueuelen is only supported on Linux");
+#endif
+  }
 #else
   if (-1 == (ctx->control_fd = vpn_udp_alloc(1, TUN_DELEGATE_ADDR,
                                              args->tun_port + 1,
@@ -389,19 +689,1390 @@ int vpn_ctx_init(vpn_ctx_t *ctx, shadowvpn_args_t *args) {
   }
 #endif
   ctx->nsock = 1;
+  if (args->mode == SHADOWVPN_MODE_CLIENT && args->paths_len > 0) {
+    if (-1 == multipath_init(&ctx->multipath, args)) {
+      close(ctx->tun);
+      return -1;
+    }
+    ctx->nsock = args->paths_len;
+  }
   ctx->socks = calloc(ctx->nsock, sizeof(int));
+  ctx->sock_drops = calloc(ctx->nsock, sizeof(uint64_t));
+  ctx->sock_dscp = calloc(ctx->nsock, sizeof(uint8_t));
   for (i = 0; i < ctx->nsock; i++) {
     int *sock = ctx->socks + i;
-    if (-1 == (*sock = vpn_udp_alloc(args->mode == SHADOWVPN_MODE_SERVER,
-                                     args->server, args->port,
-                                     ctx->remote_addrp,
-                                     &ctx->remote_addrlen))) {
+    if (ctx->multipath.npaths) {
+      shadowvpn_path_t *p = &args->paths[i];
+      path_t *path = &ctx->multipath.paths[i];
+      *sock = vpn_udp_alloc(0, p->host, p->port,
+                            (struct sockaddr *)&path->addr, &path->addrlen);
+      if (*sock != -1 && p->intf && -1 == vpn_sock_bind_intf(*sock, p->intf))
+        errf("warning: path %d is not bound to %s", i, p->intf);
+      // the queue needs an address to send to, whichever path it goes
+      if (i == 0) {
+        memcpy(ctx->remote_addrp, &path->addr, path->addrlen);
+        ctx->remote_addrlen = path->addrlen;
+      }
+    } else {
+      *sock = vpn_udp_alloc(args->mode == SHADOWVPN_MODE_SERVER,
+                            args->server, args->port, ctx->remote_addrp,
+                            &ctx->remote_addrlen);
+    }
+    if (*sock == -1) {
       errf("failed to create UDP socket");
       close(ctx->tun);
       return -1;
     }
+    if (args->pmtud) {
+      vpn_sock_dontfrag(*sock, ctx->multipath.npaths ?
+                        ctx->multipath.paths[i].addr.ss_family :
+                        ctx->remote_addr.ss_family);
+    }
+#ifdef SO_RCVBUFFORCE
+    if (args->rcvbuf)
+      vpn_sock_buf(*sock, SO_RCVBUF, SO_RCVBUFFORCE, args->rcvbuf,
+                   "setsockopt[SO_RCVBUF]");
+    if (args->sndbuf)
+      vpn_sock_buf(*sock, SO_SNDBUF, SO_SNDBUFFORCE, args->sndbuf,
+                   "setsockopt[SO_SNDBUF]");
+#else
+    if (args->rcvbuf)
+      vpn_sock_buf(*sock, SO_RCVBUF, -1, args->rcvbuf,
+                   "setsockopt[SO_RCVBUF]");
+    if (args->sndbuf)
+      vpn_sock_buf(*sock, SO_SNDBUF, -1, args->sndbuf,
+                   "setsockopt[SO_SNDBUF]");
+#endif
+  }
+  if (args->mode == SHADOWVPN_MODE_CLIENT && args->roaming) {
+#ifdef TARGET_LINUX
+    ctx->addr_fd = vpn_addr_watch();
+#else
+    errf("warning: roaming only notices address changes on Linux, "
+         "elsewhere it takes up to %ds", ROAM_REFRESH_INTERVAL / 1000);
+#endif
   }
   ctx->args = args;
+  ctx->io_ops = &kernel_ops;
+  return 0;
+}
+
+/* record the time since *t as stage, then move *t to now */
+static void vpn_latency_mark(vpn_ctx_t *ctx, latency_stage_t stage,
+                             uint64_t *t) {
+  uint64_t now = latency_now_ns();
+  latency_record(&ctx->latency, stage, now - *t);
+  *t = now;
+}
+
+/*
+   t is NULL unless the packet is sampled, then it is when the last stage
+   ended
+   return 1 if the packet was dropped, return -1 on fatal error
+*/
+static int vpn_send(vpn_ctx_t *ctx, int sock, unsigned char *buf,
+                    size_t len, const struct sockaddr *addr,
+                    socklen_t addrlen, uint64_t *t) {
+  ssize_t r;
+
+  crypto_encrypt(ctx->udp_buf, buf, len);
+  if (t)
+    vpn_latency_mark(ctx, LATENCY_ENCRYPT, t);
+  if (capture_on(&ctx->capture)) {
+    capture_packet(&ctx->capture, CAPTURE_UDP, CAPTURE_OUT,
+                   ctx->usertoken_len ? buf + SHADOWVPN_ZERO_BYTES : NULL,
+                   ctx->udp_buf + SHADOWVPN_PACKET_OFFSET,
+                   SHADOWVPN_OVERHEAD_LEN + len);
+  }
+
+  r = ctx->io_ops->send_udp(ctx, sock, ctx->udp_buf + SHADOWVPN_PACKET_OFFSET,
+                            SHADOWVPN_OVERHEAD_LEN + len, addr, addrlen);
+  if (t)
+    vpn_latency_mark(ctx, LATENCY_SENDTO, t);
+  if (r == -1) {
+    int e = errno;
+    METRICS_ADD(ctx->metrics.sendto_errors[e < METRICS_ERRNO_MAX ?
+                                           e : METRICS_ERRNO_MAX], 1);
+    if (e == EAGAIN || e == EWOULDBLOCK) {
+      METRICS_ADD(ctx->metrics.eagain_drops, 1);
+    } else if (e == ENETUNREACH || e == ENETDOWN ||
+               e == EPERM || e == EINTR || e == EMSGSIZE) {
+      // just log, do nothing
+      err("sendto");
+    } else {
+      err("sendto");
+      // TODO rebuild socket
+      return -1;
+    }
+    // for the caller to tell why
+    errno = e;
+    return 1;
+  }
+  METRICS_ADD(ctx->metrics.udp_tx_packets, 1);
+  METRICS_ADD(ctx->metrics.udp_tx_bytes, r);
+  if (ctx->pacer.rate)
+    pacer_charge(&ctx->pacer, r);
+  return 0;
+}
+
+/* with args->tos, have socket i send with DSCP dscp from now on */
+static void vpn_sock_tos(vpn_ctx_t *ctx, int i, const struct sockaddr *addr,
+                         uint8_t dscp) {
+  if (!ctx->args->tos || ctx->sock_dscp[i] == dscp)
+    return;
+  ctx->sock_dscp[i] = dscp;
+  if (-1 == ctx->io_ops->set_tos(ctx, i, addr->sa_family, dscp << 2))
+    err("setsockopt[IP_TOS]");
+}
+
+/* bytes FEC adds to a plaintext of at most mtu */
+static size_t vpn_frame_overhead(vpn_ctx_t *ctx) {
+  // parity also has the length of what it covers
+  return ctx->args->fec_data ? FEC_HDR_LEN + 2 : 0;
+}
+
+/*
+   send the plaintext in buf of len bytes, with the user token, to peer in
+   pieces that fit the path, see frag.h. return the same as vpn_send
+*/
+static int vpn_send_pieces(vpn_ctx_t *ctx, peer_t *peer, int i,
+                           const struct sockaddr *addr, socklen_t addrlen,
+                           unsigned char *buf, size_t len, uint64_t *t) {
+  size_t usertoken_len = ctx->usertoken_len;
+  unsigned char *frame = ctx->frag_buf + SHADOWVPN_ZERO_BYTES;
+  size_t room = peer->pmtu.mtu + vpn_frame_overhead(ctx);
+  int count = frag_count(len - usertoken_len, room);
+  uint16_t id = peer->frag_id++;
+  int j, r = 0;
+
+  if (count == 0) {
+    // only if the path is far smaller than mtu
+    errno = EMSGSIZE;
+    return 1;
+  }
+  memcpy(frame, buf + SHADOWVPN_ZERO_BYTES, usertoken_len);
+  for (j = 0; j < count && r == 0; j++) {
+    size_t n = frag_piece(frame + usertoken_len, id, j, count,
+                          buf + SHADOWVPN_ZERO_BYTES + usertoken_len,
+                          len - usertoken_len);
+    // only the first piece is sampled
+    r = vpn_send(ctx, i, ctx->frag_buf, usertoken_len + n, addr, addrlen,
+                 j == 0 ? t : NULL);
+  }
+  if (r == 0)
+    METRICS_ADD(ctx->metrics.fragmented_tx, 1);
+  return r;
+}
+
+/*
+   send a datagram of flow to the peer of queue, over the path of the flow
+   if there are several, with DSCP dscp. with args->fragment, it is sent in
+   pieces if it is too large for the path. return the same as vpn_send
+*/
+static int vpn_send_to(vpn_ctx_t *ctx, sched_queue_t *queue, uint32_t flow,
+                       uint8_t dscp, unsigned char *buf, size_t len,
+                       uint64_t *t) {
+  int i = 0;
+  const struct sockaddr *addr = (struct sockaddr *)queue->addr;
+  socklen_t addrlen = *queue->addrlen;
+  peer_t *peer = queue->peer;
+
+  if (ctx->multipath.npaths) {
+    path_t *path = &ctx->multipath.paths[i = multipath_pick(&ctx->multipath,
+                                                            flow)];
+    addr = (struct sockaddr *)&path->addr;
+    addrlen = path->addrlen;
+  }
+  vpn_sock_tos(ctx, i, addr, dscp);
+  if (ctx->args->fragment && len - ctx->usertoken_len >
+                             peer->pmtu.mtu + vpn_frame_overhead(ctx))
+    return vpn_send_pieces(ctx, peer, i, addr, addrlen, buf, len, t);
+  return vpn_send(ctx, i, buf, len, addr, addrlen, t);
+}
+
+/*
+   if the IP packet ip from tun is larger than the path to its peer takes,
+   tell its sender with an ICMP error written to tun
+   return 1 if it did, and ip is to be dropped
+*/
+static int vpn_too_big(vpn_ctx_t *ctx, const unsigned char *ip, size_t len) {
+  unsigned char *icmp = ctx->frame_buf + SHADOWVPN_ZERO_BYTES;
+  peer_t *peer = &ctx->peer;
+  size_t icmp_len;
+
+  if (ctx->nat_ctx) {
+    client_info_t *client = nat_find_downstream(ctx->nat_ctx, ip, len);
+    // nat_fix_downstream() drops it
+    if (client == NULL)
+      return 0;
+    peer = &client->peer;
+  }
+  if (len <= peer->pmtu.mtu)
+    return 0;
+  // IPv4 packets without DF are sent anyway
+  icmp_len = pmtu_icmp_too_big(icmp, ctx->args->mtu + FRAME_HEADROOM +
+                               ctx->usertoken_len, ip, len, peer->pmtu.mtu);
+  if (icmp_len == 0)
+    return 0;
+  METRICS_ADD(ctx->metrics.pmtu_too_big, 1);
+  if (-1 == ctx->io_ops->write_tun(ctx, icmp, icmp_len)) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      METRICS_ADD(ctx->metrics.eagain_drops, 1);
+    else
+      err("write to tun");
+  }
+  return 1;
+}
+
+/* read a batch of packets from tun into the queues, return -1 on fatal error */
+static int vpn_read_tun(vpn_ctx_t *ctx) {
+  size_t usertoken_len = ctx->usertoken_len;
+  ssize_t r;
+  int i, enqueued;
+
+#ifdef TARGET_WIN32
+  // tun is not non-blocking on Windows
+  for (i = 0; i < 1; i++) {
+#else
+  for (i = 0; i < SCHED_BATCH; i++) {
+#endif
+    sched_pkt_t *pkt = sched_alloc(&ctx->sched);
+    sched_queue_t *queue = &ctx->queue;
+    // when all packets are in use, read into tun_buf and drop it
+    unsigned char *buf = pkt ? pkt->buf : ctx->tun_buf;
+    int sampled = latency_sample(&ctx->latency,
+                                 &ctx->latency.countdown_down);
+    uint64_t t = 0;
+
+    if (sampled)
+      t = latency_now_ns();
+    r = ctx->io_ops->read_tun(ctx, buf + SHADOWVPN_ZERO_BYTES + usertoken_len,
+                              ctx->args->mtu);
+    if (r <= 0) {
+      // sample the next packet instead
+      if (sampled)
+        ctx->latency.countdown_down = 1;
+      if (pkt)
+        sched_free(&ctx->sched, pkt);
+      if (r == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+        // do nothing
+        break;
+      } else if (errno == EPERM || errno == EINTR) {
+        // just log, do nothing
+        err("read from tun");
+        break;
+      } else {
+        err("read from tun");
+        return -1;
+      }
+    }
+    if (sampled)
+      vpn_latency_mark(ctx, LATENCY_TUN_READ, &t);
+    METRICS_ADD(ctx->metrics.tun_rx_packets, 1);
+    METRICS_ADD(ctx->metrics.tun_rx_bytes, r);
+    if (pkt == NULL) {
+      METRICS_ADD(ctx->metrics.queue_drops, 1);
+      continue;
+    }
+    // with fragment, packets too large are sent in pieces instead
+    if (r > ctx->pmtu_min && !ctx->args->fragment &&
+        vpn_too_big(ctx, buf + SHADOWVPN_ZERO_BYTES + usertoken_len, r)) {
+      sched_free(&ctx->sched, pkt);
+      continue;
+    }
+    pkt->len = r + usertoken_len;
+    pkt->prio = sched_classify(buf + SHADOWVPN_ZERO_BYTES + usertoken_len, r,
+                               &pkt->dscp);
+    if (usertoken_len) {
+      if (ctx->args->mode == SHADOWVPN_MODE_CLIENT) {
+        memcpy(buf + SHADOWVPN_ZERO_BYTES,
+               ctx->args->user_tokens[0], usertoken_len);
+      } else {
+        client_info_t *client = NULL;
+        // do NAT for downstream
+        if (-1 == nat_fix_downstream(ctx->nat_ctx,
+                                     buf + SHADOWVPN_ZERO_BYTES, pkt->len,
+                                     &client)) {
+          METRICS_ADD(ctx->metrics.nat_misses, 1);
+          sched_free(&ctx->sched, pkt);
+          continue;
+        }
+        if (sampled)
+          vpn_latency_mark(ctx, LATENCY_NAT_DOWN, &t);
+        queue = &client->queue;
+      }
+    }
+    if (capture_on(&ctx->capture)) {
+      capture_packet(&ctx->capture, CAPTURE_TUN, CAPTURE_OUT,
+                     usertoken_len ? buf + SHADOWVPN_ZERO_BYTES : NULL,
+                     buf + SHADOWVPN_ZERO_BYTES + usertoken_len, r);
+    }
+    pkt->stamp = t;
+    // nowhere to send yet, or queue is full
+    if (*queue->addrlen == 0 ||
+        -1 == (enqueued = sched_enqueue(&ctx->sched, queue, pkt))) {
+      STATS_ADD(queue->stats->drops, 1);
+      METRICS_ADD(ctx->metrics.queue_drops, 1);
+      sched_free(&ctx->sched, pkt);
+    } else if (enqueued == 1) {
+      // a packet of lower priority made room
+      STATS_ADD(queue->stats->drops, 1);
+      METRICS_ADD(ctx->metrics.queue_drops, 1);
+    }
+  }
+  if (i)
+    metrics_add_batch(&ctx->metrics, i);
+  return 0;
+}
+
+/*
+   the largest packet, with its user token, that still fits in a bundle to
+   a peer that takes mtu
+*/
+static size_t vpn_bundle_room(vpn_ctx_t *ctx, size_t mtu, size_t bundle_len) {
+  if (bundle_len + FRAME_BUNDLE_HDR_LEN >= mtu)
+    return 0;
+  return mtu - bundle_len - FRAME_BUNDLE_HDR_LEN + ctx->usertoken_len;
+}
+
+/*
+   pack pkt and the packets queued after it into a bundle in frame_buf, as
+   long as they fit in one datagram. the packets are chained to pkt
+   return the length of the bundle with the user token, 0 if nothing could
+   be packed with pkt
+*/
+static size_t vpn_bundle(vpn_ctx_t *ctx, sched_queue_t *queue,
+                         sched_pkt_t *pkt) {
+  size_t usertoken_len = ctx->usertoken_len;
+  unsigned char *bundle = ctx->frame_buf + SHADOWVPN_ZERO_BYTES;
+  sched_pkt_t *more, *tail = pkt;
+  size_t len = 1 + FRAME_BUNDLE_HDR_LEN + pkt->len - usertoken_len;
+  size_t mtu = queue->peer->pmtu.mtu;
+
+  more = sched_dequeue_more(&ctx->sched, queue,
+                            vpn_bundle_room(ctx, mtu, len));
+  if (more == NULL)
+    return 0;
+  memcpy(bundle, pkt->buf + SHADOWVPN_ZERO_BYTES, usertoken_len);
+  len = frame_bundle_add(bundle + usertoken_len, 0,
+                         pkt->buf + SHADOWVPN_ZERO_BYTES + usertoken_len,
+                         pkt->len - usertoken_len);
+  do {
+    len = frame_bundle_add(bundle + usertoken_len, len,
+                           more->buf + SHADOWVPN_ZERO_BYTES + usertoken_len,
+                           more->len - usertoken_len);
+    tail->next = more;
+    tail = more;
+  } while (NULL != (more = sched_dequeue_more(&ctx->sched, queue,
+                                              vpn_bundle_room(ctx, mtu,
+                                                              len))));
+  return usertoken_len + len;
+}
+
+/*
+   compress the plaintext in buf, of which pkt is the first packet, into
+   compress_buf
+   return the length with the user token, 0 to send buf as is
+*/
+static size_t vpn_compress(vpn_ctx_t *ctx, sched_queue_t *queue,
+                           sched_pkt_t *pkt, unsigned char *buf,
+                           size_t len) {
+  size_t usertoken_len = ctx->usertoken_len;
+  unsigned char *out = ctx->compress_buf + SHADOWVPN_ZERO_BYTES;
+  compress_class_t *cls;
+  size_t n;
+
+  if (len - usertoken_len < COMPRESS_MIN_LEN)
+    return 0;
+  cls = &queue->peer->compress[compress_class(
+      pkt->buf + SHADOWVPN_ZERO_BYTES + usertoken_len,
+      pkt->len - usertoken_len)];
+  if (compress_bypass(cls)) {
+    METRICS_ADD(ctx->metrics.compress_bypassed, 1);
+    return 0;
+  }
+  n = compress_frame(&ctx->compress, cls,
+                     buf + SHADOWVPN_ZERO_BYTES + usertoken_len,
+                     len - usertoken_len, out + usertoken_len);
+  if (n == 0)
+    return 0;
+  memcpy(out, buf + SHADOWVPN_ZERO_BYTES, usertoken_len);
+  METRICS_ADD(ctx->metrics.compressed_tx, 1);
+  METRICS_ADD(ctx->metrics.compress_saved_bytes, len - usertoken_len - n);
+  return usertoken_len + n;
+}
+
+static fec_encoder_t *vpn_fec_encoder(vpn_ctx_t *ctx, peer_t *peer) {
+  fec_encoder_t *enc;
+  if (peer->fec_tx)
+    return peer->fec_tx;
+  if (NULL == (enc = malloc(sizeof(fec_encoder_t))))
+    return NULL;
+  if (-1 == fec_encoder_init(enc, ctx->args->fec_data, ctx->args->fec_parity,
+                             ctx->args->mtu)) {
+    free(enc);
+    return NULL;
+  }
+  return peer->fec_tx = enc;
+}
+
+/*
+   send the parity of the current FEC group to peer, and start the next
+   group. return -1 on fatal error
+*/
+static int vpn_send_parity(vpn_ctx_t *ctx, peer_t *peer) {
+  size_t usertoken_len = ctx->usertoken_len;
+  fec_encoder_t *enc = peer->fec_tx;
+  sched_queue_t *queue = peer->queue;
+  unsigned char *frame = ctx->fec_buf + SHADOWVPN_ZERO_BYTES;
+  int j, r = 0;
+
+  timer_stop(&ctx->timer_wheel, &peer->fec_timer);
+  memcpy(frame, peer->token, usertoken_len);
+  for (j = 0; j < enc->m && r != -1 && *queue->addrlen; j++) {
+    size_t len = fec_parity(enc, j, frame + usertoken_len);
+    // spread over the paths, if there are several
+    r = vpn_send_to(ctx, queue, enc->group + j * PATH_SLOTS / enc->m, 0,
+                    ctx->fec_buf, usertoken_len + len, NULL);
+    if (r == 0)
+      METRICS_ADD(ctx->metrics.fec_parity_tx, 1);
+  }
+  fec_next_group(enc);
+  return r == -1 ? -1 : 0;
+}
+
+/* the group did not fill up in time, send parity for what it has */
+static void vpn_fec_timeout(tw_timer_t *timer, void *data) {
+  peer_t *peer = data;
+  // a fatal sendto error shows up again on the next packet
+  if (peer->fec_tx && peer->fec_tx->count)
+    vpn_send_parity(peer->data, peer);
+}
+
+/*
+   send a plaintext of flow to the peer of queue, as the next FEC data shard
+   if FEC is enabled. return the same as vpn_send
+*/
+static int vpn_send_peer(vpn_ctx_t *ctx, sched_queue_t *queue, uint32_t flow,
+                         uint8_t dscp, unsigned char *buf, size_t len,
+                         uint64_t *t) {
+  size_t usertoken_len = ctx->usertoken_len;
+  peer_t *peer = queue->peer;
+  fec_encoder_t *enc;
+  unsigned char *frame;
+  int r;
+
+  // the client may have been evicted while the packet was waiting
+  if (*queue->addrlen == 0)
+    return 1;
+  if (!ctx->args->fec_data || NULL == (enc = vpn_fec_encoder(ctx, peer))) {
+    return vpn_send_to(ctx, queue, flow, dscp, buf, len, t);
+  }
+  frame = ctx->fec_buf + SHADOWVPN_ZERO_BYTES;
+  memcpy(frame, buf + SHADOWVPN_ZERO_BYTES, usertoken_len);
+  len = usertoken_len + fec_encode(enc,
+                                   buf + SHADOWVPN_ZERO_BYTES + usertoken_len,
+                                   len - usertoken_len,
+                                   frame + usertoken_len);
+  r = vpn_send_to(ctx, queue, flow, dscp, ctx->fec_buf, len, t);
+  if (r == -1)
+    return -1;
+  if (enc->count == enc->k) {
+    if (-1 == vpn_send_parity(ctx, peer))
+      return -1;
+  } else if (enc->count == 1) {
+    timer_start(&ctx->timer_wheel, &peer->fec_timer,
+                ctx->args->fec_timeout);
+  }
+  return r;
+}
+
+/* pace datagrams to rate bytes per second, 0 to stop */
+static void vpn_set_pacing(vpn_ctx_t *ctx, uint64_t rate) {
+  int i;
+  pacer_set_rate(&ctx->pacer, rate, latency_now_ns());
+  STATS_SET(ctx->metrics.pacing_rate, rate);
+  for (i = 0; i < ctx->nsock; i++) {
+    if (-1 == ctx->io_ops->set_pacing(ctx, i, rate ? rate : ~0ULL))
+      err("setsockopt[SO_MAX_PACING_RATE]");
+  }
+}
+
+/*
+   pace to twice the rate packets came from tun lately, and fast enough
+   to drain what is queued, so that bursts are spread out without holding
+   back a rate that grows. the rate decays slowly while idle so that the
+   next burst is spread at about the rate the link took before
+*/
+static void vpn_pace_auto(tw_timer_t *timer, void *data) {
+  vpn_ctx_t *ctx = data;
+  uint64_t rx_bytes = STATS_LOAD(ctx->metrics.tun_rx_bytes);
+  uint64_t rate = (2 * (rx_bytes - ctx->pace_rx_bytes) +
+                   ctx->sched.queued_bytes) * 1000 / PACER_AUTO_INTERVAL;
+  uint64_t decayed = ctx->pacer.rate - ctx->pacer.rate / 8;
+
+  ctx->pace_rx_bytes = rx_bytes;
+  if (rate < decayed)
+    rate = decayed;
+  if (rate < PACER_AUTO_MIN_RATE)
+    rate = PACER_AUTO_MIN_RATE;
+  vpn_set_pacing(ctx, rate);
+  timer_start(&ctx->timer_wheel, timer, PACER_AUTO_INTERVAL);
+}
+
+/* return 1 if the pacer holds back what is queued for now */
+static int vpn_paced(vpn_ctx_t *ctx) {
+  uint64_t now, wait;
+  if (ctx->pacer.rate == 0 || ctx->sched.queued_bytes == 0)
+    return 0;
+  now = latency_now_ns();
+  if (0 == (wait = pacer_wait(&ctx->pacer, now)))
+    return 0;
+  METRICS_ADD(ctx->metrics.pacer_delays, 1);
+  ctx->pace_until = now + wait;
+  return 1;
+}
+
+/* send whatever the scheduler allows now, return -1 on fatal error */
+static int vpn_flush(vpn_ctx_t *ctx) {
+  sched_queue_t *queue;
+  sched_pkt_t *pkt;
+  uint32_t flow = 0;
+  int r = 0, bundled;
+
+  ctx->pace_until = 0;
+  while (r != -1 && !vpn_paced(ctx) &&
+         NULL != (pkt = sched_dequeue(&ctx->sched, ctx->now, &queue))) {
+    unsigned char *buf = pkt->buf;
+    size_t len = pkt->len;
+    uint64_t t = pkt->stamp;
+    if (t)
+      vpn_latency_mark(ctx, LATENCY_QUEUE, &t);
+    if (ctx->args->coalesce) {
+      size_t bundle_len = vpn_bundle(ctx, queue, pkt);
+      if (bundle_len) {
+        buf = ctx->frame_buf;
+        len = bundle_len;
+      }
+    }
+    if (ctx->args->compress) {
+      size_t compressed_len = vpn_compress(ctx, queue, pkt, buf, len);
+      if (compressed_len) {
+        buf = ctx->compress_buf;
+        len = compressed_len;
+      }
+    }
+    if (ctx->multipath.npaths) {
+      flow = multipath_flow(pkt->buf + SHADOWVPN_ZERO_BYTES +
+                            ctx->usertoken_len,
+                            pkt->len - ctx->usertoken_len);
+    }
+    // a bundle goes with the DSCP of its first packet, which is of the
+    // highest priority
+    r = vpn_send_peer(ctx, queue, flow, pkt->dscp, buf, len, t ? &t : NULL);
+    bundled = pkt->next != NULL;
+    if (r == 0 && bundled) {
+      METRICS_ADD(ctx->metrics.bundles_tx, 1);
+    }
+    while (pkt) {
+      sched_pkt_t *next = pkt->next;
+      if (r == 0) {
+        STATS_ADD(queue->stats->tx_packets, 1);
+        STATS_ADD(queue->stats->tx_bytes, pkt->len - ctx->usertoken_len);
+        if (bundled)
+          METRICS_ADD(ctx->metrics.bundled_packets, 1);
+      } else {
+        STATS_ADD(queue->stats->drops, 1);
+      }
+      sched_free(&ctx->sched, pkt);
+      pkt = next;
+    }
+  }
+  return r == -1 ? -1 : 0;
+}
+
+/*
+   with coalesce_delay, return 1 while the few small packets queued may
+   still wait for more to pack with
+*/
+static int vpn_hold(vpn_ctx_t *ctx, uint64_t now_ns) {
+  size_t queued = ctx->sched.queued_bytes;
+  if (!ctx->args->coalesce || !ctx->args->coalesce_delay || queued == 0 ||
+      queued > ctx->args->mtu / 2) {
+    ctx->hold_since = 0;
+    return 0;
+  }
+  if (!ctx->hold_since)
+    ctx->hold_since = now_ns;
+  if (now_ns - ctx->hold_since < (uint64_t)ctx->args->coalesce_delay * 1000)
+    return 1;
+  ctx->hold_since = 0;
+  return 0;
+}
+
+/*
+   NAT and write one IP packet to tun, buf is the user token followed by
+   the packet. t is the same as in vpn_send
+   return -1 on fatal error
+*/
+static int vpn_write_tun(vpn_ctx_t *ctx, unsigned char *buf, size_t len,
+                         uint64_t *t) {
+  size_t usertoken_len = ctx->usertoken_len;
+
+  if (capture_on(&ctx->capture)) {
+    capture_packet(&ctx->capture, CAPTURE_TUN, CAPTURE_IN,
+                   usertoken_len ? buf : NULL, buf + usertoken_len,
+                   len - usertoken_len);
+  }
+  if (ctx->args->mode == SHADOWVPN_MODE_SERVER) {
+    if (usertoken_len) {
+      // do NAT for upstream
+      if (-1 == nat_fix_upstream(ctx->nat_ctx, buf, len,
+                                 (struct sockaddr *)&ctx->rx_addr,
+                                 ctx->rx_addrlen)) {
+        METRICS_ADD(ctx->metrics.nat_misses, 1);
+        return 0;
+      }
+      if (t)
+        vpn_latency_mark(ctx, LATENCY_NAT_UP, t);
+    } else {
+      STATS_ADD(ctx->stats.rx_packets, 1);
+      STATS_ADD(ctx->stats.rx_bytes, len);
+    }
+  }
+  if (-1 == ctx->io_ops->write_tun(ctx, buf + usertoken_len,
+                                   len - usertoken_len)) {
+    if (t)
+      vpn_latency_mark(ctx, LATENCY_TUN_WRITE, t);
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      METRICS_ADD(ctx->metrics.eagain_drops, 1);
+    } else if (errno == EPERM || errno == EINTR || errno == EINVAL) {
+      // just log, do nothing
+      err("write to tun");
+    } else {
+      err("write to tun");
+      return -1;
+    }
+    return 0;
+  }
+  if (t)
+    vpn_latency_mark(ctx, LATENCY_TUN_WRITE, t);
+  METRICS_ADD(ctx->metrics.tun_tx_packets, 1);
+  METRICS_ADD(ctx->metrics.tun_tx_bytes, len - usertoken_len);
+  return 0;
+}
+
+static int vpn_receive_bundle(vpn_ctx_t *ctx, unsigned char *buf,
+                              size_t len, uint64_t *t) {
+  size_t usertoken_len = ctx->usertoken_len;
+  const unsigned char *pkt;
+  size_t pkt_len, offset = 0;
+  int r;
+
+  while (1 == (r = frame_bundle_next(buf + usertoken_len,
+                                     len - usertoken_len, &offset,
+                                     &pkt, &pkt_len))) {
+    unsigned char *inner = (unsigned char *)pkt;
+    if (!frame_is_ip(pkt)) {
+      METRICS_ADD(ctx->metrics.frame_errors, 1);
+      continue;
+    }
+    if (usertoken_len) {
+      // NAT wants the user token right before the packet
+      inner = ctx->frame_buf + SHADOWVPN_ZERO_BYTES;
+      memcpy(inner, buf, usertoken_len);
+      memcpy(inner + usertoken_len, pkt, pkt_len);
+    }
+    if (-1 == vpn_write_tun(ctx, inner, usertoken_len + pkt_len, t))
+      return -1;
+  }
+  if (r == -1) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    errf("dropping the rest of a malformed bundle");
+  }
+  return 0;
+}
+
+/* the peer a plaintext starting with buf came from, NULL if unknown */
+static peer_t *vpn_find_peer(vpn_ctx_t *ctx, const unsigned char *buf) {
+  client_info_t *client;
+  if (ctx->nat_ctx == NULL)
+    return &ctx->peer;
+  client = nat_find_client(ctx->nat_ctx, (const char *)buf);
+  return client ? &client->peer : NULL;
+}
+
+static fec_decoder_t *vpn_fec_decoder(vpn_ctx_t *ctx, peer_t *peer) {
+  fec_decoder_t *dec;
+  if (peer->fec_rx)
+    return peer->fec_rx;
+  if (NULL == (dec = malloc(sizeof(fec_decoder_t))))
+    return NULL;
+  // parity may come a while after the data it covers, allow for jitter
+  if (-1 == fec_decoder_init(dec, ctx->args->fec_data, ctx->args->fec_parity,
+                             ctx->args->mtu,
+                             (uint64_t)ctx->args->fec_timeout * 4 + 100)) {
+    free(dec);
+    return NULL;
+  }
+  return peer->fec_rx = dec;
+}
+
+static int vpn_receive(vpn_ctx_t *ctx, unsigned char *buf, size_t len,
+                       uint64_t *t);
+
+static int vpn_receive_compressed(vpn_ctx_t *ctx, unsigned char *buf,
+                                  size_t len, uint64_t *t) {
+  size_t usertoken_len = ctx->usertoken_len;
+  unsigned char *inner = ctx->compress_buf + SHADOWVPN_ZERO_BYTES;
+  ssize_t n;
+
+  n = decompress_frame(buf + usertoken_len, len - usertoken_len,
+                       inner + usertoken_len, ctx->args->mtu);
+  // only packets and bundles are compressed
+  if (n <= 0 || (!frame_is_ip(inner + usertoken_len) &&
+                 inner[usertoken_len] != FRAME_BUNDLE)) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    errf("dropping malformed compressed frame");
+    return 0;
+  }
+  memcpy(inner, buf, usertoken_len);
+  return vpn_receive(ctx, inner, usertoken_len + n, t);
+}
+
+static frag_rx_t *vpn_frag_rx(vpn_ctx_t *ctx, peer_t *peer) {
+  frag_rx_t *rx;
+  if (peer->frag_rx)
+    return peer->frag_rx;
+  if (NULL == (rx = malloc(sizeof(frag_rx_t))))
+    return NULL;
+  if (-1 == frag_rx_init(rx, ctx->args->mtu + FRAME_HEADROOM,
+                         ctx->usertoken_len)) {
+    free(rx);
+    return NULL;
+  }
+  return peer->frag_rx = rx;
+}
+
+/* drop the datagrams of a peer whose pieces did not all arrive in time */
+static void vpn_frag_timeout(tw_timer_t *timer, void *data) {
+  peer_t *peer = data;
+  vpn_ctx_t *ctx = peer->data;
+  uint64_t next;
+
+  METRICS_ADD(ctx->metrics.reassembly_drops,
+              frag_expire(peer->frag_rx, ctx->now, &next));
+  if (next)
+    timer_start(&ctx->timer_wheel, timer, next - ctx->now);
+}
+
+static int vpn_receive_fragment(vpn_ctx_t *ctx, unsigned char *buf,
+                                size_t len, uint64_t *t) {
+  size_t usertoken_len = ctx->usertoken_len;
+  peer_t *peer = vpn_find_peer(ctx, buf);
+  frag_rx_t *rx;
+  unsigned char *inner;
+  size_t inner_len;
+  int dropped = 0, r;
+
+  if (peer == NULL) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    return 0;
+  }
+  if (NULL == (rx = vpn_frag_rx(ctx, peer)))
+    return 0;
+  r = frag_add(rx, buf, buf + usertoken_len, len - usertoken_len, ctx->now,
+               &inner, &inner_len, &dropped);
+  METRICS_ADD(ctx->metrics.reassembly_drops, dropped);
+  if (r == -1) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    errf("dropping malformed fragment");
+    return 0;
+  }
+  if (r == 0) {
+    if (!timer_pending(&peer->frag_timer))
+      timer_start(&ctx->timer_wheel, &peer->frag_timer, FRAG_TIMEOUT);
+    return 0;
+  }
+  METRICS_ADD(ctx->metrics.reassembled, 1);
+  // pieces are never cut again
+  if (inner[usertoken_len] == FRAME_FRAGMENT) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    return 0;
+  }
+  return vpn_receive(ctx, inner, inner_len, t);
+}
+
+/* buf is the user token followed by a plaintext carried by a FEC frame */
+static int vpn_receive_shard(vpn_ctx_t *ctx, unsigned char *buf, size_t len,
+                             uint64_t *t) {
+  // FEC is never nested, and the decoder is busy
+  if (buf[ctx->usertoken_len] == FRAME_FEC) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    return 0;
+  }
+  return vpn_receive(ctx, buf, len, t);
+}
+
+static int vpn_receive_fec(vpn_ctx_t *ctx, unsigned char *buf, size_t len,
+                           uint64_t *t) {
+  size_t usertoken_len = ctx->usertoken_len;
+  peer_t *peer = vpn_find_peer(ctx, buf);
+  fec_decoder_t *dec;
+  const unsigned char *data;
+  size_t data_len;
+  int r;
+
+  if (!ctx->args->fec_data || peer == NULL) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    errf("dropping FEC frame, fec is not enabled or user is unknown");
+    return 0;
+  }
+  if (NULL == (dec = vpn_fec_decoder(ctx, peer)))
+    return 0;
+  r = fec_decode(dec, buf + usertoken_len, len - usertoken_len, ctx->now,
+                 &data, &data_len);
+  if (r == -1) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    errf("dropping malformed FEC frame");
+    return 0;
+  }
+  if (r == 1) {
+    // data is in place, move the user token right before it
+    unsigned char *inner = (unsigned char *)data - usertoken_len;
+    memmove(inner, buf, usertoken_len);
+    if (-1 == vpn_receive_shard(ctx, inner, usertoken_len + data_len, t))
+      return -1;
+  }
+  while (fec_next_recovered(dec, &data, &data_len)) {
+    unsigned char *inner = ctx->fec_buf + SHADOWVPN_ZERO_BYTES;
+    METRICS_ADD(ctx->metrics.fec_recovered, 1);
+    memcpy(inner, peer->token, usertoken_len);
+    memcpy(inner + usertoken_len, data, data_len);
+    if (-1 == vpn_receive_shard(ctx, inner, usertoken_len + data_len, NULL))
+      return -1;
+  }
+  return 0;
+}
+
+/*
+   send a FRAME_PING, id is the path it probes or FRAME_PING_PEER
+   return the same as vpn_send
+*/
+static int vpn_send_ping(vpn_ctx_t *ctx, int sock,
+                         const struct sockaddr *addr, socklen_t addrlen,
+                         const char *token, uint8_t id, uint32_t seq) {
+  size_t usertoken_len = ctx->usertoken_len;
+  unsigned char *frame = ctx->ctl_buf + SHADOWVPN_ZERO_BYTES;
+  uint64_t now = latency_now_ns() / 1000;
+
+  // only read back by us, in our own byte order
+  memcpy(frame, token, usertoken_len);
+  frame[usertoken_len] = FRAME_PING;
+  frame[usertoken_len + 1] = id;
+  memcpy(frame + usertoken_len + 2, &seq, 4);
+  memcpy(frame + usertoken_len + 6, &now, 8);
+  return vpn_send(ctx, sock, ctx->ctl_buf, usertoken_len + FRAME_PING_LEN,
+                  addr, addrlen, NULL);
+}
+
+static void vpn_probe_paths(tw_timer_t *timer, void *data) {
+  vpn_ctx_t *ctx = data;
+  int i;
+  for (i = 0; i < ctx->multipath.npaths; i++) {
+    path_t *path = &ctx->multipath.paths[i];
+    // a fatal sendto error shows up again on the next packet
+    vpn_send_ping(ctx, i, (struct sockaddr *)&path->addr, path->addrlen,
+                  ctx->peer.token, i, multipath_probe(&ctx->multipath, i));
+  }
+  timer_start(&ctx->timer_wheel, timer, ctx->args->path_probe_interval);
+}
+
+/* publish what the probes of peer found */
+static void vpn_peer_rtt_stats(peer_t *peer) {
+  client_stats_t *stats = peer->queue->stats;
+  STATS_SET(stats->rtt_us, peer->rtt.srtt);
+  STATS_SET(stats->jitter_us, peer->rtt.jitter);
+  STATS_SET(stats->loss_permille,
+            (uint64_t)peer->rtt.loss * 1000 / RTT_LOSS_ONE);
+}
+
+static void vpn_ping_peer(vpn_ctx_t *ctx, peer_t *peer) {
+  sched_queue_t *queue = peer->queue;
+  uint32_t seq;
+  if (*queue->addrlen == 0)
+    return;
+  seq = rtt_probe(&peer->rtt);
+  vpn_peer_rtt_stats(peer);
+  // a fatal sendto error shows up again on the next packet
+  vpn_send_ping(ctx, 0, (struct sockaddr *)queue->addr, *queue->addrlen,
+                peer->token, FRAME_PING_PEER, seq);
+}
+
+/* keep NAT mappings on the way open, and measure every peer */
+static void vpn_keepalive(tw_timer_t *timer, void *data) {
+  vpn_ctx_t *ctx = data;
+  client_info_t *client, *tmp;
+
+  if (ctx->nat_ctx) {
+    HASH_ITER(hh1, ctx->nat_ctx->token_to_clients, client, tmp) {
+      vpn_ping_peer(ctx, &client->peer);
+    }
+  } else {
+    vpn_ping_peer(ctx, &ctx->peer);
+  }
+  timer_start(&ctx->timer_wheel, timer, ctx->args->keepalive_interval);
+}
+
+/* a probe is as good as a packet to keep the user of buf connected */
+static void vpn_probe_seen(vpn_ctx_t *ctx, const unsigned char *buf) {
+  client_info_t *client;
+  if (ctx->nat_ctx &&
+      NULL != (client = nat_find_client(ctx->nat_ctx, (char *)buf)))
+    nat_client_seen(ctx->nat_ctx, client, (struct sockaddr *)&ctx->rx_addr,
+                    ctx->rx_addrlen);
+}
+
+/*
+   send the answer of len bytes in ctl_buf to a probe, back the way it
+   came. return -1 on fatal error
+*/
+static int vpn_answer_probe(vpn_ctx_t *ctx, size_t len) {
+  const struct sockaddr *addr = (struct sockaddr *)&ctx->rx_addr;
+  socklen_t addrlen = ctx->rx_addrlen;
+
+  if (ctx->multipath.npaths) {
+    path_t *path = &ctx->multipath.paths[ctx->rx_sock];
+    addr = (struct sockaddr *)&path->addr;
+    addrlen = path->addrlen;
+  }
+  if (-1 == vpn_send(ctx, ctx->rx_sock, ctx->ctl_buf, len, addr, addrlen,
+                     NULL))
+    return -1;
+  return 0;
+}
+
+/* answer a probe with the same content, return -1 on fatal error */
+static int vpn_receive_ping(vpn_ctx_t *ctx, unsigned char *buf, size_t len) {
+  size_t usertoken_len = ctx->usertoken_len;
+  unsigned char *frame = ctx->ctl_buf + SHADOWVPN_ZERO_BYTES;
+
+  if (len != usertoken_len + FRAME_PING_LEN) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    return 0;
+  }
+  memcpy(frame, buf, len);
+  frame[usertoken_len] = FRAME_PONG;
+  vpn_probe_seen(ctx, buf);
+  return vpn_answer_probe(ctx, len);
+}
+
+static void vpn_receive_pong(vpn_ctx_t *ctx, unsigned char *buf,
+                             size_t len) {
+  unsigned char *frame = buf + ctx->usertoken_len;
+  peer_t *peer;
+  uint32_t seq;
+  uint64_t sent, rtt;
+
+  if (len != ctx->usertoken_len + FRAME_PING_LEN) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    return;
+  }
+  memcpy(&seq, frame + 2, 4);
+  memcpy(&sent, frame + 6, 8);
+  rtt = latency_now_ns() / 1000 - sent;
+  if (frame[1] == FRAME_PING_PEER) {
+    if (NULL != (peer = vpn_find_peer(ctx, buf)) &&
+        rtt_answer(&peer->rtt, seq, rtt))
+      vpn_peer_rtt_stats(peer);
+  } else if (frame[1] < ctx->multipath.npaths) {
+    multipath_answer(&ctx->multipath, frame[1], seq, rtt);
+  } else {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+  }
+}
+
+/* pmtu.mtu of peer changed */
+static void vpn_pmtu_changed(vpn_ctx_t *ctx, peer_t *peer) {
+  client_info_t *client, *tmp;
+  uint32_t mtu = peer->pmtu.mtu;
+
+  STATS_SET(peer->queue->stats->mtu, mtu);
+  if (ctx->nat_ctx) {
+    logf("path MTU to user %016llx is now %u",
+         (unsigned long long)htobe64(*((uint64_t *)peer->token)), mtu);
+    HASH_ITER(hh1, ctx->nat_ctx->token_to_clients, client, tmp) {
+      if (client->peer.pmtu.mtu < mtu)
+        mtu = client->peer.pmtu.mtu;
+    }
+  } else {
+    logf("path MTU is now %u", mtu);
+  }
+  ctx->pmtu_min = mtu;
+}
+
+/* send the next path MTU probe to peer, if it is time, see pmtu.h */
+static void vpn_probe_mtu(vpn_ctx_t *ctx, peer_t *peer) {
+  size_t usertoken_len = ctx->usertoken_len;
+  unsigned char *frame = ctx->frame_buf + SHADOWVPN_ZERO_BYTES;
+  sched_queue_t *queue = peer->queue;
+  uint32_t mtu = peer->pmtu.mtu, size, seq;
+  size_t len;
+  int i, r = 0, sent = 0;
+
+  if (*queue->addrlen == 0)
+    return;
+  if (0 != (size = pmtu_probe(&peer->pmtu, ctx->now, &seq))) {
+    // as long as the largest datagram a plaintext of size makes
+    len = size + vpn_frame_overhead(ctx);
+    memcpy(frame, peer->token, usertoken_len);
+    bzero(frame + usertoken_len, len);
+    frame[usertoken_len] = FRAME_PMTU_PROBE;
+    memcpy(frame + usertoken_len + 1, &seq, 4);
+    len += usertoken_len;
+    // a fatal sendto error shows up again on the next packet
+    if (ctx->multipath.npaths) {
+      // it has to fit every path a flow may take
+      for (i = 0; i < ctx->multipath.npaths; i++) {
+        path_t *path = &ctx->multipath.paths[i];
+        if (!path->up)
+          continue;
+        r = vpn_send(ctx, i, ctx->frame_buf, len,
+                     (struct sockaddr *)&path->addr, path->addrlen, NULL);
+        if (r == 1 && errno == EMSGSIZE)
+          break;
+        sent += r == 0;
+      }
+    } else {
+      r = vpn_send(ctx, 0, ctx->frame_buf, len, (struct sockaddr *)queue->addr,
+                   *queue->addrlen, NULL);
+      sent += r == 0;
+    }
+    METRICS_ADD(ctx->metrics.pmtu_probes_tx, sent);
+    peer->pmtu.answers = sent;
+    // too big for the interface already
+    if (r == 1 && errno == EMSGSIZE)
+      pmtu_fail(&peer->pmtu);
+  }
+  if (peer->pmtu.mtu != mtu)
+    vpn_pmtu_changed(ctx, peer);
+}
+
+static void vpn_probe_mtus(tw_timer_t *timer, void *data) {
+  vpn_ctx_t *ctx = data;
+  client_info_t *client, *tmp;
+
+  if (ctx->nat_ctx) {
+    HASH_ITER(hh1, ctx->nat_ctx->token_to_clients, client, tmp) {
+      vpn_probe_mtu(ctx, &client->peer);
+    }
+  } else {
+    vpn_probe_mtu(ctx, &ctx->peer);
+  }
+  timer_start(&ctx->timer_wheel, timer, PMTU_PROBE_INTERVAL);
+}
+
+/* tell the prober how long its probe was, return -1 on fatal error */
+static int vpn_receive_pmtu_probe(vpn_ctx_t *ctx, unsigned char *buf,
+                                  size_t len) {
+  size_t usertoken_len = ctx->usertoken_len;
+  unsigned char *frame = ctx->ctl_buf + SHADOWVPN_ZERO_BYTES;
+  size_t probe_len = len - usertoken_len;
+
+  if (probe_len < FRAME_PMTU_PROBE_MIN_LEN) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    return 0;
+  }
+  memcpy(frame, buf, usertoken_len + FRAME_PMTU_PROBE_MIN_LEN);
+  frame[usertoken_len] = FRAME_PMTU_ACK;
+  frame[usertoken_len + 5] = probe_len >> 8;
+  frame[usertoken_len + 6] = probe_len;
+  vpn_probe_seen(ctx, buf);
+  return vpn_answer_probe(ctx, usertoken_len + FRAME_PMTU_ACK_LEN);
+}
+
+static void vpn_receive_pmtu_ack(vpn_ctx_t *ctx, unsigned char *buf,
+                                 size_t len) {
+  unsigned char *frame = buf + ctx->usertoken_len;
+  size_t overhead = vpn_frame_overhead(ctx);
+  peer_t *peer;
+  uint32_t seq, size, mtu;
+
+  if (len != ctx->usertoken_len + FRAME_PMTU_ACK_LEN ||
+      NULL == (peer = vpn_find_peer(ctx, buf))) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    return;
+  }
+  memcpy(&seq, frame + 1, 4);
+  size = (frame[5] << 8) | frame[6];
+  if (size < overhead)
+    return;
+  mtu = peer->pmtu.mtu;
+  pmtu_answer(&peer->pmtu, seq, size - overhead);
+  if (peer->pmtu.mtu != mtu)
+    vpn_pmtu_changed(ctx, peer);
+}
+
+/* tell the server where we are with the announce in ctx->peer.roam */
+static void vpn_send_announce(vpn_ctx_t *ctx) {
+  size_t usertoken_len = ctx->usertoken_len;
+  unsigned char *frame = ctx->ctl_buf + SHADOWVPN_ZERO_BYTES;
+  roam_t *roam = &ctx->peer.roam;
+  uint64_t seq = htobe64(roam->seq);
+
+  memcpy(frame, ctx->peer.token, usertoken_len);
+  frame[usertoken_len] = FRAME_ANNOUNCE;
+  memcpy(frame + usertoken_len + 1, &seq, 8);
+  METRICS_ADD(ctx->metrics.roam_announces_tx, 1);
+  // a fatal sendto error shows up again on the next packet
+  vpn_send(ctx, 0, ctx->ctl_buf, usertoken_len + FRAME_ANNOUNCE_LEN,
+           ctx->remote_addrp, ctx->remote_addrlen, NULL);
+  timer_start(&ctx->timer_wheel, &ctx->roam_timer,
+              roam->retries < ROAM_MAX_RETRIES ? ROAM_RETRY_INTERVAL :
+                                                 ROAM_REFRESH_INTERVAL);
+}
+
+/*
+   resend an announce that was not answered, or make a new one, in case a
+   NAT on the way moved us without us knowing
+*/
+static void vpn_roam_timeout(tw_timer_t *timer, void *data) {
+  vpn_ctx_t *ctx = data;
+  roam_t *roam = &ctx->peer.roam;
+
+  if (roam->acked || roam->retries >= ROAM_MAX_RETRIES)
+    roam_announce(roam);
+  else
+    roam->retries++;
+  vpn_send_announce(ctx);
+}
+
+/* a local address or route changed, we may be somewhere else now */
+static void vpn_addr_changed(vpn_ctx_t *ctx) {
+  logf("local address changed, announcing it");
+  STATS_ADD(ctx->stats.roams, 1);
+  roam_announce(&ctx->peer.roam);
+  vpn_send_announce(ctx);
+}
+
+/*
+   the client is where the announce came from if it is its newest one,
+   answer with the newest one we know of. return -1 on fatal error
+*/
+static int vpn_receive_announce(vpn_ctx_t *ctx, unsigned char *buf,
+                                size_t len) {
+  size_t usertoken_len = ctx->usertoken_len;
+  unsigned char *frame = ctx->ctl_buf + SHADOWVPN_ZERO_BYTES;
+  struct sockaddr_storage *cur = &ctx->remote_addr;
+  socklen_t *cur_len = &ctx->remote_addrlen;
+  client_info_t *client = NULL;
+  peer_t *peer;
+  uint64_t seq;
+  int moved = 0;
+
+  if (len != usertoken_len + FRAME_ANNOUNCE_LEN ||
+      ctx->args->mode != SHADOWVPN_MODE_SERVER ||
+      NULL == (peer = vpn_find_peer(ctx, buf))) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    return 0;
+  }
+  memcpy(&seq, buf + usertoken_len + 1, 8);
+  if (ctx->nat_ctx) {
+    // the peer was found, so is the user
+    client = nat_find_client(ctx->nat_ctx, (char *)buf);
+  }
+  // an old announce replayed or late must not move the client back
+  if (roam_accept(&peer->roam, be64toh(seq))) {
+    if (client) {
+      moved = nat_client_seen(ctx->nat_ctx, client,
+                              (struct sockaddr *)&ctx->rx_addr,
+                              ctx->rx_addrlen);
+    } else if (roam_follow(cur, cur_len, (struct sockaddr *)&ctx->rx_addr,
+                           ctx->rx_addrlen)) {
+      STATS_ADD(peer->queue->stats->roams, 1);
+      moved = 1;
+    }
+  }
+  if (moved) {
+    if (client) {
+      logf("user %016llx roamed",
+           (unsigned long long)htobe64(*((uint64_t *)client->user_token)));
+    } else {
+      logf("client roamed");
+    }
+  }
+
+  memcpy(frame, buf, usertoken_len + 1);
+  frame[usertoken_len] = FRAME_ANNOUNCE_ACK;
+  seq = htobe64(peer->roam.seq);
+  memcpy(frame + usertoken_len + 1, &seq, 8);
+  return vpn_answer_probe(ctx, usertoken_len + FRAME_ANNOUNCE_LEN);
+}
+
+static void vpn_receive_announce_ack(vpn_ctx_t *ctx, unsigned char *buf,
+                                     size_t len) {
+  uint64_t seq;
+
+  if (len != ctx->usertoken_len + FRAME_ANNOUNCE_LEN ||
+      ctx->args->mode != SHADOWVPN_MODE_CLIENT) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    return;
+  }
+  memcpy(&seq, buf + ctx->usertoken_len + 1, 8);
+  if (roam_ack(&ctx->peer.roam, be64toh(seq))) {
+    roam_announce(&ctx->peer.roam);
+    vpn_send_announce(ctx);
+  } else if (ctx->peer.roam.acked) {
+    timer_start(&ctx->timer_wheel, &ctx->roam_timer, ROAM_REFRESH_INTERVAL);
+  }
+}
+
+/*
+   handle the plaintext of a datagram, buf is the user token followed by
+   an IP packet or a frame, see frame.h
+   return -1 on fatal error
+*/
+static int vpn_receive(vpn_ctx_t *ctx, unsigned char *buf, size_t len,
+                       uint64_t *t) {
+  unsigned char *payload = buf + ctx->usertoken_len;
+
+  if (len <= ctx->usertoken_len) {
+    METRICS_ADD(ctx->metrics.frame_errors, 1);
+    return 0;
+  }
+  if (frame_is_ip(payload))
+    return vpn_write_tun(ctx, buf, len, t);
+  switch (payload[0]) {
+    case FRAME_BUNDLE:
+      return vpn_receive_bundle(ctx, buf, len, t);
+    case FRAME_FEC:
+      return vpn_receive_fec(ctx, buf, len, t);
+    case FRAME_COMPRESSED:
+      return vpn_receive_compressed(ctx, buf, len, t);
+    case FRAME_PING:
+      return vpn_receive_ping(ctx, buf, len);
+    case FRAME_PONG:
+      vpn_receive_pong(ctx, buf, len);
+      return 0;
+    case FRAME_PMTU_PROBE:
+      return vpn_receive_pmtu_probe(ctx, buf, len);
+    case FRAME_PMTU_ACK:
+      vpn_receive_pmtu_ack(ctx, buf, len);
+      return 0;
+    case FRAME_ANNOUNCE:
+      return vpn_receive_announce(ctx, buf, len);
+    case FRAME_ANNOUNCE_ACK:
+      vpn_receive_announce_ack(ctx, buf, len);
+      return 0;
+    case FRAME_FRAGMENT:
+      return vpn_receive_fragment(ctx, buf, len, t);
+  }
+  METRICS_ADD(ctx->metrics.frame_errors, 1);
+  errf("dropping frame of unknown type %d", payload[0]);
+  return 0;
+}
+
+static void vpn_dump_latency(vpn_ctx_t *ctx, FILE *out) {
+  latency_hist_t hist;
+  int i;
+  if (!ctx->latency.every)
+    return;
+  for (i = 0; i < LATENCY_STAGES; i++) {
+    latency_read(&ctx->latency.hists[i], &hist);
+    fprintf(out, "latency stage=%s count=%llu p50=%lluns p99=%lluns "
+            "p999=%lluns max=%lluns\n", latency_stage_name(i),
+            (unsigned long long)hist.count,
+            (unsigned long long)latency_quantile(&hist, 0.5),
+            (unsigned long long)latency_quantile(&hist, 0.99),
+            (unsigned long long)latency_quantile(&hist, 0.999),
+            (unsigned long long)hist.max_ns);
+  }
+}
+
+void vpn_dump_stats(vpn_ctx_t *ctx, FILE *out) {
+  client_stats_t stats;
+  int i;
+  if (ctx->nat_ctx) {
+    nat_dump_stats(ctx->nat_ctx, out);
+  } else {
+    stats_read(&ctx->stats, &stats);
+    fprintf(out, "connected=%d rx_packets=%llu rx_bytes=%llu tx_packets=%llu "
+            "tx_bytes=%llu drops=%llu rtt=%lluus jitter=%lluus "
+            "loss=%.1f%% mtu=%llu roams=%llu\n", ctx->remote_addrlen != 0,
+            (unsigned long long)stats.rx_packets,
+            (unsigned long long)stats.rx_bytes,
+            (unsigned long long)stats.tx_packets,
+            (unsigned long long)stats.tx_bytes,
+            (unsigned long long)stats.drops,
+            (unsigned long long)stats.rtt_us,
+            (unsigned long long)stats.jitter_us,
+            stats.loss_permille / 10.0,
+            (unsigned long long)stats.mtu,
+            (unsigned long long)stats.roams);
+  }
+  for (i = 0; i < ctx->multipath.npaths; i++) {
+    path_t *path = &ctx->multipath.paths[i];
+    fprintf(out, "path=%d up=%d rtt=%lluus jitter=%lluus loss=%.1f%% "
+            "weight=%d slots=%d\n", i, path->up,
+            (unsigned long long)path->rtt.srtt,
+            (unsigned long long)path->rtt.jitter,
+            100.0 * path->rtt.loss / RTT_LOSS_ONE, path->weight,
+            path->slots);
+  }
+  if (ctx->multipath.npaths) {
+    fprintf(out, "path_failovers=%llu\n",
+            (unsigned long long)ctx->multipath.failovers);
+  }
+  if (ctx->pacer.rate) {
+    fprintf(out, "pacing_rate=%llukbit/s\n",
+            (unsigned long long)ctx->pacer.rate / 125);
+  }
+  vpn_dump_latency(ctx, out);
+  fflush(out);
+}
+
+static int vpn_sched_init(vpn_ctx_t *ctx) {
+  shadowvpn_args_t *args = ctx->args;
+  size_t pkt_size = SHADOWVPN_ZERO_BYTES + ctx->usertoken_len + args->mtu;
+  // what the path takes until path MTU discovery finds otherwise
+  uint32_t mtu = args->fragment && args->fragment < args->mtu ?
+                 args->fragment : args->mtu;
+  int npkts = SCHED_QUEUE_LIMIT;
+  client_info_t *client, *tmp;
+
+  if (ctx->nat_ctx) {
+    npkts = SCHED_QUEUE_LIMIT * (args->user_tokens_len + 1);
+    if (npkts > SCHED_POOL_LIMIT)
+      npkts = SCHED_POOL_LIMIT;
+  }
+  if (-1 == sched_init(&ctx->sched, pkt_size, npkts, &ctx->timer_wheel)) {
+    return -1;
+  }
+  // rate limit is for users, so not for client
+  sched_queue_init(&ctx->sched, &ctx->queue,
+                   args->mode == SHADOWVPN_MODE_SERVER ?
+                   (uint64_t)args->user_rate * 125 : 0,
+                   &ctx->remote_addr, &ctx->remote_addrlen, &ctx->stats);
+  peer_init(&ctx->peer, &ctx->queue,
+            ctx->usertoken_len ? args->user_tokens[0] : NULL, mtu,
+            vpn_fec_timeout, vpn_frag_timeout, ctx);
+  ctx->queue.peer = &ctx->peer;
+  STATS_SET(ctx->stats.mtu, mtu);
+  ctx->pmtu_min = mtu;
+  if (ctx->nat_ctx) {
+    HASH_ITER(hh1, ctx->nat_ctx->token_to_clients, client, tmp) {
+      uint32_t rate = args->user_rates[client->id];
+      if (rate == 0)
+        rate = args->user_rate;
+      sched_queue_init(&ctx->sched, &client->queue, (uint64_t)rate * 125,
+                       &client->source_addr.addr,
+                       &client->source_addr.addrlen, &client->stats);
+      peer_init(&client->peer, &client->queue, client->user_token,
+                mtu, vpn_fec_timeout, vpn_frag_timeout, ctx);
+      client->queue.peer = &client->peer;
+      STATS_SET(client->stats.mtu, mtu);
+    }
+  }
   return 0;
 }
 
@@ -409,7 +2080,7 @@ int vpn_run(vpn_ctx_t *ctx) {
   fd_set readset;
   int max_fd = 0, i;
   ssize_t r;
-  size_t usertoken_len = 0;
+  size_t usertoken_len = 0, buf_len;
   if (ctx->running) {
     errf("can not start, already running");
     return -1;
@@ -422,19 +2093,103 @@ int vpn_run(vpn_ctx_t *ctx) {
   if (ctx->args->user_tokens_len) {
     usertoken_len = SHADOWVPN_USERTOKEN_LEN;
   }
-
-  ctx->tun_buf = malloc(ctx->args->mtu + SHADOWVPN_ZERO_BYTES +
-                        usertoken_len);
-  ctx->udp_buf = malloc(ctx->args->mtu + SHADOWVPN_ZERO_BYTES +
-                        usertoken_len);
+  ctx->usertoken_len = usertoken_len;
+
+  buf_len = ctx->args->mtu + FRAME_HEADROOM + SHADOWVPN_ZERO_BYTES +
+            usertoken_len;
+  ctx->tun_buf = malloc(buf_len);
+  ctx->udp_buf = malloc(buf_len);
+  ctx->frame_buf = malloc(buf_len);
+  ctx->fec_buf = malloc(buf_len);
+  ctx->compress_buf = malloc(buf_len);
+  ctx->frag_buf = malloc(buf_len);
+  if (NULL == ctx->tun_buf || NULL == ctx->udp_buf ||
+      NULL == ctx->frame_buf || NULL == ctx->fec_buf ||
+      NULL == ctx->compress_buf || NULL == ctx->frag_buf) {
+    err("malloc");
+    free(ctx->tun_buf);
+    free(ctx->udp_buf);
+    free(ctx->frame_buf);
+    free(ctx->fec_buf);
+    free(ctx->compress_buf);
+    free(ctx->frag_buf);
+    ctx->tun_buf = ctx->udp_buf = ctx->frame_buf = NULL;
+    ctx->fec_buf = ctx->compress_buf = ctx->frag_buf = NULL;
+    return -1;
+  }
   bzero(ctx->tun_buf, SHADOWVPN_ZERO_BYTES);
   bzero(ctx->udp_buf, SHADOWVPN_ZERO_BYTES);
+  bzero(ctx->frame_buf, SHADOWVPN_ZERO_BYTES);
+  bzero(ctx->fec_buf, SHADOWVPN_ZERO_BYTES);
+  bzero(ctx->compress_buf, SHADOWVPN_ZERO_BYTES);
+  bzero(ctx->frag_buf, SHADOWVPN_ZERO_BYTES);
   
+  ctx->now = timer_now_ms();
+  timer_wheel_init(&ctx->timer_wheel, ctx->now);
+  latency_init(&ctx->latency, ctx->args->latency_sample);
+  capture_init(&ctx->capture, ctx->args->capture_slots,
+               ctx->args->capture_snaplen);
+  timer_init(&ctx->idle_timer, vpn_remote_idle, ctx);
+
   if (ctx->args->mode == SHADOWVPN_MODE_SERVER && usertoken_len) {
-    ctx->nat_ctx = malloc(sizeof(nat_ctx_t));
-    nat_init(ctx->nat_ctx, ctx->args);
+    if (NULL == (ctx->nat_ctx = malloc(sizeof(nat_ctx_t)))) {
+      err("malloc");
+      return -1;
+    }
+    if (-1 == nat_init(ctx->nat_ctx, ctx->args)) {
+      free(ctx->nat_ctx);
+      ctx->nat_ctx = NULL;
+      return -1;
+    }
+    ctx->nat_ctx->timer_wheel = &ctx->timer_wheel;
+  }
+  if (-1 == vpn_sched_init(ctx)) {
+    return -1;
+  }
+  if (ctx->multipath.npaths) {
+    timer_init(&ctx->probe_timer, vpn_probe_paths, ctx);
+    vpn_probe_paths(&ctx->probe_timer, ctx);
+  }
+  if (ctx->args->pacing_auto) {
+    timer_init(&ctx->pace_timer, vpn_pace_auto, ctx);
+    timer_start(&ctx->timer_wheel, &ctx->pace_timer, PACER_AUTO_INTERVAL);
+  } else if (ctx->args->pacing_rate) {
+    vpn_set_pacing(ctx, (uint64_t)ctx->args->pacing_rate * 125);
+  }
+  if (ctx->args->pmtud) {
+    timer_init(&ctx->pmtu_timer, vpn_probe_mtus, ctx);
+    vpn_probe_mtus(&ctx->pmtu_timer, ctx);
+  }
+  // with paths, each of them goes somewhere else, and the server follows
+  // wherever packets come from
+  if (ctx->args->mode == SHADOWVPN_MODE_CLIENT && ctx->args->roaming &&
+      !ctx->multipath.npaths) {
+    timer_init(&ctx->roam_timer, vpn_roam_timeout, ctx);
+    roam_announce(&ctx->peer.roam);
+    vpn_send_announce(ctx);
+  }
+  // with paths, probing them keeps them open
+  if (ctx->args->keepalive_interval && !ctx->multipath.npaths) {
+    timer_init(&ctx->keepalive_timer, vpn_keepalive, ctx);
+    timer_start(&ctx->timer_wheel, &ctx->keepalive_timer,
+                ctx->args->keepalive_interval);
+  }
+  if (ctx->args->metrics) {
+    if (-1 == metrics_server_start(&ctx->metrics_server, ctx->args->metrics,
+                                   ctx)) {
+      errf("failed to start metrics server");
+      return -1;
+    }
   }
 
+#ifndef TARGET_WIN32
+  // so that we can read packets from tun in batches
+  int flags = fcntl(ctx->tun, F_GETFL, 0);
+  if (flags == -1 || -1 == fcntl(ctx->tun, F_SETFL, flags | O_NONBLOCK)) {
+    err("fcntl");
+  }
+#endif
+
   logf("VPN started");
 
   while (ctx->running) {
@@ -451,91 +2206,100 @@ int vpn_run(vpn_ctx_t *ctx) {
       FD_SET(ctx->socks[i], &readset);
       max_fd = max(max_fd, ctx->socks[i]);
     }
+    if (ctx->addr_fd != -1) {
+      FD_SET(ctx->addr_fd, &readset);
+      max_fd = max(max_fd, ctx->addr_fd);
+    }
 
     // we assume that pipe fd is always less than tun and sock fd which are
     // created later
     max_fd = max(ctx->tun, max_fd) + 1;
 
-    if (-1 == select(max_fd, &readset, NULL, NULL, NULL)) {
+    struct timeval timeout, *timeoutp = NULL;
+    int64_t timeout_ms = timer_wheel_timeout(&ctx->timer_wheel,
+                                             timer_now_ms());
+    // -1 means no timeout
+    int64_t wait_us = timeout_ms >= 0 ? timeout_ms * 1000 : -1;
+    uint64_t now_ns = latency_now_ns();
+    if (ctx->hold_since) {
+      // wake up in time to send what is held back for coalescing
+      uint64_t held = now_ns - ctx->hold_since;
+      uint64_t delay = (uint64_t)ctx->args->coalesce_delay * 1000;
+      int64_t hold_us = held < delay ? (delay - held) / 1000 : 0;
+      if (wait_us < 0 || wait_us > hold_us)
+        wait_us = hold_us;
+    }
+    if (ctx->pace_until) {
+      // and what the pacer holds back
+      int64_t pace_us = ctx->pace_until > now_ns ?
+                        (ctx->pace_until - now_ns + 999) / 1000 : 0;
+      if (wait_us < 0 || wait_us > pace_us)
+        wait_us = pace_us;
+    }
+    if (wait_us >= 0) {
+      timeout.tv_sec = wait_us / 1000000;
+      timeout.tv_usec = wait_us % 1000000;
+      timeoutp = &timeout;
+    }
+
+    if (-1 == select(max_fd, &readset, NULL, NULL, timeoutp)) {
       if (errno == EINTR)
         continue;
       err("select");
       break;
     }
+
+    METRICS_ADD(ctx->metrics.select_wakeups, 1);
+    ctx->now = timer_now_ms();
+    if (ctx->nat_ctx) {
+      ctx->nat_ctx->now = ctx->now;
+    }
+    timer_wheel_advance(&ctx->timer_wheel, ctx->now);
+
 #ifndef TARGET_WIN32
     if (FD_ISSET(ctx->control_pipe[0], &readset)) {
-      char pipe_buf;
+      char pipe_buf = VPN_CONTROL_STOP;
       (void)read(ctx->control_pipe[0], &pipe_buf, 1);
-      break;
+      if (pipe_buf == VPN_CONTROL_STATS) {
+        vpn_dump_stats(ctx, stdout);
+      } else {
+        break;
+      }
     }
 #else
     if (FD_ISSET(ctx->control_fd, &readset)) {
-      char buf;
+      char buf = VPN_CONTROL_STOP;
       recv(ctx->control_fd, &buf, 1, 0);
-      break;
+      if (buf == VPN_CONTROL_STATS) {
+        vpn_dump_stats(ctx, stdout);
+      } else {
+        break;
+      }
     }
 #endif
+    if (ctx->addr_fd != -1 && FD_ISSET(ctx->addr_fd, &readset) &&
+        ctx->io_ops->addr_changed(ctx)) {
+      vpn_addr_changed(ctx);
+    }
     if (FD_ISSET(ctx->tun, &readset)) {
-      r = tun_read(ctx->tun,
-                   ctx->tun_buf + SHADOWVPN_ZERO_BYTES + usertoken_len,
-                   ctx->args->mtu);
-      if (r == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          // do nothing
-        } else if (errno == EPERM || errno == EINTR) {
-          // just log, do nothing
-          err("read from tun");
-        } else {
-          err("read from tun");
-          break;
-        }
-      }
-      if (usertoken_len) {
-        if (ctx->args->mode == SHADOWVPN_MODE_CLIENT) {
-          memcpy(ctx->tun_buf + SHADOWVPN_ZERO_BYTES,
-                 ctx->args->user_tokens[0], usertoken_len);
-        } else {
-          // do NAT for downstream
-          nat_fix_downstream(ctx->nat_ctx,
-                             ctx->tun_buf + SHADOWVPN_ZERO_BYTES,
-                             r + usertoken_len,
-                             ctx->remote_addrp, &ctx->remote_addrlen);
-        }
-      }
-      if (ctx->remote_addrlen) {
-        crypto_encrypt(ctx->udp_buf, ctx->tun_buf, r + usertoken_len);
-
-        // TODO concurrency is currently removed
-        int sock_to_send = ctx->socks[0];
-
-        r = sendto(sock_to_send, ctx->udp_buf + SHADOWVPN_PACKET_OFFSET,
-                   SHADOWVPN_OVERHEAD_LEN + usertoken_len + r, 0,
-                   ctx->remote_addrp, ctx->remote_addrlen);
-        if (r == -1) {
-          if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            // do nothing
-          } else if (errno == ENETUNREACH || errno == ENETDOWN ||
-                     errno == EPERM || errno == EINTR || errno == EMSGSIZE) {
-            // just log, do nothing
-            err("sendto");
-          } else {
-            err("sendto");
-            // TODO rebuild socket
-            break;
-          }
-        }
-      }
+      if (-1 == vpn_read_tun(ctx))
+        break;
     }
     for (i = 0; i < ctx->nsock; i++) {
       int sock = ctx->socks[i];
       if (FD_ISSET(sock, &readset)) {
-        // only change remote addr if decryption succeeds
-        struct sockaddr_storage temp_remote_addr;
-        socklen_t temp_remote_addrlen = sizeof(temp_remote_addr);
-        r = recvfrom(sock, ctx->udp_buf + SHADOWVPN_PACKET_OFFSET,
-                    SHADOWVPN_OVERHEAD_LEN + usertoken_len + ctx->args->mtu, 0,
-                    (struct sockaddr *)&temp_remote_addr,
-                    &temp_remote_addrlen);
+        int sampled = latency_sample(&ctx->latency,
+                                     &ctx->latency.countdown_up);
+        uint64_t t = 0;
+        if (sampled)
+          t = latency_now_ns();
+        ctx->rx_addrlen = sizeof(ctx->rx_addr);
+        r = ctx->io_ops->recv_udp(ctx, i,
+                                  ctx->udp_buf + SHADOWVPN_PACKET_OFFSET,
+                                  SHADOWVPN_OVERHEAD_LEN + usertoken_len +
+                                  ctx->args->mtu + FRAME_HEADROOM,
+                                  (struct sockaddr *)&ctx->rx_addr,
+                                  &ctx->rx_addrlen);
         if (r == -1) {
           if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // do nothing
@@ -549,56 +2313,85 @@ int vpn_run(vpn_ctx_t *ctx) {
             break;
           }
         }
-        if (r == 0)
+        if (r <= 0) {
+          // sample the next packet instead
+          if (sampled)
+            ctx->latency.countdown_up = 1;
           continue;
-
-        if (-1 == crypto_decrypt(ctx->tun_buf, ctx->udp_buf,
-                                r - SHADOWVPN_OVERHEAD_LEN)) {
+        }
+        if (sampled)
+          vpn_latency_mark(ctx, LATENCY_RECVFROM, &t);
+        METRICS_ADD(ctx->metrics.udp_rx_packets, 1);
+        METRICS_ADD(ctx->metrics.udp_rx_bytes, r);
+
+        int decrypted = crypto_decrypt(ctx->tun_buf, ctx->udp_buf,
+                                       r - SHADOWVPN_OVERHEAD_LEN);
+        if (sampled)
+          vpn_latency_mark(ctx, LATENCY_DECRYPT, &t);
+        if (capture_on(&ctx->capture)) {
+          // the user is only known once decrypted
+          unsigned char *user = decrypted == 0 && usertoken_len ?
+                                ctx->tun_buf + SHADOWVPN_ZERO_BYTES : NULL;
+          capture_packet(&ctx->capture, CAPTURE_UDP, CAPTURE_IN, user,
+                         ctx->udp_buf + SHADOWVPN_PACKET_OFFSET, r);
+        }
+        if (-1 == decrypted) {
+          METRICS_ADD(ctx->metrics.decrypt_failures, 1);
           errf("dropping invalid packet, maybe wrong password");
         } else {
-          if (ctx->args->mode == SHADOWVPN_MODE_SERVER) {
-            // if we are running a server, update server address from
-            // recv_from
-            memcpy(ctx->remote_addrp, &temp_remote_addr, temp_remote_addrlen);
-            ctx->remote_addrlen = temp_remote_addrlen;
-          }
-          if (usertoken_len) {
-            if (ctx->args->mode == SHADOWVPN_MODE_SERVER) {
-              // do NAT for upstream
-              if (-1 == nat_fix_upstream(ctx->nat_ctx,
-                                         ctx->tun_buf + SHADOWVPN_ZERO_BYTES,
-                                         r - SHADOWVPN_OVERHEAD_LEN,
-                                         ctx->remote_addrp, ctx->remote_addrlen)) {
-                continue;
+          // only change remote addr if decryption succeeds, with NAT
+          // the address of each user is changed by nat_client_seen()
+          if (ctx->args->mode == SHADOWVPN_MODE_SERVER && !usertoken_len) {
+            if (ctx->args->idle_timeout) {
+              if (ctx->remote_addrlen == 0) {
+                logf("client connected");
+              }
+              ctx->last_seen = ctx->now;
+              if (!timer_pending(&ctx->idle_timer)) {
+                timer_start(&ctx->timer_wheel, &ctx->idle_timer,
+                            (uint64_t)ctx->args->idle_timeout * 1000);
               }
             }
+            // an announce only moves it if it is new, see
+            // vpn_receive_announce()
+            if (ctx->tun_buf[SHADOWVPN_ZERO_BYTES] != FRAME_ANNOUNCE &&
+                roam_follow(&ctx->remote_addr, &ctx->remote_addrlen,
+                            (struct sockaddr *)&ctx->rx_addr,
+                            ctx->rx_addrlen))
+              STATS_ADD(ctx->stats.roams, 1);
           }
-          if (-1 == tun_write(ctx->tun,
-                              ctx->tun_buf + SHADOWVPN_ZERO_BYTES + usertoken_len,
-                              r - SHADOWVPN_OVERHEAD_LEN - usertoken_len)) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-              // do nothing
-            } else if (errno == EPERM || errno == EINTR || errno == EINVAL) {
-              // just log, do nothing
-              err("write to tun");
-            } else {
-              err("write to tun");
-              break;
-            }
-          }
+          ctx->rx_sock = i;
+          if (-1 == vpn_receive(ctx, ctx->tun_buf + SHADOWVPN_ZERO_BYTES,
+                                r - SHADOWVPN_OVERHEAD_LEN,
+                                sampled ? &t : NULL))
+            break;
         }
       }
     }
+    if (!vpn_hold(ctx, latency_now_ns()) && -1 == vpn_flush(ctx))
+      break;
   }
+  // stop the reader before freeing what it reads
+  metrics_server_stop(&ctx->metrics_server);
+  capture_destroy(&ctx->capture);
   free(ctx->tun_buf);
   free(ctx->udp_buf);
+  free(ctx->frame_buf);
+  free(ctx->fec_buf);
+  free(ctx->compress_buf);
+  free(ctx->frag_buf);
+  peer_destroy(&ctx->peer);
+  if (ctx->nat_ctx) {
+    client_info_t *client, *tmp;
+    HASH_ITER(hh1, ctx->nat_ctx->token_to_clients, client, tmp) {
+      peer_destroy(&client->peer);
+    }
+  }
+  sched_destroy(&ctx->sched);
 
   shell_down(ctx->args);
 
-  close(ctx->tun);
-  for (i = 0; i < ctx->nsock; i++) {
-    close(ctx->socks[i]);
-  }
+  ctx->io_ops->close(ctx);
 
   ctx->running = 0;
 
@@ -618,7 +2411,7 @@ int vpn_stop(vpn_ctx_t *ctx) {
     return -1;
   }
   ctx->running = 0;
-  char buf = 0;
+  char buf = VPN_CONTROL_STOP;
 #ifndef TARGET_WIN32
   if (-1 == write(ctx->control_pipe[1], &buf, 1)) {
     err("write");
@@ -645,3 +2438,19 @@ int vpn_stop(vpn_ctx_t *ctx) {
 #endif
   return 0;
 }
+
+int vpn_request_stats(vpn_ctx_t *ctx) {
+  char buf = VPN_CONTROL_STATS;
+  if (!ctx->running) {
+    return -1;
+  }
+#ifndef TARGET_WIN32
+  if (-1 == write(ctx->control_pipe[1], &buf, 1)) {
+    return -1;
+  }
+  return 0;
+#else
+  // Windows has no signal to ask for stats
+  return -1;
+#endif
+}
@@ -24,12 +24,24 @@
 #include <time.h>
 
 #include "args.h"
+#include "timer.h"
+#include "sched.h"
+#include "stats.h"
+#include "metrics.h"
+#include "latency.h"
+#include "capture.h"
+#include "io.h"
 #include "nat.h"
+#include "path.h"
 
-typedef struct {
+struct vpn_ctx_s {
   int running;
   int nsock;
   int *socks;
+  /* datagrams the kernel dropped on each socket, from SO_RXQ_OVFL */
+  uint64_t *sock_drops;
+  /* DSCP each socket currently sends with, see args->tos */
+  uint8_t *sock_dscp;
   int tun;
   /* select() in winsock doesn't support file handler */
 #ifndef TARGET_WIN32
@@ -42,6 +54,40 @@ typedef struct {
 #endif
   unsigned char *tun_buf;
   unsigned char *udp_buf;
+  /* same size as tun_buf, where frames are built and taken apart */
+  unsigned char *frame_buf;
+  /* same size as tun_buf, where FEC frames are built and rebuilt */
+  unsigned char *fec_buf;
+  /* same size as tun_buf, where plaintexts are compressed and
+     decompressed */
+  unsigned char *compress_buf;
+  /* same size as tun_buf, where pieces of datagrams are built */
+  unsigned char *frag_buf;
+  compress_t compress;
+  /* SHADOWVPN_USERTOKEN_LEN if user_token is set, otherwise 0 */
+  size_t usertoken_len;
+
+  /* client with paths only, socks[i] sends over paths[i] */
+  multipath_t multipath;
+  tw_timer_t probe_timer;
+  /* pings every peer, see args->keepalive_interval */
+  tw_timer_t keepalive_timer;
+  /* socket the datagram being handled came in on, and from where */
+  int rx_sock;
+  struct sockaddr_storage rx_addr;
+  socklen_t rx_addrlen;
+  /* probes the path MTU to every peer, if args->pmtud */
+  tw_timer_t pmtu_timer;
+  /* the smallest pmtu.mtu of all peers */
+  uint32_t pmtu_min;
+  /* client with roaming only, readable when a local address changed, -1
+     if not watched */
+  int addr_fd;
+  /* resends or refreshes the announce of where we are, see roam.h */
+  tw_timer_t roam_timer;
+  /* where probes and their answers are built */
+  unsigned char ctl_buf[SHADOWVPN_ZERO_BYTES + SHADOWVPN_USERTOKEN_LEN +
+                        FRAME_PING_LEN];
 
   /* the address we currently use (client only) */
   struct sockaddr_storage remote_addr;
@@ -50,19 +96,73 @@ typedef struct {
   socklen_t remote_addrlen;
   shadowvpn_args_t *args;
 
+  /* drives every timer, advanced after each select() */
+  timer_wheel_t timer_wheel;
+  /* time of the last select() wakeup, in ms */
+  uint64_t now;
+
+  /* server without NAT only, forget remote_addr when it goes idle */
+  uint64_t last_seen;
+  tw_timer_t idle_timer;
+
   /* server with NAT enabled only */
   nat_ctx_t *nat_ctx;
-} vpn_ctx_t;
+
+  /* packets from tun wait here before they are sent */
+  sched_t sched;
+  /* in ns, since when small packets have been held back for coalescing,
+     0 if they are not */
+  uint64_t hold_since;
+  /* spaces out what is sent, see args->pacing_rate */
+  pacer_t pacer;
+  /* in ns, when the pacer lets queued packets go, 0 if it holds none */
+  uint64_t pace_until;
+  /* with args->pacing_auto, sets the rate from tun_rx_bytes of metrics
+     since the last time */
+  tw_timer_t pace_timer;
+  uint64_t pace_rx_bytes;
+  /* queue of remote_addr, used unless NAT is enabled */
+  sched_queue_t queue;
+  /* remote_addr as a peer, used unless NAT is enabled */
+  peer_t peer;
+  /* counters of remote_addr, server without NAT only */
+  client_stats_t stats;
+
+  /* datapath counters, served by metrics_server if args->metrics is set */
+  metrics_t metrics;
+  metrics_server_t metrics_server;
+  /* per stage latency of sampled packets, see args->latency_sample */
+  latency_t latency;
+  /* packets recorded for troubleshooting, toggled through metrics */
+  capture_t capture;
+
+  /* does all tun and UDP I/O, see io.h */
+  const vpn_io_ops_t *io_ops;
+  void *io_data;
+};
 
 /* return -1 on error. no need to destroy any resource */
 int vpn_ctx_init(vpn_ctx_t *ctx, shadowvpn_args_t *args);
 
+/*
+   same as vpn_ctx_init, but with the in-memory backend instead of a tun
+   device and UDP sockets, see io.h
+*/
+int vpn_ctx_init_mock(vpn_ctx_t *ctx, shadowvpn_args_t *args,
+                      vpn_io_mock_t *mock);
+
 /* return -1 on error. no need to destroy any resource */
 int vpn_run(vpn_ctx_t *ctx);
 
 /* return -1 on error. no need to destroy any resource */
 int vpn_stop(vpn_ctx_t *ctx);
 
+/* ask vpn_run to print user counters to stdout, safe in signal handlers */
+int vpn_request_stats(vpn_ctx_t *ctx);
+
+/* print user counters, only call this from the thread running vpn_run */
+void vpn_dump_stats(vpn_ctx_t *ctx, FILE *out);
+
 /* these low level functions are exposed for Android jni */
 #ifndef TARGET_WIN32
 int vpn_tun_alloc(const char *dev);
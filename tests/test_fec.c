@@ -0,0 +1,169 @@
+/**
+  test_fec.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+   Every loss pattern of up to m shards of a group, for a few k:m, both
+   for full groups and for groups whose parity was sent early with fewer
+   data shards, must deliver each plaintext exactly once. Malformed frames
+   must be refused.
+*/
+
+#include "shadowvpn.h"
+#include "test.h"
+
+#define MAX_LEN 200
+#define TIMEOUT 1000
+
+static unsigned char plaintexts[FEC_MAX_SHARDS][MAX_LEN];
+static size_t plaintext_lens[FEC_MAX_SHARDS];
+static unsigned char frames[FEC_MAX_SHARDS][FEC_HDR_LEN + 2 + MAX_LEN];
+static size_t frame_lens[FEC_MAX_SHARDS];
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng() {
+  rng_state = rng_state * 1103515245 + 12345;
+  return rng_state >> 8;
+}
+
+/* the plaintext data is, or -1 */
+static int find(const unsigned char *data, size_t len, int count) {
+  int i;
+  for (i = 0; i < count; i++) {
+    if (plaintext_lens[i] == len && memcmp(plaintexts[i], data, len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/*
+   send count data shards and m parity with an encoder for k, lose the
+   shards in lost, deliver the rest in order or in reverse
+*/
+static void run_group(fec_encoder_t *enc, fec_decoder_t *dec, int count,
+                      uint64_t lost, int reverse, uint64_t now) {
+  int got[FEC_MAX_SHARDS] = {0};
+  const unsigned char *data;
+  size_t data_len;
+  int i, n = count + enc->m, r;
+
+  for (i = 0; i < count; i++) {
+    size_t j;
+    plaintext_lens[i] = 1 + rng() % MAX_LEN;
+    for (j = 0; j < plaintext_lens[i]; j++)
+      plaintexts[i][j] = rng();
+    frame_lens[i] = fec_encode(enc, plaintexts[i], plaintext_lens[i],
+                               frames[i]);
+  }
+  for (i = 0; i < enc->m; i++)
+    frame_lens[count + i] = fec_parity(enc, i, frames[count + i]);
+  fec_next_group(enc);
+
+  for (i = 0; i < n; i++) {
+    int s = reverse ? n - 1 - i : i;
+    if (lost & (1ULL << s))
+      continue;
+    r = fec_decode(dec, frames[s], frame_lens[s], now, &data, &data_len);
+    CHECK(r >= 0);
+    if (r == 1) {
+      CHECK(s < count);
+      CHECK(find(data, data_len, count) == s);
+      got[s]++;
+    }
+    while (fec_next_recovered(dec, &data, &data_len)) {
+      r = find(data, data_len, count);
+      CHECK(r >= 0);
+      got[r]++;
+    }
+  }
+  for (i = 0; i < count; i++)
+    CHECK(got[i] == 1);
+}
+
+/* k:m with groups of count data shards, every loss of up to m shards */
+static void test_losses(int k, int m, int count) {
+  fec_encoder_t enc;
+  fec_decoder_t dec;
+  uint64_t lost, now = 0;
+  int n = count + m;
+
+  CHECK(fec_encoder_init(&enc, k, m, MAX_LEN) == 0);
+  CHECK(fec_decoder_init(&dec, k, m, MAX_LEN, TIMEOUT) == 0);
+  for (lost = 0; lost < (1ULL << n); lost++) {
+    if (__builtin_popcountll(lost) > m)
+      continue;
+    run_group(&enc, &dec, count, lost, lost & 1, now++);
+  }
+  fec_encoder_destroy(&enc);
+  fec_decoder_destroy(&dec);
+}
+
+static void test_malformed() {
+  fec_encoder_t enc;
+  fec_decoder_t dec;
+  const unsigned char *data;
+  size_t data_len;
+  unsigned char frame[FEC_HDR_LEN + 2 + MAX_LEN + 1];
+  unsigned char big[MAX_LEN + 1] = {0};
+  size_t len;
+
+  CHECK(fec_encoder_init(&enc, 4, 2, MAX_LEN) == 0);
+  CHECK(fec_decoder_init(&dec, 4, 2, MAX_LEN, TIMEOUT) == 0);
+  len = fec_encode(&enc, plaintexts[0], 10, frame);
+
+  CHECK(fec_decode(&dec, frame, FEC_HDR_LEN, 0, &data, &data_len) == -1);
+  // k of 0, larger than the decoder's, m other than the decoder's
+  frame[4] = 0;
+  CHECK(fec_decode(&dec, frame, len, 0, &data, &data_len) == -1);
+  frame[4] = 5;
+  CHECK(fec_decode(&dec, frame, len, 0, &data, &data_len) == -1);
+  frame[4] = 4;
+  frame[5] = 3;
+  CHECK(fec_decode(&dec, frame, len, 0, &data, &data_len) == -1);
+  frame[5] = 2;
+  // index past k + m
+  frame[3] = 6;
+  CHECK(fec_decode(&dec, frame, len, 0, &data, &data_len) == -1);
+  frame[3] = 0;
+  CHECK(fec_decode(&dec, frame, len, 0, &data, &data_len) == 1);
+
+  // data and parity longer than a shard
+  fec_next_group(&enc);
+  len = fec_encode(&enc, big, MAX_LEN + 1, frame);
+  CHECK(fec_decode(&dec, frame, len, 0, &data, &data_len) == -1);
+  len = fec_parity(&enc, 0, frame);
+  CHECK(fec_decode(&dec, frame, len, 0, &data, &data_len) == -1);
+
+  fec_encoder_destroy(&enc);
+  fec_decoder_destroy(&dec);
+}
+
+int main() {
+  test_losses(1, 1, 1);
+  test_losses(4, 2, 4);
+  test_losses(10, 4, 10);
+  test_losses(20, 3, 20);
+  // parity sent early, with k lowered to what was sent
+  test_losses(10, 4, 3);
+  test_losses(20, 3, 7);
+  test_losses(4, 2, 1);
+  test_malformed();
+  return 0;
+}
@@ -0,0 +1,226 @@
+/**
+  test_frag.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+   Reassembly of FRAME_FRAGMENT frames: pieces out of order, duplicated,
+   evicted for newer plaintexts, and frames that do not fit their slot or
+   are malformed.
+*/
+
+#include "shadowvpn.h"
+#include "test.h"
+
+#define TOKEN_LEN SHADOWVPN_USERTOKEN_LEN
+#define MAX_LEN 1500
+#define ROOM 300
+
+static const unsigned char token[TOKEN_LEN] = "testtokn";
+static unsigned char plaintext[MAX_LEN];
+static unsigned char frames[FRAG_MAX_PIECES][ROOM];
+static size_t frame_lens[FRAG_MAX_PIECES];
+
+/* cut len bytes of plaintext into frames, return the count */
+static int cut(uint16_t id, size_t len) {
+  int i, count = frag_count(len, ROOM);
+  CHECK(count >= 2);
+  for (i = 0; i < count; i++) {
+    frame_lens[i] = frag_piece(frames[i], id, i, count, plaintext, len);
+    CHECK(frame_lens[i] <= ROOM);
+  }
+  return count;
+}
+
+static int add(frag_rx_t *rx, int i, uint64_t now, unsigned char **out,
+               size_t *out_len, int *dropped) {
+  return frag_add(rx, token, frames[i], frame_lens[i], now, out, out_len,
+                  dropped);
+}
+
+static void check_out(unsigned char *out, size_t out_len, size_t len) {
+  CHECK(out_len == TOKEN_LEN + len);
+  CHECK(memcmp(out, token, TOKEN_LEN) == 0);
+  CHECK(memcmp(out + TOKEN_LEN, plaintext, len) == 0);
+}
+
+static void test_count() {
+  CHECK(frag_count(ROOM, ROOM) == 1);
+  CHECK(frag_count(ROOM + 1, ROOM) == 2);
+  CHECK(frag_count(100, FRAG_HDR_LEN) == 0);
+  CHECK(frag_count((ROOM - FRAG_HDR_LEN) * FRAG_MAX_PIECES, ROOM) ==
+        FRAG_MAX_PIECES);
+  CHECK(frag_count((ROOM - FRAG_HDR_LEN) * FRAG_MAX_PIECES + 1, ROOM) == 0);
+}
+
+static void test_reorder() {
+  frag_rx_t rx;
+  unsigned char *out;
+  size_t out_len, len;
+  int i, count, dropped = 0;
+
+  CHECK(frag_rx_init(&rx, MAX_LEN, TOKEN_LEN) == 0);
+  // every length cut into a given count, including a short last piece
+  for (len = ROOM + 1; len <= MAX_LEN; len += 97) {
+    count = cut(len & 0xffff, len);
+    for (i = count - 1; i > 0; i--)
+      CHECK(add(&rx, i, 0, &out, &out_len, &dropped) == 0);
+    CHECK(add(&rx, 0, 0, &out, &out_len, &dropped) == 1);
+    check_out(out, out_len, len);
+  }
+  CHECK(dropped == 0);
+  frag_rx_destroy(&rx);
+}
+
+static void test_duplicate() {
+  frag_rx_t rx;
+  unsigned char *out;
+  size_t out_len;
+  int i, count, dropped = 0;
+
+  CHECK(frag_rx_init(&rx, MAX_LEN, TOKEN_LEN) == 0);
+  count = cut(1, 1000);
+  for (i = 0; i < count - 1; i++) {
+    CHECK(add(&rx, i, 0, &out, &out_len, &dropped) == 0);
+    CHECK(add(&rx, i, 0, &out, &out_len, &dropped) == 0);
+  }
+  CHECK(add(&rx, count - 1, 0, &out, &out_len, &dropped) == 1);
+  check_out(out, out_len, 1000);
+  // a late copy starts over instead of completing the plaintext again
+  CHECK(add(&rx, count - 1, 0, &out, &out_len, &dropped) == 0);
+  CHECK(dropped == 0);
+  frag_rx_destroy(&rx);
+}
+
+static void test_evict() {
+  frag_rx_t rx;
+  unsigned char *out;
+  size_t out_len;
+  uint64_t next;
+  int i, count, dropped = 0;
+
+  CHECK(frag_rx_init(&rx, MAX_LEN, TOKEN_LEN) == 0);
+  // one more plaintext than there are slots, id 0 is the oldest
+  for (i = 0; i <= FRAG_RX_SLOTS; i++) {
+    cut(i, 1000);
+    CHECK(add(&rx, 0, i, &out, &out_len, &dropped) == 0);
+  }
+  CHECK(dropped == 1);
+
+  // the rest of id 0 can not complete it, its first piece is gone
+  count = cut(0, 1000);
+  for (i = 1; i < count; i++)
+    CHECK(add(&rx, i, FRAG_RX_SLOTS + 1, &out, &out_len, &dropped) == 0);
+  CHECK(dropped == 2);
+
+  // id 1 was evicted for it, id 2 is still there
+  count = cut(2, 1000);
+  for (i = 1; i < count - 1; i++)
+    CHECK(add(&rx, i, FRAG_RX_SLOTS + 1, &out, &out_len, &dropped) == 0);
+  CHECK(add(&rx, count - 1, FRAG_RX_SLOTS + 1, &out, &out_len, &dropped) ==
+        1);
+  check_out(out, out_len, 1000);
+
+  // ids 0, 3 and 4 are left, id 3 expires first
+  CHECK(frag_expire(&rx, FRAG_TIMEOUT, &next) == 0);
+  CHECK(next == 3 + FRAG_TIMEOUT);
+  CHECK(frag_expire(&rx, FRAG_TIMEOUT + FRAG_RX_SLOTS + 1, &next) == 3);
+  CHECK(next == 0);
+  frag_rx_destroy(&rx);
+}
+
+static void test_count_mismatch() {
+  frag_rx_t rx;
+  unsigned char *out;
+  size_t out_len;
+  int i, count, dropped = 0;
+
+  CHECK(frag_rx_init(&rx, MAX_LEN, TOKEN_LEN) == 0);
+  count = cut(7, 1400);
+  CHECK(add(&rx, 0, 0, &out, &out_len, &dropped) == 0);
+
+  // the same id for a plaintext cut into fewer pieces replaces it
+  CHECK(cut(7, 500) < count);
+  CHECK(add(&rx, 0, 0, &out, &out_len, &dropped) == 0);
+  CHECK(dropped == 1);
+  CHECK(add(&rx, 1, 0, &out, &out_len, &dropped) == 1);
+  check_out(out, out_len, 500);
+
+  // and pieces of the first one do not complete anything
+  count = cut(7, 1400);
+  for (i = 1; i < count; i++)
+    CHECK(add(&rx, i, 0, &out, &out_len, &dropped) == 0);
+  CHECK(dropped == 1);
+  frag_rx_destroy(&rx);
+}
+
+static void test_malformed() {
+  frag_rx_t rx;
+  unsigned char *out;
+  unsigned char frame[ROOM];
+  size_t out_len, len;
+  int dropped = 0;
+
+  CHECK(frag_rx_init(&rx, MAX_LEN, TOKEN_LEN) == 0);
+  cut(9, 1000);
+  len = frame_lens[1];
+
+  CHECK(frag_add(&rx, token, frames[1], FRAG_HDR_LEN, 0, &out, &out_len,
+                 &dropped) == -1);
+  // a piece shorter or longer than its index says
+  CHECK(frag_add(&rx, token, frames[1], len - 1, 0, &out, &out_len,
+                 &dropped) == -1);
+  memcpy(frame, frames[1], len);
+  CHECK(frag_add(&rx, token, frame, len + 1, 0, &out, &out_len,
+                 &dropped) == -1);
+  // count of 1 or more than FRAG_MAX_PIECES
+  frame[4] = 1;
+  CHECK(frag_add(&rx, token, frame, len, 0, &out, &out_len, &dropped) == -1);
+  frame[4] = FRAG_MAX_PIECES + 1;
+  CHECK(frag_add(&rx, token, frame, len, 0, &out, &out_len, &dropped) == -1);
+  // index past count
+  memcpy(frame, frames[1], len);
+  frame[3] = frame[4];
+  CHECK(frag_add(&rx, token, frame, len, 0, &out, &out_len, &dropped) == -1);
+  // a plaintext longer than the receiver takes
+  memcpy(frame, frames[1], len);
+  frame[5] = (MAX_LEN + 1) >> 8;
+  frame[6] = (MAX_LEN + 1) & 0xff;
+  CHECK(frag_add(&rx, token, frame, len, 0, &out, &out_len, &dropped) == -1);
+  // a plaintext shorter than its count
+  memcpy(frame, frames[1], len);
+  frame[5] = 0;
+  frame[6] = 1;
+  CHECK(frag_add(&rx, token, frame, len, 0, &out, &out_len, &dropped) == -1);
+
+  CHECK(dropped == 0);
+  frag_rx_destroy(&rx);
+}
+
+int main() {
+  size_t i;
+  for (i = 0; i < sizeof(plaintext); i++)
+    plaintext[i] = i * 7 + 3;
+  test_count();
+  test_reorder();
+  test_duplicate();
+  test_evict();
+  test_count_mismatch();
+  test_malformed();
+  return 0;
+}
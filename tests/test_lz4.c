@@ -0,0 +1,139 @@
+/**
+  test_lz4.c
+
+  Copyright (C) 2015 clowwindy
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+   LZ4 frames must round trip, and truncated frames, offsets before the
+   start of the output and lengths past either end must be refused.
+*/
+
+#include "shadowvpn.h"
+#include "test.h"
+
+#define CAP 1500
+
+static const char json[] =
+  "{\"temp\": 23.5, \"sensor\": \"abc\", \"ts\": 1700000000}";
+
+static uint32_t rng_state = 3;
+
+static uint32_t rng() {
+  rng_state = rng_state * 1103515245 + 12345;
+  return rng_state >> 8;
+}
+
+/* frame a hand written LZ4 block, return the frame length */
+static size_t frame(unsigned char *out, size_t orig, const char *block,
+                    size_t block_len) {
+  out[0] = FRAME_COMPRESSED;
+  out[1] = orig >> 8;
+  out[2] = orig & 0xff;
+  memcpy(out + COMPRESS_HDR_LEN, block, block_len);
+  return COMPRESS_HDR_LEN + block_len;
+}
+
+static void test_round_trip() {
+  static compress_t c;
+  compress_class_t cls;
+  unsigned char in[CAP], fr[CAP], out[CAP];
+  size_t len, n, j;
+  int i, kind, compressed = 0;
+
+  for (i = 0; i < 3000; i++) {
+    len = 1 + rng() % CAP;
+    kind = i % 3;
+    for (j = 0; j < len; j++) {
+      if (kind == 0)
+        in[j] = json[j % (sizeof(json) - 1)];
+      else if (kind == 1)
+        in[j] = rng() % 4;
+      else
+        in[j] = j > 8 && rng() % 8 ? in[j - 1 - rng() % 8] : rng();
+    }
+    bzero(&cls, sizeof(cls));
+    n = compress_frame(&c, &cls, in, len, fr);
+    if (n == 0)
+      continue;
+    compressed++;
+    CHECK(n < len);
+    CHECK(decompress_frame(fr, n, out, CAP) == (ssize_t)len);
+    CHECK(memcmp(in, out, len) == 0);
+    // the plaintext does not fit
+    CHECK(decompress_frame(fr, n, out, len - 1) == -1);
+    // every truncation is refused
+    for (j = 0; j < n; j++)
+      CHECK(decompress_frame(fr, j, out, CAP) == -1);
+    // a flipped bit may decode to anything, but within out
+    fr[COMPRESS_HDR_LEN + rng() % (n - COMPRESS_HDR_LEN)] ^= 1 << (rng() % 8);
+    CHECK(decompress_frame(fr, n, out, CAP) <= (ssize_t)len);
+  }
+  CHECK(compressed > 1500);
+
+  // random bytes are not worth it
+  for (j = 0; j < CAP; j++)
+    in[j] = rng();
+  bzero(&cls, sizeof(cls));
+  CHECK(compress_frame(&c, &cls, in, CAP, fr) == 0);
+}
+
+static void test_malformed() {
+  unsigned char fr[64], out[CAP];
+  size_t n;
+
+  // 4 literals, a match of 8 at offset 4, then 5 literals
+  n = frame(fr, 17, "\x44" "abcd" "\x04\x00" "\x50" "12345", 13);
+  CHECK(decompress_frame(fr, n, out, CAP) == 17);
+  CHECK(memcmp(out, "abcdabcdabcd12345", 17) == 0);
+  // output longer or shorter than the header says
+  n = frame(fr, 16, "\x44" "abcd" "\x04\x00" "\x50" "12345", 13);
+  CHECK(decompress_frame(fr, n, out, CAP) == -1);
+  n = frame(fr, 18, "\x44" "abcd" "\x04\x00" "\x50" "12345", 13);
+  CHECK(decompress_frame(fr, n, out, CAP) == -1);
+  // a match running past the output
+  n = frame(fr, 10, "\x44" "abcd" "\x04\x00" "\x50" "12345", 13);
+  CHECK(decompress_frame(fr, n, out, CAP) == -1);
+  // offsets of 0 and before the start of the output
+  n = frame(fr, 17, "\x44" "abcd" "\x00\x00" "\x50" "12345", 13);
+  CHECK(decompress_frame(fr, n, out, CAP) == -1);
+  n = frame(fr, 17, "\x44" "abcd" "\x05\x00" "\x50" "12345", 13);
+  CHECK(decompress_frame(fr, n, out, CAP) == -1);
+  n = frame(fr, 17, "\x44" "abcd" "\xff\xff" "\x50" "12345", 13);
+  CHECK(decompress_frame(fr, n, out, CAP) == -1);
+  // literals and offset cut short
+  n = frame(fr, 5, "\x50" "123", 4);
+  CHECK(decompress_frame(fr, n, out, CAP) == -1);
+  n = frame(fr, 17, "\x44" "abcd" "\x04", 6);
+  CHECK(decompress_frame(fr, n, out, CAP) == -1);
+  // extra length bytes that never end, or add up past the output
+  n = frame(fr, 300, "\xf0" "\xff", 2);
+  CHECK(decompress_frame(fr, n, out, CAP) == -1);
+  n = frame(fr, 20, "\xf0" "\xff\xff\xff\x00" "abcd", 9);
+  CHECK(decompress_frame(fr, n, out, CAP) == -1);
+  // no block, or a plaintext larger than out
+  n = frame(fr, 17, "", 0);
+  CHECK(decompress_frame(fr, n, out, CAP) == -1);
+  n = frame(fr, 17, "\x44" "abcd" "\x04\x00" "\x50" "12345", 13);
+  CHECK(decompress_frame(fr, n, out, 16) == -1);
+}
+
+int main() {
+  test_round_trip();
+  test_malformed();
+  return 0;
+}